@@ -0,0 +1,557 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "main.cpp"
+#include "shared_tree.hpp"
+
+namespace {
+using Clock = std::chrono::steady_clock;
+
+double nanosPerOp(Clock::time_point start, Clock::time_point end, std::size_t ops) {
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count()) /
+           static_cast<double>(ops);
+}
+
+std::vector<std::int64_t> randomKeys(std::size_t count, std::uint32_t seed) {
+    std::mt19937_64 rng(seed);
+    std::vector<std::int64_t> keys(count);
+    for (auto& key : keys) key = static_cast<std::int64_t>(rng() >> 1);
+    return keys;
+}
+
+template <std::size_t Order>
+void benchInt64(const char* label, const std::vector<std::int64_t>& keys, BPlusTreeOptions options = {}) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree(options);
+    auto start = Clock::now();
+    for (std::int64_t key : keys) tree.insert(key, key);
+    auto mid = Clock::now();
+    std::int64_t checksum = 0;
+    for (std::int64_t key : keys) checksum += *tree.find(key);
+    auto end = Clock::now();
+    const BPlusTreeStats stats = tree.stats();
+    std::cout << label << " order=" << Order << " insert " << nanosPerOp(start, mid, keys.size())
+              << " ns/op, find " << nanosPerOp(mid, end, keys.size()) << " ns/op, leaf fill " << stats.leaf_fill
+              << ", height " << stats.height << " (checksum " << checksum << ")\n";
+}
+
+// Counts the calling thread's dTLB load misses in user space. value() is -1 where perf events are
+// unavailable (non-Linux, perf_event_paranoid, virtual machines without a PMU).
+class DtlbMissCounter {
+public:
+    DtlbMissCounter() {
+#ifdef __linux__
+        perf_event_attr attr{};
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd_ = static_cast<int>(::syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+        if (fd_ >= 0) ::ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    DtlbMissCounter(const DtlbMissCounter&) = delete;
+    DtlbMissCounter& operator=(const DtlbMissCounter&) = delete;
+    ~DtlbMissCounter() {
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    long long value() const {
+        long long count = -1;
+        if (fd_ < 0 || ::read(fd_, &count, sizeof(count)) != static_cast<ssize_t>(sizeof(count))) return -1;
+        return count;
+    }
+
+private:
+    int fd_ = -1;
+};
+
+// Random lookups on a large tree, reporting dTLB misses per find next to the latency.
+template <std::size_t Order>
+void benchTlb(const char* label, const std::vector<std::int64_t>& keys, BPlusTreeOptions options = {}) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree(options);
+    for (std::int64_t key : keys) tree.insert(key, key);
+    std::vector<std::int64_t> probes(keys);
+    std::shuffle(probes.begin(), probes.end(), std::mt19937_64(7));
+    std::int64_t checksum = 0;
+    DtlbMissCounter counter;
+    const long long misses_before = counter.value();
+    auto start = Clock::now();
+    for (std::int64_t key : probes) checksum += *tree.find(key);
+    auto end = Clock::now();
+    const long long misses = counter.value() - misses_before;
+    const BPlusTreeStats stats = tree.stats();
+    std::cout << label << " order=" << Order << " find " << nanosPerOp(start, end, probes.size()) << " ns/op, dTLB misses/find ";
+    if (misses_before < 0) {
+        std::cout << "n/a";
+    } else {
+        std::cout << static_cast<double>(misses) / static_cast<double>(probes.size());
+    }
+    std::cout << ", huge page bytes " << stats.huge_page_bytes << "/" << stats.arena_bytes << " (checksum " << checksum << ")\n";
+}
+
+// Full scans on their own and next to an inserting thread, plus that thread's insert latency.
+template <std::size_t Order>
+void benchScan(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::size_t i = 0; i < keys.size(); i += 2) tree.insert(keys[i], keys[i]);
+    std::int64_t checksum = 0;
+    std::size_t visited = 0;
+    auto start = Clock::now();
+    tree.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+              [&](std::int64_t key, std::int64_t value) {
+                  checksum += key ^ value;
+                  ++visited;
+              });
+    auto end = Clock::now();
+    std::cout << label << " order=" << Order << " scan " << nanosPerOp(start, end, visited) << " ns/entry";
+
+    std::atomic<bool> inserting{true};
+    std::size_t concurrent_visited = 0;
+    std::thread scanner([&] {
+        while (inserting) {
+            tree.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+                      [&](std::int64_t, std::int64_t) { ++concurrent_visited; });
+        }
+    });
+    start = Clock::now();
+    for (std::size_t i = 1; i < keys.size(); i += 2) tree.insert(keys[i], keys[i]);
+    end = Clock::now();
+    inserting = false;
+    scanner.join();
+    std::cout << ", insert next to scans " << nanosPerOp(start, end, keys.size() / 2) << " ns/op (" << concurrent_visited
+              << " entries scanned meanwhile, checksum " << checksum << ")\n";
+}
+
+// parallel_reduce summing a CPU-bound per-entry function, per thread count.
+template <std::size_t Order>
+void benchParallelReduce(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::int64_t key : keys) tree.insert(key, key);
+    const auto lo = std::numeric_limits<std::int64_t>::min();
+    const auto hi = std::numeric_limits<std::int64_t>::max();
+    for (unsigned threads : {1u, 2u, 4u, 8u}) {
+        auto start = Clock::now();
+        const std::uint64_t checksum = tree.parallel_reduce(
+            lo, hi, std::uint64_t{0},
+            [](std::uint64_t acc, std::int64_t key, std::int64_t) {
+                auto mixed = static_cast<std::uint64_t>(key);
+                for (int round = 0; round < 16; ++round) mixed = (mixed ^ (mixed >> 29)) * 0xBF58476D1CE4E5B9ull;
+                return acc + mixed;
+            },
+            [](std::uint64_t left, std::uint64_t right) { return left + right; }, threads);
+        auto end = Clock::now();
+        std::cout << label << " order=" << Order << " parallel_reduce threads=" << threads << " "
+                  << nanosPerOp(start, end, keys.size()) << " ns/entry (checksum " << checksum << ")\n";
+    }
+}
+
+template <std::size_t Order>
+void benchFindBatch(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::int64_t key : keys) tree.insert(key, key);
+    std::vector<std::int64_t> probes = keys;
+    std::shuffle(probes.begin(), probes.end(), std::mt19937_64(44));
+    auto start = Clock::now();
+    std::size_t hits = 0;
+    for (std::int64_t key : probes) hits += tree.find(key) ? 1 : 0;
+    auto end = Clock::now();
+    std::cout << label << " order=" << Order << " find loop " << nanosPerOp(start, end, probes.size()) << " ns/key (hits "
+              << hits << ")\n";
+    start = Clock::now();
+    hits = 0;
+    for (const auto& value : tree.find_batch(probes)) hits += value ? 1 : 0;
+    end = Clock::now();
+    std::cout << label << " order=" << Order << " find_batch " << nanosPerOp(start, end, probes.size()) << " ns/key (hits "
+              << hits << ")\n";
+    for (unsigned threads : {1u, 4u}) {
+        start = Clock::now();
+        hits = 0;
+        for (const auto& value : tree.find_batch_parallel(probes, threads)) hits += value ? 1 : 0;
+        end = Clock::now();
+        std::cout << label << " order=" << Order << " find_batch_parallel threads=" << threads << " "
+                  << nanosPerOp(start, end, probes.size()) << " ns/key (hits " << hits << ")\n";
+    }
+}
+
+template <std::size_t Order>
+void benchMergeFrom(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> merged;
+    BPlusTree<std::int64_t, std::int64_t, Order> inserted;
+    for (std::int64_t key : keys) {
+        merged.insert(key, key);
+        inserted.insert(key, key);
+    }
+    // A 1% delta: half updates of existing keys, half new keys.
+    const std::vector<std::int64_t> fresh = randomKeys(keys.size() / 200, 45);
+    BPlusTree<std::int64_t, std::int64_t, Order> delta;
+    for (std::size_t i = 0; i < fresh.size(); ++i) {
+        delta.insert(fresh[i], 1);
+        delta.insert(keys[i * 199 % keys.size()], 1);
+    }
+    auto start = Clock::now();
+    merged.merge_from(delta);
+    auto mid = Clock::now();
+    delta.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+               [&](std::int64_t key, std::int64_t value) { inserted.insert(key, value); });
+    auto end = Clock::now();
+    std::cout << label << " order=" << Order << " merge_from " << delta.size() << " entries "
+              << std::chrono::duration<double, std::micro>(mid - start).count() << " us, insert loop "
+              << std::chrono::duration<double, std::micro>(end - mid).count() << " us (sizes " << merged.size() << " "
+              << inserted.size() << ")\n";
+}
+
+template <std::size_t Order>
+void benchWriteBatch(const char* label, const std::vector<std::int64_t>& keys) {
+    // Batches of 64 writes, either to random keys (half of them existing) or to two runs of adjacent
+    // keys, like the rows of one entity.
+    constexpr std::size_t kBatch = 64;
+    const std::vector<std::int64_t> bases = randomKeys(keys.size() / 10 / kBatch, 72);
+    for (bool adjacent : {false, true}) {
+        BPlusTree<std::int64_t, std::int64_t, Order> batched;
+        BPlusTree<std::int64_t, std::int64_t, Order> looped;
+        for (std::int64_t key : keys) {
+            batched.insert(key, key);
+            looped.insert(key, key);
+        }
+        std::vector<std::int64_t> writes;
+        for (std::size_t b = 0; b < bases.size(); ++b) {
+            for (std::size_t i = 0; i < kBatch; ++i) {
+                const std::size_t n = b * kBatch + i;
+                if (adjacent) {
+                    writes.push_back(i % 2 == 0 ? bases[b] / 2 + static_cast<std::int64_t>(i) : keys[b] + static_cast<std::int64_t>(i));
+                } else {
+                    writes.push_back(i % 2 == 0 ? keys[n * 7 % keys.size()] : bases[(n * 31) % bases.size()] ^ static_cast<std::int64_t>(n));
+                }
+            }
+        }
+        auto start = Clock::now();
+        for (std::size_t first = 0; first < writes.size(); first += kBatch) {
+            typename decltype(batched)::WriteBatch batch;
+            for (std::size_t i = first; i < first + kBatch; ++i) batch.put(writes[i], 1);
+            batched.apply(std::move(batch));
+        }
+        auto mid = Clock::now();
+        for (std::int64_t key : writes) looped.insert(key, 1);
+        auto end = Clock::now();
+        std::cout << label << (adjacent ? "/adjacent" : "") << " order=" << Order << " apply " << kBatch << "-key batches "
+                  << nanosPerOp(start, mid, writes.size()) << " ns/key, insert loop " << nanosPerOp(mid, end, writes.size())
+                  << " ns/key (sizes " << batched.size() << " " << looped.size() << ")\n";
+    }
+}
+
+template <std::size_t Order>
+void benchTransactions(const char* label, const std::vector<std::int64_t>& keys) {
+    // Two-key read-modify-write transfers from two threads, against the same work under one mutex.
+    constexpr std::size_t kThreads = 2;
+    BPlusTree<std::int64_t, std::int64_t, Order> optimistic;
+    BPlusTree<std::int64_t, std::int64_t, Order> locked;
+    for (std::int64_t key : keys) {
+        optimistic.insert(key, 0);
+        locked.insert(key, 0);
+    }
+    const std::size_t rounds = keys.size() / 10 / kThreads;
+    std::atomic<std::size_t> aborts{0};
+    auto run = [&](auto&& transfer) {
+        std::vector<std::thread> threads;
+        for (std::size_t t = 0; t < kThreads; ++t) {
+            threads.emplace_back([&, t] {
+                for (std::size_t i = 0; i < rounds; ++i) {
+                    const std::size_t n = (t * rounds + i) * 7;
+                    transfer(keys[n % keys.size()], keys[(n * 31 + 1) % keys.size()]);
+                }
+            });
+        }
+        for (auto& thread : threads) thread.join();
+    };
+    auto start = Clock::now();
+    run([&](std::int64_t from, std::int64_t to) {
+        for (auto txn = optimistic.begin();; ++aborts) {
+            txn.put(from, *txn.get(from) - 1);
+            txn.put(to, *txn.get(to) + 1);
+            if (txn.commit()) break;
+        }
+    });
+    auto mid = Clock::now();
+    std::mutex mutex;
+    run([&](std::int64_t from, std::int64_t to) {
+        std::lock_guard<std::mutex> guard(mutex);
+        locked.insert_or_assign(from, *locked.find(from) - 1);
+        locked.insert_or_assign(to, *locked.find(to) + 1);
+    });
+    auto end = Clock::now();
+    std::cout << label << " order=" << Order << " transaction transfer " << nanosPerOp(start, mid, rounds * kThreads)
+              << " ns/op (" << aborts.load() << " aborts), mutex transfer " << nanosPerOp(mid, end, rounds * kThreads)
+              << " ns/op\n";
+}
+
+template <std::size_t Order>
+void benchSplitJoin(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::int64_t key : keys) tree.insert(key, key);
+    const std::int64_t median = std::numeric_limits<std::int64_t>::max() / 2;
+    auto start = Clock::now();
+    BPlusTree<std::int64_t, std::int64_t, Order> upper = tree.split_at(median);
+    auto mid = Clock::now();
+    tree.join(upper);
+    auto end = Clock::now();
+    // What rebalancing used to cost: re-inserting the upper half into a fresh tree.
+    BPlusTree<std::int64_t, std::int64_t, Order> copy;
+    auto copy_start = Clock::now();
+    tree.scan(median, std::numeric_limits<std::int64_t>::max(), [&](std::int64_t key, std::int64_t value) { copy.insert(key, value); });
+    auto copy_end = Clock::now();
+    std::cout << label << " order=" << Order << " split_at " << std::chrono::duration<double, std::micro>(mid - start).count()
+              << " us, join " << std::chrono::duration<double, std::micro>(end - mid).count() << " us, copying "
+              << copy.size() << " entries " << std::chrono::duration<double, std::micro>(copy_end - copy_start).count()
+              << " us\n";
+}
+
+template <std::size_t Order>
+void benchEraseRange(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> ranged;
+    BPlusTree<std::int64_t, std::int64_t, Order> looped;
+    for (std::int64_t key : keys) {
+        ranged.insert(key, key);
+        looped.insert(key, key);
+    }
+    // Expire the lowest quarter of the key space.
+    const std::int64_t lo = 0;
+    const std::int64_t hi = std::numeric_limits<std::int64_t>::max() / 4;
+    auto start = Clock::now();
+    const std::size_t erased = ranged.erase_range(lo, hi);
+    auto mid = Clock::now();
+    std::vector<std::int64_t> expired;
+    looped.scan(lo, hi, [&](std::int64_t key, std::int64_t) { expired.push_back(key); });
+    auto loop_start = Clock::now();
+    for (std::int64_t key : expired) looped.erase(key);
+    auto end = Clock::now();
+    std::cout << label << " order=" << Order << " erase_range " << erased << " entries "
+              << std::chrono::duration<double, std::micro>(mid - start).count() << " us, erase loop "
+              << std::chrono::duration<double, std::micro>(end - loop_start).count() << " us\n";
+}
+
+template <std::size_t Order>
+void benchFreeze(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::int64_t key : keys) tree.insert(key, key);
+    std::vector<std::int64_t> probes = keys;
+    std::shuffle(probes.begin(), probes.end(), std::mt19937_64(46));
+    auto lookups = [&] {
+        std::size_t hits = 0;
+        auto start = Clock::now();
+        for (std::int64_t key : probes) hits += tree.find(key) ? 1 : 0;
+        return std::make_pair(nanosPerOp(start, Clock::now(), probes.size()), hits);
+    };
+    const std::size_t plain_bytes = tree.stats().node_bytes;
+    const auto plain = lookups();
+    tree.freeze();
+    const std::size_t frozen_bytes = tree.stats().node_bytes;
+    const auto frozen = lookups();
+    std::cout << label << " order=" << Order << " freeze node bytes " << plain_bytes << " -> " << frozen_bytes
+              << ", find " << plain.first << " -> " << frozen.first << " ns/op (hits " << plain.second << " " << frozen.second
+              << ")\n";
+}
+
+template <std::size_t Order>
+void benchSnapshot(const char* label, const std::vector<std::int64_t>& keys) {
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::int64_t key : keys) tree.insert(key, key);
+    std::stringstream stream;
+    auto start = Clock::now();
+    tree.serialize(stream);
+    auto mid = Clock::now();
+    auto loaded = BPlusTree<std::int64_t, std::int64_t, Order>::deserialize(stream);
+    auto end = Clock::now();
+    // What loading cost without a bulk build: one insert per entry, in key order.
+    BPlusTree<std::int64_t, std::int64_t, Order> inserted;
+    auto insert_start = Clock::now();
+    tree.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+              [&](std::int64_t key, std::int64_t value) { inserted.insert(key, value); });
+    auto insert_end = Clock::now();
+    const double megabytes = static_cast<double>(stream.str().size()) / (1 << 20);
+    std::cout << label << " order=" << Order << " snapshot " << megabytes << " MiB ("
+              << static_cast<double>(stream.str().size()) / static_cast<double>(tree.size()) << " B/entry), serialize "
+              << megabytes / std::chrono::duration<double>(mid - start).count() << " MiB/s, deserialize "
+              << megabytes / std::chrono::duration<double>(end - mid).count() << " MiB/s ("
+              << nanosPerOp(mid, end, loaded.size()) << " ns/entry), insert loop "
+              << nanosPerOp(insert_start, insert_end, inserted.size()) << " ns/entry\n";
+}
+
+template <std::size_t Order>
+void benchCursor(const char* label, const std::vector<std::int64_t>& keys) {
+    // Lookups that drift through the key space in small steps: find() from the root each time,
+    // a cursor's finger search, and a scan over the same span for reference.
+    BPlusTree<std::int64_t, std::int64_t, Order> tree;
+    for (std::int64_t key : keys) tree.insert(key, key);
+    std::vector<std::int64_t> sorted = keys;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::int64_t> probes;
+    std::mt19937_64 rng(75);
+    for (std::size_t i = 0, at = 0; i < keys.size(); ++i) {
+        at = std::min(sorted.size() - 1, at + rng() % 4);
+        probes.push_back(sorted[at]);
+    }
+    std::int64_t checksum = 0;
+    auto start = Clock::now();
+    for (std::int64_t key : probes) checksum += *tree.find(key);
+    auto mid = Clock::now();
+    auto cursor = tree.cursor();
+    for (std::int64_t key : probes) checksum -= *cursor.find(key);
+    auto end = Clock::now();
+    std::size_t scanned = 0;
+    tree.scan(probes.front(), probes.back(), [&](std::int64_t, std::int64_t value) {
+        checksum += value;
+        ++scanned;
+    });
+    auto scan_end = Clock::now();
+    std::cout << label << " order=" << Order << " nearby find " << nanosPerOp(start, mid, probes.size()) << " ns/op, cursor find "
+              << nanosPerOp(mid, end, probes.size()) << " ns/op, scan " << nanosPerOp(end, scan_end, scanned)
+              << " ns/entry (checksum " << checksum << ")\n";
+}
+
+template <std::size_t Order>
+void benchSharedTree(const char* label, const std::vector<std::int64_t>& keys) {
+    // Copy-on-write inserts and lock-free lookups in a shared memory segment, against the in-process tree.
+    const std::string name = "/b_plus_tree_bench_" + std::to_string(::getpid());
+    SharedBPlusTree<std::int64_t, std::int64_t, Order>::remove(name);
+    SharedBPlusTree<std::int64_t, std::int64_t, Order> shared(name, keys.size() / (Order / 2) * 2);
+    SharedBPlusTree<std::int64_t, std::int64_t, Order>::remove(name);
+    BPlusTree<std::int64_t, std::int64_t, Order> local;
+    auto start = Clock::now();
+    for (std::int64_t key : keys) shared.insert(key, key);
+    auto mid = Clock::now();
+    std::int64_t checksum = 0;
+    for (std::int64_t key : keys) checksum += *shared.find(key);
+    auto end = Clock::now();
+    for (std::int64_t key : keys) local.insert(key, key);
+    auto local_start = Clock::now();
+    for (std::int64_t key : keys) checksum -= *local.find(key);
+    auto local_end = Clock::now();
+    std::cout << label << " order=" << Order << " shared insert " << nanosPerOp(start, mid, keys.size()) << " ns/op, find "
+              << nanosPerOp(mid, end, keys.size()) << " ns/op, local find " << nanosPerOp(local_start, local_end, keys.size())
+              << " ns/op (checksum " << checksum << ")\n";
+}
+
+template <std::size_t Order>
+void benchStringValues(const char* label, const std::vector<std::int64_t>& keys, BPlusTreeOptions options = {}) {
+    BPlusTree<std::int64_t, std::string, Order> tree(options);
+    const std::string payload(48, 'v');
+    auto start = Clock::now();
+    for (std::int64_t key : keys) tree.insert(key, payload);
+    auto mid = Clock::now();
+    std::size_t checksum = 0;
+    for (std::int64_t key : keys) checksum += tree.find(key)->size();
+    auto end = Clock::now();
+    std::cout << label << " order=" << Order << " insert " << nanosPerOp(start, mid, keys.size())
+              << " ns/op, find " << nanosPerOp(mid, end, keys.size()) << " ns/op (checksum " << checksum << ")\n";
+}
+
+// Values drawn from a few long statuses: std::string values against dictionary ids.
+template <typename Value, std::size_t Order>
+void benchStatusValues(const char* label, const std::vector<std::int64_t>& keys) {
+    const std::vector<std::string> statuses{"awaiting-payment-confirmation", "shipped-to-regional-warehouse",
+                                            "delivered-and-signed-for", "returned-to-sender-address"};
+    BPlusTree<std::int64_t, Value, Order> tree;
+    auto start = Clock::now();
+    for (std::size_t i = 0; i < keys.size(); ++i) tree.insert(keys[i], Value(statuses[i % statuses.size()]));
+    auto mid = Clock::now();
+    const Value wanted(statuses[2]);
+    std::size_t matches = 0;
+    tree.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+              [&](std::int64_t, const Value& value) { matches += value == wanted ? 1 : 0; });
+    auto end = Clock::now();
+    // std::string keeps these statuses on the heap, one buffer per entry.
+    const std::size_t heap_bytes = std::is_same_v<Value, std::string> ? keys.size() * (statuses[0].size() + 1) : 0;
+    std::cout << label << " order=" << Order << " insert " << nanosPerOp(start, mid, keys.size()) << " ns/op, scan "
+              << nanosPerOp(mid, end, keys.size()) << " ns/entry, node bytes " << tree.stats().node_bytes
+              << " + value heap ~" << heap_bytes << " (matches " << matches << ")\n";
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    const std::size_t count = argc > 1 ? static_cast<std::size_t>(std::stoull(argv[1])) : 1'000'000;
+    const std::vector<std::int64_t> random = randomKeys(count, 42);
+    std::vector<std::int64_t> sequential(count);
+    for (std::size_t i = 0; i < count; ++i) sequential[i] = static_cast<std::int64_t>(i);
+
+    benchInt64<16>("random", random);
+    benchInt64<64>("random", random);
+    benchInt64<128>("random", random);
+    benchInt64<256>("random", random);
+    benchInt64<128>("sequential", sequential);
+
+    BPlusTreeOptions gapped;
+    gapped.leaf_layout = LeafLayout::Gapped;
+    benchInt64<64>("random/gapped", random, gapped);
+    benchInt64<128>("random/gapped", random, gapped);
+    benchInt64<256>("random/gapped", random, gapped);
+    benchInt64<512>("random/gapped", random, gapped);
+    benchInt64<512>("random", random);
+    benchInt64<128>("sequential/gapped", sequential, gapped);
+
+    BPlusTreeOptions append;
+    append.leaf_layout = LeafLayout::Append;
+    benchInt64<64>("random/append", random, append);
+    benchInt64<128>("random/append", random, append);
+    benchInt64<256>("random/append", random, append);
+    benchInt64<512>("random/append", random, append);
+    benchInt64<128>("sequential/append", sequential, append);
+
+    BPlusTreeOptions redistribute;
+    redistribute.overflow_policy = OverflowPolicy::Redistribute;
+    benchInt64<16>("random/redistribute", random, redistribute);
+    benchInt64<64>("random/redistribute", random, redistribute);
+    benchInt64<128>("random/redistribute", random, redistribute);
+
+    benchStringValues<128>("random/string", random);
+    benchStringValues<128>("random/string/gapped", random, gapped);
+    benchStringValues<128>("random/string/append", random, append);
+    benchStatusValues<std::string, 64>("random/status/string", random);
+    benchStatusValues<InternedString, 64>("random/status/interned", random);
+
+    // A quarter of the payload fits in memory; the rest is spilled and reloaded on access.
+    BPlusTreeOptions budget;
+    budget.memory_budget = count * (sizeof(std::int64_t) + sizeof(std::string) + 48) / 4;
+    benchStringValues<128>("random/string/budget", random, budget);
+    benchStringValues<128>("sequential/string/budget", sequential, budget);
+
+    benchScan<64>("random", random);
+    benchParallelReduce<64>("random", random);
+    benchFindBatch<64>("random", random);
+    benchSplitJoin<64>("random", random);
+    benchMergeFrom<64>("random", random);
+    benchWriteBatch<64>("random", random);
+    benchTransactions<64>("random", random);
+    benchEraseRange<64>("random", random);
+    benchSnapshot<64>("random", random);
+    benchFreeze<64>("random", random);
+    benchSharedTree<64>("random", random);
+    benchCursor<64>("random", random);
+    benchFreeze<64>("sequential", sequential);
+
+    BPlusTreeOptions huge_pages;
+    huge_pages.huge_pages = true;
+    const std::vector<std::int64_t> large = randomKeys(count * 4, 43);
+    benchTlb<16>("tlb", large);
+    benchTlb<16>("tlb/huge_pages", large, huge_pages);
+    benchTlb<64>("tlb", large);
+    benchTlb<64>("tlb/huge_pages", large, huge_pages);
+    return 0;
+}
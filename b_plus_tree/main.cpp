@@ -1,159 +1,3521 @@
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <istream>
+#include <iterator>
+#include <map>
 #include <memory>
+#include <new>
+#include <numeric>
 #include <optional>
+#include <ostream>
+#include <set>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
 #include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
-template <typename Key, typename Value, std::size_t Order>
-class BPlusTree {
-  static_assert(Order >= 3, "B+Tree order must be at least 3");
-  /*
-    Data Structure:
-    
-    [(Node)        ]
-    [Keys:    K1 | K2 | K3 | ... | K_maxkeys() ]
-    [Values:  V1 | V2 | V3 | ... | V_maxkeys() ] (null is assigned if the node is internal)
-    - Node has a single parent
-    - Node has children.
-    
-    The class BPlusTree constructs the following graph:
-           [ Root (internal) ]
-               /       \
-          [ I ]         [ I ]        ← internal nodes
-           / \           / \
-        [L0] [L1]     [L2] [L3]      ← leaves (where leaf = true)
-        
-   ```
-  */
-  struct Node {
-    explicit Node(bool is_leaf) : leaf(is_leaf), parent(nullptr) {}
-    bool leaf;
-    std::vector<Key> keys;
-    std::vector<Value> values; // Valid only when the node is leaf
-    std::vector<std::unique_ptr<Node>> children; // Valid when the node is internal
-    Node* parent;
-  };
-  std::unique_ptr<Node> root_;
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "scheduler.hpp"
+
+namespace detail {
+// 32-bit reference to a block handed out by NodeArena::allocate_addressable.
+using NodeId = std::uint32_t;
+inline constexpr NodeId kNoNode = ~NodeId{0};
+
+// Pool that tree nodes and their fixed-capacity arrays are carved from. Memory is taken in chunks
+// that live as long as the arena; freed blocks are kept on per-size free lists for reuse.
+// With huge pages each chunk is a 2 MiB aligned anonymous mapping advised MADV_HUGEPAGE, so a
+// descent touches a handful of TLB entries instead of one per node. If mmap fails the chunk comes
+// from the heap instead, and if madvise fails (THP disabled) the mapping keeps regular pages;
+// huge_page_bytes() tells how much was actually advised.
+// A tree allocates under its exclusive latch, so the arena only serializes allocation with a mutex
+// once share() says that trees split off one another use it. Resolving an id takes no lock: the
+// chunk table is reserved up front (address space only, pages are touched as chunks are added), so
+// its slots never move once written.
+class NodeArena {
+public:
+  static constexpr std::size_t kHugePageSize = std::size_t{2} << 20;
+
+  explicit NodeArena(bool huge_pages)
+      : huge_pages_(huge_pages), chunk_size_(huge_pages ? kHugePageSize : kRegularChunkSize) {
+    void* table = ::mmap(nullptr, tableBytes(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table == MAP_FAILED) throw std::bad_alloc();
+    table_ = static_cast<char**>(table);
+  }
+  NodeArena(const NodeArena&) = delete;
+  NodeArena& operator=(const NodeArena&) = delete;
+  ~NodeArena() {
+    ::munmap(table_, tableBytes());
+    for (const Chunk& chunk : chunks_) {
+      if (chunk.mapped) {
+        ::munmap(chunk.base, chunk_size_);
+      } else {
+        ::operator delete(chunk.base);
+      }
+    }
+  }
+
+  // Called before a second tree starts allocating from the arena; from then on every allocation
+  // takes the mutex. The first tree's latch is held exclusively meanwhile.
+  void share() { shared_.store(true, std::memory_order_relaxed); }
+
+  void* allocate(std::size_t bytes, std::size_t align = alignof(std::max_align_t)) {
+    if (!pooled(bytes, align)) return ::operator new(bytes, std::align_val_t{align});
+    const std::unique_lock<std::mutex> lock = guard();
+    const std::size_t size = roundUp(bytes);
+    const std::size_t size_class = size / kGranule;
+    if (size_class < free_.size() && free_[size_class]) {
+      void* block = free_[size_class];
+      free_[size_class] = *static_cast<void**>(block);
+      return block;
+    }
+    if (static_cast<std::size_t>(limit_ - cursor_) < size) newChunk();
+    void* block = cursor_;
+    cursor_ += size;
+    return block;
+  }
+
+  void deallocate(void* block, std::size_t bytes, std::size_t align = alignof(std::max_align_t)) {
+    if (!pooled(bytes, align)) {
+      ::operator delete(block, std::align_val_t{align});
+      return;
+    }
+    const std::unique_lock<std::mutex> lock = guard();
+    const std::size_t size_class = roundUp(bytes) / kGranule;
+    if (size_class >= free_.size()) free_.resize(size_class + 1, nullptr);
+    *static_cast<void**>(block) = free_[size_class];
+    free_[size_class] = block;
+  }
+
+  // Bump-allocates a block that can be named by a 32-bit id: the chunk index followed by the
+  // offset in granules. Such blocks go back through release_addressable(), which keeps the id
+  // rather than threading a free list through the block, so a released block stays readable.
+  NodeId allocate_addressable(std::size_t bytes) {
+    const std::unique_lock<std::mutex> lock = guard();
+    const std::size_t size = roundUp(bytes);
+    if (static_cast<std::size_t>(limit_ - cursor_) < size) newChunk();
+    const std::size_t chunk = chunks_.size() - 1;
+    if (chunk >= maxChunks()) throw std::length_error("NodeArena id space exhausted");
+    const auto offset = static_cast<std::size_t>(cursor_ - chunks_.back().base) / kGranule;
+    cursor_ += size;
+    return static_cast<NodeId>((chunk << offsetBits()) | offset);
+  }
+  // An id released for a block of this size, for any tree on the arena to reuse, or kNoNode.
+  NodeId reuse_addressable(std::size_t bytes) {
+    const std::unique_lock<std::mutex> lock = guard();
+    const std::size_t size_class = roundUp(bytes) / kGranule;
+    if (size_class >= free_ids_.size() || free_ids_[size_class].empty()) return kNoNode;
+    const NodeId id = free_ids_[size_class].back();
+    free_ids_[size_class].pop_back();
+    return id;
+  }
+  void release_addressable(NodeId id, std::size_t bytes) {
+    const std::unique_lock<std::mutex> lock = guard();
+    const std::size_t size_class = roundUp(bytes) / kGranule;
+    if (size_class >= free_ids_.size()) free_ids_.resize(size_class + 1);
+    free_ids_[size_class].push_back(id);
+  }
+  void* address(NodeId id) const {
+    return table_[id >> offsetBits()] + static_cast<std::size_t>(id & ((NodeId{1} << offsetBits()) - 1)) * kGranule;
+  }
+
+  std::size_t reserved_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return chunks_.size() * chunk_size_;
+  }
+  std::size_t huge_page_bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return huge_page_bytes_;
+  }
+
+private:
+  static constexpr std::size_t kRegularChunkSize = std::size_t{64} << 10;
+  static constexpr std::size_t kGranule = 16;
+
+  struct Chunk {
+    char* base = nullptr;
+    bool mapped = false;
+  };
+
+  std::unique_lock<std::mutex> guard() {
+    return shared_.load(std::memory_order_relaxed) ? std::unique_lock<std::mutex>(mutex_) : std::unique_lock<std::mutex>();
+  }
+
+  static std::size_t roundUp(std::size_t bytes) { return (bytes + kGranule - 1) / kGranule * kGranule; }
+  // 12 bits for regular chunks, 17 for huge pages: either way ids reach 64 GiB of chunks.
+  unsigned offsetBits() const { return huge_pages_ ? 17 : 12; }
+  std::size_t maxChunks() const { return std::size_t{1} << (32 - offsetBits()); }
+  std::size_t tableBytes() const { return maxChunks() * sizeof(char*); }
+  // Over-aligned and large blocks bypass the pool.
+  bool pooled(std::size_t bytes, std::size_t align) const { return align <= kGranule && bytes <= chunk_size_ / 4; }
+
+  void newChunk() {
+    Chunk chunk;
+    if (huge_pages_) chunk = mapHugeChunk();
+    if (!chunk.base) chunk.base = static_cast<char*>(::operator new(chunk_size_));
+    if (chunks_.size() < maxChunks()) table_[chunks_.size()] = chunk.base;
+    chunks_.push_back(chunk);
+    cursor_ = chunk.base;
+    limit_ = chunk.base + chunk_size_;
+  }
+
+  Chunk mapHugeChunk() {
+    // Map one extra huge page and trim both ends so that the chunk is 2 MiB aligned.
+    void* raw = ::mmap(nullptr, 2 * kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return {};
+    char* base = static_cast<char*>(raw);
+    const std::size_t misalignment = reinterpret_cast<std::uintptr_t>(base) % kHugePageSize;
+    char* aligned = misalignment == 0 ? base : base + (kHugePageSize - misalignment);
+    if (aligned != base) ::munmap(base, static_cast<std::size_t>(aligned - base));
+    const std::size_t tail = static_cast<std::size_t>(base + 2 * kHugePageSize - (aligned + kHugePageSize));
+    if (tail != 0) ::munmap(aligned + kHugePageSize, tail);
+#ifdef MADV_HUGEPAGE
+    if (::madvise(aligned, kHugePageSize, MADV_HUGEPAGE) == 0) huge_page_bytes_ += kHugePageSize;
+#endif
+    return {aligned, true};
+  }
+
+  bool huge_pages_;
+  std::size_t chunk_size_;
+  std::atomic<bool> shared_{false};
+  mutable std::mutex mutex_;  // once shared_, guards everything below except reads of table_ slots already written
+  std::vector<Chunk> chunks_;
+  char** table_ = nullptr;  // chunk bases by index, for address()
+  char* cursor_ = nullptr;
+  char* limit_ = nullptr;
+  std::vector<void*> free_;  // intrusive free list heads, indexed by size / kGranule
+  std::vector<std::vector<NodeId>> free_ids_;  // released addressable blocks, indexed likewise
+  std::size_t huge_page_bytes_ = 0;
+};
+
+// Fixed-capacity replacement for std::vector used by nodes whose elements are trivially copyable.
+// The buffer is allocated once with room for Capacity elements, so it never regrows, and shifts and
+// splits are plain memmove/memcpy instead of element-wise moves.
+template <typename T, std::size_t Capacity>
+class FixedArray {
+  static_assert(std::is_trivially_copyable_v<T>, "FixedArray relies on memmove/memcpy");
+
+public:
+  using value_type = T;
+  using iterator = T*;
+  using const_iterator = const T*;
+
+  FixedArray() = default;
+  FixedArray(const FixedArray&) = delete;
+  FixedArray& operator=(const FixedArray&) = delete;
+  ~FixedArray() { release(); }
+
+  T* begin() { return data_; }
+  T* end() { return data_ + size_; }
+  const T* begin() const { return data_; }
+  const T* end() const { return data_ + size_; }
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  static constexpr std::size_t capacity() { return Capacity; }
+
+  T& operator[](std::size_t index) { return data_[index]; }
+  const T& operator[](std::size_t index) const { return data_[index]; }
+  T& front() { return data_[0]; }
+  const T& front() const { return data_[0]; }
+  T& back() { return data_[size_ - 1]; }
+  const T& back() const { return data_[size_ - 1]; }
+
+  template <typename... Args>
+  T* emplace(T* pos, Args&&... args) {
+    const std::size_t index = static_cast<std::size_t>(pos - data_);
+    // Build the element first: args may alias an element that is about to be shifted.
+    T value(std::forward<Args>(args)...);
+    grow(size_ + 1);
+    std::memmove(data_ + index + 1, data_ + index, (size_ - index) * sizeof(T));
+    std::memcpy(data_ + index, &value, sizeof(T));
+    ++size_;
+    return data_ + index;
+  }
+  T* insert(T* pos, const T& value) { return emplace(pos, value); }
+
+  // Inserts the contiguous range [first, last), which must not alias this array.
+  template <typename It>
+  T* insert(T* pos, It first, It last) {
+    const std::size_t index = static_cast<std::size_t>(pos - data_);
+    const T* src = pointerOf(first);
+    const std::size_t count = static_cast<std::size_t>(pointerOf(last) - src);
+    if (count == 0) return pos;
+    grow(size_ + count);
+    std::memmove(data_ + index + count, data_ + index, (size_ - index) * sizeof(T));
+    std::memcpy(data_ + index, src, count * sizeof(T));
+    size_ += count;
+    return data_ + index;
+  }
+
+  T* erase(T* first, T* last) {
+    if (first == last) return first;
+    std::memmove(first, last, static_cast<std::size_t>(end() - last) * sizeof(T));
+    size_ -= static_cast<std::size_t>(last - first);
+    return first;
+  }
+  T* erase(T* pos) { return erase(pos, pos + 1); }
+
+  template <typename... Args>
+  void emplace_back(Args&&... args) {
+    grow(size_ + 1);
+    ::new (static_cast<void*>(data_ + size_)) T(std::forward<Args>(args)...);
+    ++size_;
+  }
+  void push_back(const T& value) { emplace_back(value); }
+  void pop_back() { --size_; }
+
+  // Replaces the contents with [first, last), which must be a contiguous range of T.
+  template <typename It>
+  void assign(It first, It last) {
+    const T* src = pointerOf(first);
+    const std::size_t count = static_cast<std::size_t>(pointerOf(last) - src);
+    grow(count);
+    std::memcpy(data_, src, count * sizeof(T));
+    size_ = count;
+  }
+
+  void resize(std::size_t count) {
+    grow(count);
+    for (std::size_t i = size_; i < count; ++i) {
+      ::new (static_cast<void*>(data_ + i)) T();
+    }
+    size_ = count;
+  }
+  void clear() { size_ = 0; }
+  // The capacity is fixed, so only an empty array has anything to give back.
+  void shrink_to_fit() {
+    if (size_ == 0) release();
+  }
+  std::size_t allocated_bytes() const { return data_ ? Capacity * sizeof(T) : 0; }
+  // Takes the buffer from `arena` instead of the heap. Must be called before the first allocation.
+  void bind_arena(NodeArena* arena) { arena_ = arena; }
+
+private:
+  static const T* pointerOf(const T* it) { return it; }
+  static const T* pointerOf(std::move_iterator<T*> it) { return it.base(); }
+
+  void grow(std::size_t count) {
+    if (count > Capacity) throw std::length_error("FixedArray capacity exceeded");
+    if (!data_ && count > 0) {
+      data_ = static_cast<T*>(arena_ ? arena_->allocate(Capacity * sizeof(T), alignof(T))
+                                     : ::operator new(Capacity * sizeof(T), std::align_val_t{alignof(T)}));
+    }
+  }
+  void release() {
+    if (data_) {
+      if (arena_) {
+        arena_->deallocate(data_, Capacity * sizeof(T), alignof(T));
+      } else {
+        ::operator delete(data_, std::align_val_t{alignof(T)});
+      }
+    }
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  T* data_ = nullptr;
+  std::size_t size_ = 0;
+  NodeArena* arena_ = nullptr;
+};
+
+// Slots for tree nodes addressed by NodeId, so that nodes reference each other with half the space
+// of a pointer. Slots are bump-allocated from the arena next to the arrays allocated after them,
+// never move, and once destroyed go back to the arena, where any tree sharing it reuses them;
+// resolving an id is one lookup in the chunk table.
+// Behind each node the slot keeps a generation, bumped when the node is destroyed, so that an id
+// and its generation name one node for good; it stays readable once the node is gone. It is atomic
+// because a tree may still check the generation of a slot that a tree split off it has reused.
+template <typename T>
+class NodePool {
+  static_assert(alignof(T) <= alignof(std::max_align_t), "NodeArena blocks are max_align_t aligned");
+
+public:
+  explicit NodePool(NodeArena* arena = nullptr) : arena_(arena) {}
+  NodePool(const NodePool&) = delete;
+  NodePool& operator=(const NodePool&) = delete;
+
+  template <typename... Args>
+  NodeId create(Args&&... args) {
+    NodeId id = arena_->reuse_addressable(kSlotBytes);
+    if (id == kNoNode) {
+      id = arena_->allocate_addressable(kSlotBytes);
+      ::new (generationOf(id)) std::atomic<std::uint64_t>(0);
+    }
+    ::new (get(id)) T(std::forward<Args>(args)...);
+    return id;
+  }
+
+  void destroy(NodeId id) {
+    get(id)->~T();
+    generationOf(id)->fetch_add(1, std::memory_order_relaxed);
+    arena_->release_addressable(id, kSlotBytes);
+  }
+
+  T* get(NodeId id) const { return static_cast<T*>(arena_->address(id)); }
+  std::uint64_t generation(NodeId id) const { return generationOf(id)->load(std::memory_order_relaxed); }
+
+  void swap(NodePool& other) noexcept { std::swap(arena_, other.arena_); }
+
+private:
+  static constexpr std::size_t kGenerationOffset =
+      (sizeof(T) + alignof(std::uint64_t) - 1) / alignof(std::uint64_t) * alignof(std::uint64_t);
+  static constexpr std::size_t kSlotBytes = kGenerationOffset + sizeof(std::atomic<std::uint64_t>);
+
+  std::atomic<std::uint64_t>* generationOf(NodeId id) const {
+    return reinterpret_cast<std::atomic<std::uint64_t>*>(static_cast<char*>(arena_->address(id)) + kGenerationOffset);
+  }
+
+  NodeArena* arena_;
+};
+
+// Node storage selected at compile time: fixed-capacity memmove arrays for trivially copyable
+// elements (int, int64_t, ...), std::vector for everything else.
+template <typename T, std::size_t Capacity>
+using NodeArray = std::conditional_t<std::is_trivially_copyable_v<T>, FixedArray<T, Capacity>, std::vector<T>>;
+
+template <typename T>
+std::size_t allocatedBytes(const std::vector<T>& array) { return array.capacity() * sizeof(T); }
+template <typename T, std::size_t Capacity>
+std::size_t allocatedBytes(const FixedArray<T, Capacity>& array) { return array.allocated_bytes(); }
+
+// std::vector buffers stay on the heap.
+template <typename T>
+void bindArena(std::vector<T>&, NodeArena*) {}
+template <typename T, std::size_t Capacity>
+void bindArena(FixedArray<T, Capacity>& array, NodeArena* arena) { array.bind_arena(arena); }
+
+inline unsigned countTrailingZeros(std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<unsigned>(__builtin_ctzll(word));
+#else
+  unsigned count = 0;
+  for (; (word & 1u) == 0; word >>= 1) ++count;
+  return count;
+#endif
+}
+
+template <typename T, typename = void>
+struct IsHashable : std::false_type {};
+template <typename T>
+struct IsHashable<T, std::void_t<decltype(std::hash<T>{}(std::declval<const T&>()))>> : std::true_type {};
+
+// One-byte key summary used to skip most key comparisons when probing an unsorted leaf tail.
+// Keys without a std::hash specialization all share fingerprint 0, which only costs extra compares.
+template <typename Key>
+std::uint8_t fingerprint(const Key& key) {
+  if constexpr (IsHashable<Key>::value) {
+    const auto hash = static_cast<std::uint64_t>(std::hash<Key>{}(key));
+    return static_cast<std::uint8_t>((hash * 0x9E3779B97F4A7C15ull) >> 56);
+  } else {
+    (void)key;
+    return 0;
+  }
+}
+
+inline unsigned countLeadingZeros(std::uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+  return static_cast<unsigned>(__builtin_clzll(word));
+#else
+  unsigned count = 0;
+  for (std::uint64_t mask = std::uint64_t{1} << 63; (word & mask) == 0; mask >>= 1) ++count;
+  return count;
+#endif
+}
+
+inline void putVarint(std::string& out, std::uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+    value >>= 7;
+  }
+  out.push_back(static_cast<char>(value));
+}
+
+inline bool getVarint(const char*& in, const char* end, std::uint64_t& value) {
+  value = 0;
+  for (unsigned shift = 0; in != end && shift < 64; shift += 7) {
+    const auto byte = static_cast<std::uint8_t>(*in++);
+    value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) return true;
+  }
+  return false;
+}
+
+// Binary encoding of keys and values for spilling leaves to disk. `footprint` is the memory an
+// element is charged against the tree's memory budget.
+template <typename T, typename = void>
+struct Codec {
+  static constexpr bool supported = false;
+};
+
+template <typename T>
+struct Codec<T, std::enable_if_t<std::is_trivially_copyable_v<T>>> {
+  static constexpr bool supported = true;
+  static void encode(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+  static bool decode(const char*& in, const char* end, T& value) {
+    if (static_cast<std::size_t>(end - in) < sizeof(T)) return false;
+    std::memcpy(&value, in, sizeof(T));
+    in += sizeof(T);
+    return true;
+  }
+  static std::size_t footprint(const T&) { return sizeof(T); }
+};
+
+template <>
+struct Codec<std::string> {
+  static constexpr bool supported = true;
+  static void encode(std::string& out, const std::string& value) {
+    putVarint(out, value.size());
+    out.append(value);
+  }
+  static bool decode(const char*& in, const char* end, std::string& value) {
+    std::uint64_t length = 0;
+    if (!getVarint(in, end, length) || static_cast<std::uint64_t>(end - in) < length) return false;
+    value.assign(in, static_cast<std::size_t>(length));
+    in += length;
+    return true;
+  }
+  static std::size_t footprint(const std::string& value) { return sizeof(std::string) + value.size(); }
+};
+
+// Region of the spill file holding one evicted leaf.
+struct SpillExtent {
+  std::uint64_t offset = 0;
+  std::uint64_t length = 0;
+  std::uint64_t capacity = 0;  // 0: no region
+};
+
+// Append-mostly file that evicted leaves are written to. Released regions are reused first-fit.
+// Shared by trees split off one another, so region bookkeeping is under a mutex.
+class SpillFile {
+public:
+  // An empty path spills to an anonymous temporary file that disappears with the process.
+  explicit SpillFile(const std::string& path) {
+    if (path.empty()) {
+      file_ = std::tmpfile();
+      fd_ = file_ ? ::fileno(file_) : -1;
+    } else {
+      fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    }
+    if (fd_ < 0) fail("cannot open spill file");
+  }
+  SpillFile(const SpillFile&) = delete;
+  SpillFile& operator=(const SpillFile&) = delete;
+  ~SpillFile() {
+    if (file_) {
+      std::fclose(file_);
+    } else {
+      ::close(fd_);
+    }
+  }
+
+  // Stores bytes, reusing the leaf's previous region when it is large enough.
+  SpillExtent write(const std::string& bytes, SpillExtent extent) {
+    if (extent.capacity < bytes.size()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (extent.capacity != 0) free_.push_back(extent);
+      extent = allocate(bytes.size());
+    }
+    extent.length = bytes.size();
+    for (std::size_t done = 0; done < bytes.size();) {
+      const ssize_t written = ::pwrite(fd_, bytes.data() + done, bytes.size() - done,
+                                       static_cast<off_t>(extent.offset + done));
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) fail("cannot write spill file");
+      done += static_cast<std::size_t>(written);
+    }
+    return extent;
+  }
+
+  std::string read(const SpillExtent& extent) const {
+    std::string bytes(static_cast<std::size_t>(extent.length), '\0');
+    for (std::size_t done = 0; done < bytes.size();) {
+      const ssize_t got = ::pread(fd_, &bytes[done], bytes.size() - done, static_cast<off_t>(extent.offset + done));
+      if (got < 0 && errno == EINTR) continue;
+      if (got <= 0) fail("cannot read spill file");
+      done += static_cast<std::size_t>(got);
+    }
+    return bytes;
+  }
+
+  void release(const SpillExtent& extent) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (extent.capacity != 0) free_.push_back(extent);
+  }
+
+private:
+  SpillExtent allocate(std::uint64_t length) {
+    for (std::size_t i = 0; i < free_.size(); ++i) {
+      if (free_[i].capacity >= length) {
+        SpillExtent extent = free_[i];
+        free_[i] = free_.back();
+        free_.pop_back();
+        return extent;
+      }
+    }
+    SpillExtent extent{end_, 0, length};
+    end_ += length;
+    return extent;
+  }
+
+  [[noreturn]] static void fail(const char* what) {
+    throw std::runtime_error(std::string(what) + ": " + std::strerror(errno));
+  }
+
+  std::FILE* file_ = nullptr;
+  int fd_ = -1;
+  std::mutex mutex_;
+  std::uint64_t end_ = 0;
+  std::vector<SpillExtent> free_;
+};
+
+// Snapshot format written by serialize() and read by deserialize(); fixed-width fields are little-endian.
+//   header: "BPTSNAP\0", u32 format version, u32 flags (kSnapshotDeltaKeys)
+//   block:  u32 entry count, u32 payload bytes, u64 checksum of the payload, payload
+//   end:    a block with entry count 0 whose payload is the varint total number of entries
+// A payload holds its entries in key order, each key followed by its value (see Codec). Integer keys
+// are stored as the varint distance to the previous key of the block instead, the first one to 0,
+// so every block decodes on its own.
+inline constexpr char kSnapshotMagic[8] = {'B', 'P', 'T', 'S', 'N', 'A', 'P', '\0'};
+inline constexpr std::uint32_t kSnapshotVersion = 1;
+inline constexpr std::uint32_t kSnapshotDeltaKeys = 1;
+inline constexpr std::size_t kSnapshotHeaderBytes = 16;
+inline constexpr std::size_t kSnapshotBlockHeaderBytes = 16;
+// Payloads are closed once they reach this size.
+inline constexpr std::size_t kSnapshotBlockBytes = std::size_t{64} << 10;
+
+template <typename T>
+inline constexpr bool kDeltaEncodable = std::is_integral_v<T> && !std::is_same_v<T, bool>;
+
+// Order-preserving mapping of an integer to an unsigned one: signed values get their sign bit flipped.
+template <typename T>
+std::uint64_t orderedBits(T value) {
+  using Unsigned = std::make_unsigned_t<T>;
+  auto bits = static_cast<Unsigned>(value);
+  if constexpr (std::is_signed_v<T>) bits = static_cast<Unsigned>(bits ^ (Unsigned{1} << (sizeof(T) * 8 - 1)));
+  return bits;
+}
+template <typename T>
+T fromOrderedBits(std::uint64_t bits) {
+  using Unsigned = std::make_unsigned_t<T>;
+  auto value = static_cast<Unsigned>(bits);
+  if constexpr (std::is_signed_v<T>) value = static_cast<Unsigned>(value ^ (Unsigned{1} << (sizeof(T) * 8 - 1)));
+  return static_cast<T>(value);
+}
+
+inline void putFixed(char* out, std::uint64_t value, std::size_t bytes) {
+  for (std::size_t i = 0; i < bytes; ++i) out[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+}
+inline std::uint64_t getFixed(const char* in, std::size_t bytes) {
+  std::uint64_t value = 0;
+  for (std::size_t i = 0; i < bytes; ++i) value |= static_cast<std::uint64_t>(static_cast<std::uint8_t>(in[i])) << (8 * i);
+  return value;
+}
+
+// Checksum of a snapshot block, eight bytes per step. Catches torn and corrupted blocks; it is not
+// meant to resist deliberate tampering.
+inline std::uint64_t blockChecksum(const char* data, std::size_t size) {
+  std::uint64_t hash = 0x9E3779B97F4A7C15ull ^ size;
+  std::size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t word;
+    std::memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 32;
+  }
+  for (; i < size; ++i) hash = (hash ^ static_cast<std::uint8_t>(data[i])) * 0x100000001B3ull;
+  hash ^= hash >> 29;
+  hash *= 0xC4CEB9FE1A85EC53ull;
+  return hash ^ (hash >> 32);
+}
+
+inline void writeFully(int fd, const char* data, std::size_t size) {
+  for (std::size_t done = 0; done < size;) {
+    const ssize_t written = ::write(fd, data + done, size - done);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) throw std::runtime_error(std::string("cannot write B+Tree snapshot: ") + std::strerror(errno));
+    done += static_cast<std::size_t>(written);
+  }
+}
+// Reads until `size` bytes arrived or the file ended; returns how many arrived.
+inline std::size_t readFully(int fd, char* data, std::size_t size) {
+  std::size_t done = 0;
+  while (done < size) {
+    const ssize_t got = ::read(fd, data + done, size - done);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) throw std::runtime_error(std::string("cannot read B+Tree snapshot: ") + std::strerror(errno));
+    if (got == 0) break;
+    done += static_cast<std::size_t>(got);
+  }
+  return done;
+}
+
+// Process-wide set of the distinct strings behind InternedString values. Ids are dense and never
+// reused, and a string never moves once interned, so resolving an id takes no lock: the id is an
+// index into segments that are allocated once (the first holds 64 strings, each next one twice as
+// many) and published through atomic pointers. Interning takes the lock, shared while it only finds
+// an existing string.
+class StringDictionary {
+public:
+  static StringDictionary& instance() {
+    static StringDictionary dictionary;
+    return dictionary;
+  }
+
+  // The empty string is always id 0.
+  StringDictionary() { intern(std::string_view{}); }
+  StringDictionary(const StringDictionary&) = delete;
+  StringDictionary& operator=(const StringDictionary&) = delete;
+  ~StringDictionary() {
+    for (auto& segment : segments_) delete[] segment.load(std::memory_order_relaxed);
+  }
+
+  std::uint32_t intern(std::string_view text) {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      const auto it = ids_.find(text);
+      if (it != ids_.end()) return it->second;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    const auto it = ids_.find(text);
+    if (it != ids_.end()) return it->second;
+    if (strings_.size() == UINT32_MAX) throw std::length_error("StringDictionary is full");
+    const auto id = static_cast<std::uint32_t>(strings_.size());
+    const std::string_view stored = strings_.emplace_back(text);
+    const unsigned segment = segmentOf(id);
+    std::string_view* views = segments_[segment].load(std::memory_order_relaxed);
+    if (!views) {
+      views = new std::string_view[std::size_t{kFirstSegment} << segment];
+      segments_[segment].store(views, std::memory_order_release);
+    }
+    views[offsetOf(id, segment)] = stored;
+    ids_.emplace(stored, id);
+    return id;
+  }
+
+  // `id` must have been returned by intern().
+  std::string_view lookup(std::uint32_t id) const {
+    const unsigned segment = segmentOf(id);
+    return segments_[segment].load(std::memory_order_acquire)[offsetOf(id, segment)];
+  }
+
+  std::size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return strings_.size();
+  }
+
+private:
+  static constexpr unsigned kFirstSegmentBits = 6;
+  static constexpr std::uint64_t kFirstSegment = std::uint64_t{1} << kFirstSegmentBits;
+  static constexpr std::size_t kSegments = 33 - kFirstSegmentBits;  // enough for 2^32 ids
+
+  static unsigned segmentOf(std::uint64_t id) { return 63 - countLeadingZeros(id + kFirstSegment) - kFirstSegmentBits; }
+  static std::size_t offsetOf(std::uint64_t id, unsigned segment) {
+    return static_cast<std::size_t>(id + kFirstSegment - (kFirstSegment << segment));
+  }
+
+  std::array<std::atomic<std::string_view*>, kSegments> segments_{};
+  std::deque<std::string> strings_;  // a deque keeps its elements in place as it grows
+  std::unordered_map<std::string_view, std::uint32_t> ids_;
+  mutable std::shared_mutex mutex_;
+};
+}  // namespace detail
+
+// Value (or key) type for strings drawn from a small set, such as statuses or region codes. It holds
+// the 32-bit id of its text in the process-wide dictionary, so a leaf stores 4 bytes per value
+// instead of a std::string with its heap buffer, and equality is an id compare. view() is a
+// lock-free lookup; the text lives as long as the process. Spill files and snapshots store the text.
+class InternedString {
+public:
+  InternedString() = default;
+  InternedString(std::string_view text) : id_(detail::StringDictionary::instance().intern(text)) {}
+  InternedString(const std::string& text) : InternedString(std::string_view(text)) {}
+  InternedString(const char* text) : InternedString(std::string_view(text)) {}
+
+  std::string_view view() const { return detail::StringDictionary::instance().lookup(id_); }
+  operator std::string_view() const { return view(); }
+  std::uint32_t id() const { return id_; }
+
+  friend bool operator==(InternedString a, InternedString b) { return a.id_ == b.id_; }
+  friend bool operator!=(InternedString a, InternedString b) { return a.id_ != b.id_; }
+  friend bool operator<(InternedString a, InternedString b) { return a.view() < b.view(); }
+  // Comparing with text does not intern it.
+  template <typename Text>
+  using IfText = std::enable_if_t<std::is_convertible_v<const Text&, std::string_view> && !std::is_same_v<Text, InternedString>>;
+  template <typename Text, typename = IfText<Text>>
+  friend bool operator==(InternedString a, const Text& text) { return a.view() == std::string_view(text); }
+  template <typename Text, typename = IfText<Text>>
+  friend bool operator==(const Text& text, InternedString a) { return a.view() == std::string_view(text); }
+  template <typename Text, typename = IfText<Text>>
+  friend bool operator!=(InternedString a, const Text& text) { return !(a == text); }
+  template <typename Text, typename = IfText<Text>>
+  friend bool operator!=(const Text& text, InternedString a) { return !(a == text); }
+
+private:
+  std::uint32_t id_ = 0;  // the empty string
+};
+
+namespace detail {
+// Ids only mean something within this process, so the text is stored instead.
+template <>
+struct Codec<InternedString> {
+  static constexpr bool supported = true;
+  static void encode(std::string& out, const InternedString& value) {
+    const std::string_view text = value.view();
+    putVarint(out, text.size());
+    out.append(text.data(), text.size());
+  }
+  static bool decode(const char*& in, const char* end, InternedString& value) {
+    std::uint64_t length = 0;
+    if (!getVarint(in, end, length) || static_cast<std::uint64_t>(end - in) < length) return false;
+    value = InternedString(std::string_view(in, static_cast<std::size_t>(length)));
+    in += length;
+    return true;
+  }
+  static std::size_t footprint(const InternedString&) { return sizeof(InternedString); }
+};
+}  // namespace detail
+
+enum class LeafLayout {
+  // Leaves are dense sorted arrays; an insert shifts every entry after the insertion point.
+  Sorted,
+  // Leaves use all Order slots and keep their free slots spread between the entries (packed memory
+  // array style), so an insert only shifts up to the nearest gap. Pays off at large orders.
+  Gapped,
+  // New entries are appended to an unsorted tail of the leaf (probed through one-byte fingerprints)
+  // and merged into the sorted part only on split or once the tail outgrows append_tail_limit.
+  // Suited to write-heavy workloads where a leaf takes many inserts between reads.
+  Append,
+};
+
+enum class OverflowPolicy {
+  // A full leaf is split in two, leaving both halves about half full.
+  Split,
+  // B*-tree style: a full leaf first hands entries to an adjacent sibling with room; when the
+  // neighbours are full too, two full leaves are split into three that are about 2/3 full.
+  // Fewer, fuller leaves make for a smaller tree and fewer cache misses per lookup.
+  Redistribute,
+};
+
+// How merge_from() resolves a key present in both trees.
+enum class ConflictPolicy {
+  // The entry already in the tree stays as it is.
+  KeepExisting,
+  // The incoming value replaces the existing one.
+  Overwrite,
+};
+
+enum class MutationKind : std::uint8_t {
+  Put,         // `key` now maps to `value`
+  Erase,       // `key` was removed
+  EraseRange,  // the keys in [key, end) were removed
+  EraseFrom,   // the keys >= key were removed (by erase_from() or moved out by split_at())
+};
+
+// One change as reported to a change hook (see BPlusTree::set_change_hook()). The pointers are only
+// valid during the call.
+template <typename Key, typename Value>
+struct Mutation {
+  MutationKind kind = MutationKind::Put;
+  const Key* key = nullptr;
+  const Key* end = nullptr;      // EraseRange only
+  const Value* value = nullptr;  // Put only
+};
+
+struct BPlusTreeOptions {
+  LeafLayout leaf_layout = LeafLayout::Sorted;
+  OverflowPolicy overflow_policy = OverflowPolicy::Split;
+  // LeafLayout::Append only: the tail length that triggers sorting the leaf. 0 picks Order / 4.
+  std::size_t append_tail_limit = 0;
+  // Bytes of keys and values that resident leaves may hold; 0 means unlimited. Beyond it, cold leaves
+  // (picked by a CLOCK sweep, referenced bits being set by find/insert) are written to the spill
+  // file and reloaded on access. Needs keys and values that are trivially copyable or std::string.
+  std::size_t memory_budget = 0;
+  // Where evicted leaves go; empty means an anonymous temporary file.
+  std::string spill_path;
+  // Carve nodes from 2 MiB transparent huge pages (mmap + madvise) to cut TLB misses on descents of
+  // large trees. Falls back to regular pages when the kernel does not cooperate.
+  bool huge_pages = false;
+};
+
+struct BPlusTreeStats {
+  std::size_t entries = 0;
+  std::size_t height = 0;  // number of levels, leaves included
+  std::size_t leaves = 0;
+  std::size_t internal_nodes = 0;
+  double leaf_fill = 0.0;  // average entries per leaf relative to the maximum
+  std::size_t node_bytes = 0;  // nodes plus their key/value/child arrays (not memory owned by keys or values)
+  std::size_t evicted_leaves = 0;
+  std::size_t frozen_leaves = 0;
+  std::size_t resident_bytes = 0;  // key/value bytes charged against the memory budget (when one is set)
+  std::size_t arena_bytes = 0;  // memory reserved by the node arena (shared with trees split off this one)
+  std::size_t huge_page_bytes = 0;  // part of arena_bytes advised as transparent huge pages
+};
+
+template <typename Key, typename Value, std::size_t Order>
+class BPlusTree {
+  static_assert(Order >= 3, "B+Tree order must be at least 3");
+  /*
+    Data Structure:
+    
+    [(Node)        ]
+    [Keys:    K1 | K2 | K3 | ... | K_maxkeys() ]
+    [Values:  V1 | V2 | V3 | ... | V_maxkeys() ] (null is assigned if the node is internal)
+    - Node has a single parent
+    - Node has children.
+
+    With LeafLayout::Gapped a leaf spans all Order slots and some of them are gaps:
+    [Keys:    K1 | K1 | K2 | K3 | K3 | K3 | ... ]
+    [Used:     1 |  0 |  1 |  1 |  0 |  0 | ... ]
+    A gap repeats the key of the entry before it, so the slots stay sorted and the usual
+    lower_bound still lands on the live entry. Slot 0 is always live.
+
+    With LeafLayout::Append the last `tail` entries of a leaf are unsorted:
+    [Keys:    K1 | K4 | K7 || K9 | K2 | K5 ]
+                 sorted    ||  tail (fingerprints F9 | F2 | F5)
+    
+    The class BPlusTree constructs the following graph:
+           [ Root (internal) ]
+               /       \
+          [ I ]         [ I ]        ← internal nodes
+           / \           / \
+        [L0] [L1]     [L2] [L3]      ← leaves (where leaf = true)
+        
+   ```
+  */
+  // Nodes live in nodes_ and their fixed arrays in arena_; they refer to each other by 32-bit ids.
+  // Children are owned by their parent.
+  using NodeId = detail::NodeId;
+  static constexpr NodeId kNoNode = detail::kNoNode;
+  struct Node {
+    Node(bool is_leaf, detail::NodeArena* arena) : leaf(is_leaf) {
+      detail::bindArena(keys, arena);
+      detail::bindArena(values, arena);
+      detail::bindArena(children, arena);
+      detail::bindArena(fingerprints, arena);
+    }
+    bool leaf;
+    // A node holds at most Order keys: maxKeys() plus the overflowing one that triggers a split.
+    detail::NodeArray<Key, Order> keys;
+    detail::NodeArray<Value, Order> values; // Valid only when the node is leaf
+    detail::FixedArray<NodeId, Order + 1> children; // Valid when the node is internal
+    NodeId self = kNoNode;
+    NodeId parent = kNoNode;
+    // Leaves only: neighbours in key order, and a stamp that changes whenever the entries change.
+    NodeId prev = kNoNode;
+    NodeId next = kNoNode;
+    std::uint64_t version = 0;
+    // Gapped leaves: keys/values hold Order slots, `live` of which are occupied. Evicted leaves:
+    // `live` entries are in the spill file.
+    bool gapped = false;
+    std::size_t live = 0;
+    std::array<std::uint64_t, (Order + 63) / 64> occupied{};
+    // Append leaves only: number of unsorted entries at the end of keys/values, and their fingerprints.
+    std::size_t tail = 0;
+    detail::NodeArray<std::uint8_t, Order> fingerprints;
+    // Memory budget only: an evicted leaf is an empty stub whose entries live in `spill`.
+    bool evicted = false;
+    bool referenced = false;  // CLOCK bit
+    detail::SpillExtent spill;
+    std::size_t gap_bytes = 0;  // budget charged for the key copies in the gaps (see chargeGaps())
+    // Frozen leaves (see freeze()): `keys` is released and the `live` keys are stored as their
+    // distances to frozen_base, frozen_width (>= 1) bits each, packed into frozen_words words.
+    bool frozen = false;
+    std::uint8_t frozen_width = 0;
+    std::uint32_t frozen_words = 0;
+    std::uint64_t frozen_base = 0;
+    std::uint64_t* frozen_bits = nullptr;
+  };
+  static constexpr bool kSpillable = detail::Codec<Key>::supported && detail::Codec<Value>::supported;
+  // A leaf as last seen by a scan, a cursor or a transaction: unchanged while its slot has the same
+  // generation (the id still names that leaf) and the leaf the same version. A scan continues after
+  // it while that holds.
+  struct ScanPosition {
+    NodeId leaf = kNoNode;
+    std::uint64_t version = 0;
+    std::uint64_t generation = 0;
+    bool operator==(const ScanPosition& other) const {
+      return leaf == other.leaf && version == other.version && generation == other.generation;
+    }
+  };
+  // The keys of a write batch with their values from before it (nullopt: absent), in key order.
+  struct BatchUndo {
+    std::uint64_t sequence = 0;
+    std::vector<std::pair<Key, std::optional<Value>>> before;
+  };
+  // Root-to-leaf path remembered by a cursor, with the key range [lower, upper) of every node
+  // (nullopt: unbounded). Valid while the node epoch and split epoch are unchanged; the leaf's range
+  // also needs its version unchanged.
+  struct CursorPath {
+    std::vector<NodeId> nodes;
+    std::vector<std::optional<Key>> lowers;
+    std::vector<std::optional<Key>> uppers;
+    std::uint64_t version = 0;
+    std::uint64_t epoch = 0;
+    std::uint64_t splits = 0;
+  };
+
+  // Shared with the trees split off this one (see split_at()), so that join() can re-link their nodes.
+  std::shared_ptr<detail::NodeArena> arena_;
+  detail::NodePool<Node> nodes_;
+  Node* root_ = nullptr;
+  BPlusTreeOptions options_;
+  mutable std::size_t size_ = 0;
+  std::optional<Key> compact_cursor_;  // where the next compact() slice resumes
+  // Memory budget state. Lookups reload and evict leaves too, hence mutable.
+  mutable std::shared_ptr<detail::SpillFile> spill_;
+  mutable std::size_t resident_bytes_ = 0;
+  mutable Node* clock_hand_ = nullptr;
+  // Set by split_at() on both trees: size_ is unknown and resident_bytes_ only an upper bound until
+  // settleCounts() walks the leaves, which readers may do under the shared latch.
+  mutable std::atomic<bool> counts_stale_{false};
+  mutable std::mutex count_mutex_;
+  // Writers hold the latch exclusively, readers shared. Scans take it per leaf (see scan()).
+  mutable std::shared_mutex latch_;
+  // Write batches (apply() and transaction commits) so far, counted under the exclusive latch. A
+  // scan reads the tree as of the batch it started at: the batches committed while it runs leave
+  // undo images behind, kept until no scan that started before them is left.
+  std::uint64_t batch_sequence_ = 0;
+  std::deque<BatchUndo> batch_undo_;
+  mutable std::mutex scans_mutex_;  // guards scan_starts_
+  mutable std::multiset<std::uint64_t> scan_starts_;  // batch sequence of every running scan
+  std::uint64_t version_clock_ = 0;  // source of leaf versions
+  std::uint64_t node_epoch_ = 0;  // bumped whenever a node is freed
+  // Bumped whenever node ranges may shrink without a node being freed: an internal node splits, the
+  // root grows, or join() grafts a tree on.
+  std::uint64_t split_epoch_ = 0;
+  std::function<void(const Mutation<Key, Value>&)> change_hook_;
+
+public:
+  using key_type = Key;
+  using mapped_type = Value;
+  BPlusTree() : BPlusTree(BPlusTreeOptions{}) {}
+  explicit BPlusTree(BPlusTreeOptions options)
+      : arena_(std::make_shared<detail::NodeArena>(options.huge_pages)), nodes_(arena_.get()), options_(std::move(options)) {
+    if (options_.memory_budget != 0) {
+      if (!kSpillable) throw std::invalid_argument("memory_budget needs trivially copyable or std::string keys and values");
+      spill_ = std::make_shared<detail::SpillFile>(options_.spill_path);
+    }
+    root_ = newNode(true);
+  }
+  BPlusTree(const BPlusTree&) = delete;
+  BPlusTree& operator=(const BPlusTree&) = delete;
+  // A moved-from tree may only be destroyed or assigned to.
+  BPlusTree(BPlusTree&& other) noexcept { swapWith(other); }
+  BPlusTree& operator=(BPlusTree&& other) noexcept {
+    swapWith(other);
+    return *this;
+  }
+  ~BPlusTree() {
+    if (root_) destroyNode(root_);
+  }
+  // Inserts the entry, overwriting the value if the key is already registered.
+  void insert(const Key& key, const Value& value) { insertOrAssignImpl(key, value); }
+  void insert(Key&& key, Value&& value) { insertOrAssignImpl(std::move(key), std::move(value)); }
+
+  // Builds a (Key, Value) pair from args and inserts it unless the key is already registered.
+  // Returns true if the entry was inserted.
+  template <typename... Args>
+  bool emplace(Args&&... args) {
+    std::pair<Key, Value> entry(std::forward<Args>(args)...);
+    return tryEmplaceImpl(std::move(entry.first), std::move(entry.second));
+  }
+
+  // Same as emplace, but the value is constructed from args only when the key is absent.
+  template <typename... Args>
+  bool try_emplace(const Key& key, Args&&... args) {
+    return tryEmplaceImpl(key, std::forward<Args>(args)...);
+  }
+  template <typename... Args>
+  bool try_emplace(Key&& key, Args&&... args) {
+    return tryEmplaceImpl(std::move(key), std::forward<Args>(args)...);
+  }
+
+  // Inserts the entry or assigns obj to the existing value. Returns true if the entry was inserted.
+  template <typename M>
+  bool insert_or_assign(const Key& key, M&& obj) {
+    return insertOrAssignImpl(key, std::forward<M>(obj));
+  }
+  template <typename M>
+  bool insert_or_assign(Key&& key, M&& obj) {
+    return insertOrAssignImpl(std::move(key), std::forward<M>(obj));
+  }
+
+  // Inserts every entry, overwriting the values of registered keys, and returns how many keys were
+  // new. For a key given more than once the last entry wins. The entries are sorted and merged in
+  // the way merge_from() does, one pass per leaf under a single exclusive latch, so a batch costs
+  // one descent per leaf it touches rather than one per entry.
+  std::size_t insert_batch(std::vector<std::pair<Key, Value>> entries) {
+    sortKeepingLast(entries);
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    Finger finger;
+    return mergeSorted(entries.begin(), entries.end(), ConflictPolicy::Overwrite, finger);
+  }
+
+  // Puts and erases collected for apply(). Of several operations on one key the last one counts.
+  class WriteBatch {
+  public:
+    void put(Key key, Value value) { ops_.emplace_back(std::move(key), std::optional<Value>(std::move(value))); }
+    void erase(Key key) { ops_.emplace_back(std::move(key), std::nullopt); }
+    std::size_t size() const { return ops_.size(); }
+    bool empty() const { return ops_.empty(); }
+    void clear() { ops_.clear(); }
+
+  private:
+    friend class BPlusTree;
+    std::vector<std::pair<Key, std::optional<Value>>> ops_;
+  };
+
+  // Applies every operation of the batch atomically with respect to readers: find(), find_batch()
+  // and serialize() run entirely before or after it, and a scan sees it entirely if it committed
+  // before the scan started and not at all otherwise. Neither waits for the other: while scans are
+  // running the batch keeps the previous state of its keys for them (one more finger walk). The
+  // operations are sorted, the erases resolved by one finger walk and the puts merged leaf by leaf
+  // as in insert_batch(), so a batch costs one descent and at most one rebuild per leaf it touches.
+  void apply(WriteBatch batch) {
+    sortKeepingLast(batch.ops_);
+    std::vector<std::pair<Key, Value>> puts;
+    std::vector<Key> erases;
+    for (auto& [key, value] : batch.ops_) {
+      if (value) {
+        puts.emplace_back(std::move(key), std::move(*value));
+      } else {
+        erases.push_back(std::move(key));
+      }
+    }
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    installBatch(puts, erases);
+  }
+
+  // Optimistic transaction (Silo-style OCC), started by begin(). Reads go to the tree right away,
+  // each under the latch for just that read, and record the version of every leaf they looked at;
+  // writes are buffered in the transaction, and its own reads see them. commit() validates under
+  // the shared latch, then again and installs in one short exclusive section, as a write batch like
+  // apply(): it fails if any recorded leaf changed or was freed since it was read, so the
+  // transaction commits only if everything it read is still current, which makes committed
+  // transactions serializable. Because a range read records every leaf that covers the range, an
+  // insert into it (a phantom) fails the commit too. Conflicts are detected per leaf, not per key;
+  // a node slot's generation tells a freed or reused leaf from the one that was read.
+  class Transaction {
+  public:
+    std::optional<Value> get(const Key& key) {
+      if (auto it = writes_.find(key); it != writes_.end()) return it->second;
+      return tree_->transactionalFind(key, reads_);
+    }
+
+    // Calls fn(key, value) for the entries with lo <= key < hi in key order, the transaction's own
+    // writes included; fn may return false to stop early. The range is read in full before fn runs.
+    template <typename Fn>
+    void scan(const Key& lo, const Key& hi, Fn&& fn) {
+      std::vector<std::pair<Key, Value>> entries;
+      tree_->transactionalRange(lo, hi, entries, reads_);
+      auto write = writes_.lower_bound(lo);
+      const auto writes_end = writes_.lower_bound(hi);
+      for (auto entry = entries.begin(); entry != entries.end() || write != writes_end;) {
+        const bool own = write != writes_end && (entry == entries.end() || !(entry->first < write->first));
+        if (!own) {
+          if (!visitEntry(fn, entry->first, entry->second)) return;
+          ++entry;
+          continue;
+        }
+        if (entry != entries.end() && !(write->first < entry->first)) ++entry;  // overridden by the write
+        if (write->second && !visitEntry(fn, write->first, *write->second)) return;
+        ++write;
+      }
+    }
+
+    void put(Key key, Value value) { writes_.insert_or_assign(std::move(key), std::optional<Value>(std::move(value))); }
+    void erase(Key key) { writes_.insert_or_assign(std::move(key), std::nullopt); }
+
+    // Installs the writes if nothing read has changed and returns true; otherwise returns false and
+    // writes nothing. Either way the transaction starts over empty and can be used again.
+    bool commit() {
+      std::vector<std::pair<Key, Value>> puts;
+      std::vector<Key> erases;
+      for (auto& [key, value] : writes_) {
+        if (value) {
+          puts.emplace_back(key, std::move(*value));
+        } else {
+          erases.push_back(key);
+        }
+      }
+      const bool committed = tree_->commitTransaction(reads_, puts, erases);
+      abort();
+      return committed;
+    }
+
+    // Drops the reads and writes.
+    void abort() {
+      reads_.clear();
+      writes_.clear();
+    }
+
+  private:
+    friend class BPlusTree;
+    explicit Transaction(BPlusTree& tree) : tree_(&tree) {}
+
+    BPlusTree* tree_;
+    std::vector<ScanPosition> reads_;  // every leaf read, with its version and generation then
+    std::map<Key, std::optional<Value>> writes_;  // nullopt: erase
+  };
+
+  // Starts a transaction on this tree, which must outlive it.
+  Transaction begin() { return Transaction(*this); }
+
+  // Position in the tree kept between calls, for lookups that land near the previous one. seek()
+  // climbs the remembered root-to-leaf path only as far as the key's range needs and descends from
+  // there (finger search), so a key in the same or a neighbouring leaf costs a search in a node or
+  // two instead of a descent from the root. The path is dropped whenever a node was freed or an
+  // internal node split since. The cursor holds a sorted copy of its leaf's entries: next() and
+  // prev() step through it without the latch, and see writes made to that leaf after it was read
+  // only once they reach another leaf or seek() again. The tree must outlive the cursor.
+  class Cursor {
+  public:
+    // Moves to the first entry whose key is not less than `key`. Returns valid().
+    bool seek(const Key& key) {
+      std::shared_lock<std::shared_mutex> lock(tree_->latch_);
+      load(tree_->cursorLeaf(path_, key, false));
+      index_ = lowerBound(key);
+      return index_ < entries_.size() || nextLeaf();
+    }
+
+    // The value of `key`, leaving the cursor where seek(key) does.
+    std::optional<Value> find(const Key& key) {
+      if (!seek(key) || key < entries_[index_].first) return std::nullopt;
+      return entries_[index_].second;
+    }
+
+    // Moves to the next or previous entry. Stepping off either end invalidates the cursor, which
+    // then stays invalid until the next seek(). Return valid().
+    bool next() {
+      if (!valid()) return false;
+      if (++index_ < entries_.size()) return true;
+      std::shared_lock<std::shared_mutex> lock(tree_->latch_);
+      return nextLeaf();
+    }
+    bool prev() {
+      if (!valid()) return false;
+      if (index_ > 0) {
+        --index_;
+        return true;
+      }
+      std::shared_lock<std::shared_mutex> lock(tree_->latch_);
+      return prevLeaf();
+    }
+
+    bool valid() const { return index_ < entries_.size(); }
+    const Key& key() const { return entries_[index_].first; }
+    const Value& value() const { return entries_[index_].second; }
+
+  private:
+    friend class BPlusTree;
+    explicit Cursor(const BPlusTree& tree) : tree_(&tree) {}
+
+    std::size_t lowerBound(const Key& key) const {
+      auto it = std::lower_bound(entries_.begin(), entries_.end(), key, [](const auto& entry, const Key& k) { return entry.first < k; });
+      return static_cast<std::size_t>(it - entries_.begin());
+    }
+
+    // Copies the leaf's entries unless they are the ones already held.
+    void load(const Node* leaf) {
+      if (loaded_ == tree_->positionOf(leaf)) return;
+      entries_.clear();
+      tree_->forEachEntry(leaf, [&](const Key& key, const Value& value) { entries_.emplace_back(key, value); });
+      if (leaf->tail != 0) {
+        std::sort(entries_.begin(), entries_.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+      }
+      loaded_ = tree_->positionOf(leaf);
+    }
+
+    // Moves to the first entry of the leaves after the current one, under the latch.
+    bool nextLeaf() {
+      while (path_.uppers.back()) {
+        const Key bound = *path_.uppers.back();
+        load(tree_->cursorLeaf(path_, bound, false));
+        index_ = lowerBound(bound);
+        if (index_ < entries_.size()) return true;
+      }
+      index_ = entries_.size();
+      return false;
+    }
+    // Moves to the last entry of the leaves before the current one, under the latch.
+    bool prevLeaf() {
+      while (path_.lowers.back()) {
+        const Key bound = *path_.lowers.back();
+        load(tree_->cursorLeaf(path_, bound, true));
+        index_ = lowerBound(bound);
+        if (index_ > 0) {
+          --index_;
+          return true;
+        }
+      }
+      index_ = entries_.size();
+      return false;
+    }
+
+    const BPlusTree* tree_;
+    CursorPath path_;
+    ScanPosition loaded_;  // the leaf entries_ was copied from
+    std::vector<std::pair<Key, Value>> entries_;
+    std::size_t index_ = 0;
+  };
+
+  // A cursor on this tree, which must outlive it; it is positioned by its first seek().
+  Cursor cursor() const { return Cursor(*this); }
+
+  std::optional<Value> find(const Key& key) const {
+    // With a memory budget a lookup may reload and evict leaves, so it needs the latch exclusively.
+    std::shared_lock<std::shared_mutex> shared(latch_, std::defer_lock);
+    std::unique_lock<std::shared_mutex> exclusive(latch_, std::defer_lock);
+    if (budgeted()) {
+      exclusive.lock();
+    } else {
+      shared.lock();
+    }
+    Node* leaf = findLeaf(key);
+    const bool reloaded = touchLeaf(leaf);
+    const Slot slot = locate(leaf, key);
+    std::optional<Value> result;
+    if (slot.found) {
+      result = leaf->values[slot.index];
+    }
+    if (reloaded) enforceMemoryBudget();
+    return result;
+  }
+
+  // Looks up every key and returns the results in the same order. The probes are resolved in key
+  // order by a finger that climbs only as far as the next key needs, so neighbouring keys share most
+  // of their descent and the leaves are visited left to right.
+  std::vector<std::optional<Value>> find_batch(const std::vector<Key>& keys) const {
+    std::vector<std::optional<Value>> results(keys.size());
+    const std::vector<std::size_t> order = probeOrder(keys);
+    resolveProbes(keys, order.data(), order.data() + order.size(), results);
+    return results;
+  }
+
+  // find_batch() with the sorted probes cut at internal-node separators, so every task of the shared
+  // scheduler resolves the probes of its own subtrees, at most `threads` at once (0: all workers).
+  // Each task holds the latch shared while it runs. A tree with a memory budget reloads and evicts
+  // leaves under the exclusive latch, which would run the tasks one after another, so it falls back
+  // to find_batch() instead.
+  std::vector<std::optional<Value>> find_batch_parallel(const std::vector<Key>& keys, unsigned threads = 0) const {
+    if (budgeted()) return find_batch(keys);
+    std::vector<std::optional<Value>> results(keys.size());
+    if (keys.empty()) return results;
+    const std::vector<std::size_t> order = probeOrder(keys);
+    // Like the scans, the chunks hold the latch one at a time and must not straddle a write batch.
+    const ScanPin pin(*this);
+    const std::vector<Key> bounds = chunkBounds(keys[order.front()], keys[order.back()], workerCount(threads) * kChunksPerWorker);
+    // Chunk c takes the probes in [bounds[c], bounds[c + 1]); the last one also takes the largest key.
+    std::vector<const std::size_t*> cuts{order.data()};
+    for (std::size_t c = 1; c + 1 < bounds.size(); ++c) {
+      cuts.push_back(std::lower_bound(cuts.back(), order.data() + order.size(), bounds[c],
+                                      [&](std::size_t probe, const Key& bound) { return keys[probe] < bound; }));
+    }
+    cuts.push_back(order.data() + order.size());
+    runChunks(cuts.size() - 1, workerCount(threads), [&](std::size_t chunk) {
+      resolveProbes(keys, cuts[chunk], cuts[chunk + 1], results, pin.start());
+    });
+    return results;
+  }
+
+  // Removes the entry and returns whether it existed. Leaves are only unlinked once they are empty
+  // (free-at-empty); compact() merges the underfull nodes that deletions leave behind.
+  bool erase(const Key& key) {
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    Node* leaf = findLeaf(key);
+    const bool reloaded = touchLeaf(leaf);
+    const Slot slot = locate(leaf, key);
+    if (slot.found) {
+      logChange(MutationKind::Erase, key);
+      eraseFromLeaf(leaf, slot.index);
+    }
+    if (reloaded) enforceMemoryBudget();
+    return slot.found;
+  }
+
+  // Removes the entries with lo <= key < hi and returns how many there were. A range within one leaf
+  // is cut out of it directly. A wider one is cut out like split_at() does, at lo and at hi, so the
+  // subtrees in between are detached whole and freed; the two remaining halves are joined again and
+  // the nodes along the seam merged with their siblings where they fit.
+  std::size_t erase_range(const Key& lo, const Key& hi) {
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    if (!(lo < hi)) return 0;
+    logChange(MutationKind::EraseRange, lo, &hi);
+    Node* leaf = findLeaf(lo);
+    if (leaf == findLeaf(hi)) return eraseWithinLeaf(leaf, lo, hi);
+    BPlusTree middle(*this, SharedStorage{});
+    splitOff(lo, middle, false);
+    BPlusTree right(*this, SharedStorage{});
+    middle.splitOff(hi, right, false);
+    // Only the detached middle is walked to count what was erased; the halves keep the totals.
+    std::size_t erased = 0;
+    std::size_t erased_bytes = 0;
+    for (const Node* gone = middle.leftmostLeaf(middle.root_); gone; gone = middle.nextLeaf(gone)) {
+      erased += entryCount(gone);
+      erased_bytes += residentBytes(gone);
+    }
+    graft(right);
+    // Leaves reloaded by the second cut were charged to middle.
+    size_ -= erased;
+    resident_bytes_ = resident_bytes_ + middle.resident_bytes_ - erased_bytes;
+    destroyNode(middle.root_);
+    destroyNode(right.root_);
+    middle.root_ = nullptr;
+    right.root_ = nullptr;
+    while (mergeAlongPath(lo)) {}
+    enforceMemoryBudget();
+    return erased;
+  }
+
+  // Removes the entries with a key >= `key` and returns how many there were. They are cut off like
+  // split_at() does, but the detached nodes are freed instead of handed to a new tree.
+  std::size_t erase_from(const Key& key) {
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    BPlusTree right(*this, SharedStorage{});
+    splitOff(key, right, false);
+    std::size_t erased = 0;
+    std::size_t erased_bytes = 0;
+    for (const Node* gone = right.leftmostLeaf(right.root_); gone; gone = right.nextLeaf(gone)) {
+      erased += entryCount(gone);
+      erased_bytes += residentBytes(gone);
+    }
+    if (erased != 0) logChange(MutationKind::EraseFrom, key);
+    size_ -= erased;
+    resident_bytes_ -= erased_bytes;
+    destroyNode(right.root_);
+    right.root_ = nullptr;
+    while (mergeAlongPath(key)) {}
+    enforceMemoryBudget();
+    return erased;
+  }
+
+  // Runs one slice of online defragmentation, visiting at most `budget` leaves: adjacent nodes whose
+  // entries fit into one are merged, and spare array capacity is released. Successive calls resume
+  // where the previous slice stopped, so a maintenance thread can compact a live tree in short
+  // steps (each slice holds the latch exclusively). Returns true once a pass has covered the
+  // whole tree; the next call starts a new pass.
+  bool compact(std::size_t budget) {
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    Node* leaf = compact_cursor_ ? findLeaf(*compact_cursor_) : leftmostLeaf(root_);
+    settleCounts();
+    if (size_ == 0) return true;
+    for (std::size_t visited = 0; visited < budget; ++visited) {
+      while (mergeWithRightSibling(leaf)) {}
+      shrinkNode(leaf);
+      // Parents are compacted once their last child has been visited.
+      for (Node* node = leaf; !isRoot(node) && node->self == parentOf(node)->children.back();) {
+        node = parentOf(node);
+        while (mergeWithRightSibling(node)) {}
+        shrinkNode(node);
+      }
+      Node* next = nextLeaf(leaf);
+      if (!next) {
+        compact_cursor_.reset();
+        collapseRoot();
+        return true;
+      }
+      leaf = next;
+    }
+    compact_cursor_ = lowerFence(leaf);
+    collapseRoot();
+    return false;
+  }
+
+  // Stores the keys of every resident leaf frame-of-reference encoded: the leaf's smallest key in
+  // full and every key as its distance to it, bit-packed as wide as the leaf's key range needs.
+  // Clustered keys take a few bits each instead of sizeof(Key) bytes. Lookups binary-search the
+  // packed keys in place and scans decode them; a write to a frozen leaf unpacks it again until
+  // the next freeze(), so this suits read-mostly trees. Needs integer keys.
+  void freeze() {
+    static_assert(detail::kDeltaEncodable<Key>, "freeze() needs integer keys");
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    for (Node* leaf = leftmostLeaf(root_); leaf; leaf = nextLeaf(leaf)) {
+      if (!leaf->evicted && !leaf->frozen && entryCount(leaf) != 0) freezeLeaf(leaf);
+    }
+  }
+
+  // Calls hook(mutation) for every change made to the entries from now on: a Put per entry inserted
+  // or overwritten (merge_from() and a join() included), an Erase per erase(), one EraseRange per
+  // erase_range() and one EraseFrom per split_at() or erase_from(). The hook runs under the exclusive latch, so the
+  // calls come in commit order; it must not call back into the tree. Pass an empty hook to detach.
+  // Replaying the mutations in order on a copy of the tree reproduces it, also if the copy already
+  // holds some of them: each one sets its keys regardless of their previous state.
+  void set_change_hook(std::function<void(const Mutation<Key, Value>&)> hook) {
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    change_hook_ = std::move(hook);
+  }
+
+  std::size_t size() const {
+    std::shared_lock<std::shared_mutex> lock(latch_);
+    settleCounts();
+    return size_;
+  }
+  bool empty() const { return size() == 0; }
+
+  // Merges a copy of every entry of `other` into this tree and returns how many keys were new. Both
+  // trees are walked in key order: the entries bound for one leaf are merged into it in a single pass
+  // (split over as many new leaves as needed) and subtrees that receive nothing are never visited.
+  // Keys present in both trees are resolved by `policy`. `other` is only read.
+  std::size_t merge_from(const BPlusTree& other, ConflictPolicy policy = ConflictPolicy::Overwrite) {
+    if (&other == this) return 0;
+    std::unique_lock<std::shared_mutex> lock(latch_, std::defer_lock);
+    std::shared_lock<std::shared_mutex> other_lock(other.latch_, std::defer_lock);
+    std::lock(lock, other_lock);
+    return mergeFrom(other, policy);
+  }
+
+  // Moves every entry with a key >= `key` into a new tree and returns it. Only the nodes on the path
+  // to `key` are cut in two; the subtrees right of that path are handed over as they are, and both
+  // trees count their entries again on the first call that needs the total (size(), stats(),
+  // compact(), join(), snapshots). The new tree has the same options and shares
+  // this tree's node arena and spill file, which lets join() re-link the two later; otherwise they
+  // are independent, each with its own latch. Nodes along the cut may be underfull until compact().
+  BPlusTree split_at(const Key& key) {
+    std::unique_lock<std::shared_mutex> lock(latch_);
+    BPlusTree right(*this, SharedStorage{});
+    // erase_range() cuts temporaries under this latch; a returned tree allocates on its own.
+    arena_->share();
+    splitOff(key, right, true);
+    // Empty leaves other than the root are unlinked, so the leftmost one tells.
+    if (entryCount(right.leftmostLeaf(right.root_)) != 0) logChange(MutationKind::EraseFrom, key);
+    enforceMemoryBudget();
+    right.enforceMemoryBudget();
+    return right;
+  }
+
+  // Appends every entry of `other`, whose keys must all be greater than this tree's, and leaves it
+  // empty. If the trees share a node arena (one was split off the other, see split_at()), the root of
+  // the shorter tree is hung under the boundary spine of the taller one at the matching height, in
+  // O(log n); otherwise the entries are moved over one by one. Throws std::invalid_argument if the
+  // key ranges overlap.
+  void join(BPlusTree& other) {
+    if (&other == this) throw std::invalid_argument("B+Tree cannot be joined with itself");
+    std::unique_lock<std::shared_mutex> lock(latch_, std::defer_lock);
+    std::unique_lock<std::shared_mutex> other_lock(other.latch_, std::defer_lock);
+    std::lock(lock, other_lock);
+    settleCounts();
+    other.settleCounts();
+    if (other.size_ == 0) return;
+    if (size_ != 0 && !(leafBoundary(rightmostLeaf(root_), true) < other.leafBoundary(other.leftmostLeaf(other.root_), false))) {
+      throw std::invalid_argument("B+Tree join needs all keys of the other tree to be greater");
+    }
+    if (arena_ == other.arena_) {
+      if (change_hook_) {
+        for (const Node* leaf = other.leftmostLeaf(other.root_); leaf; leaf = other.nextLeaf(leaf)) {
+          other.forEachEntry(leaf, [&](const Key& key, const Value& value) { logChange(MutationKind::Put, key, nullptr, &value); });
+        }
+      }
+      graft(other);
+    } else {
+      appendEntries(other);
+    }
+    clock_hand_ = nullptr;
+    ++node_epoch_;
+    enforceMemoryBudget();
+  }
+
+  // Writes every entry in key order in the snapshot format (see detail::kSnapshotMagic): blocks of
+  // about 64 KiB, each with its own checksum, holding varint lengths and delta-encoded integer keys.
+  // Each block is written as soon as it is encoded, so only one is held in memory. Writers wait until
+  // the whole tree is written, so the snapshot is consistent; to keep them from waiting on a slow
+  // stream, take snapshot() instead. Needs keys and values that are trivially copyable or
+  // std::string, as memory_budget does.
+  void serialize(std::ostream& out) const {
+    writeSnapshot([&](const char* data, std::size_t size) {
+      if (!out.write(data, static_cast<std::streamsize>(size))) throw std::runtime_error("cannot write B+Tree snapshot");
+    });
+  }
+  void serialize(int fd) const {
+    writeSnapshot([fd](const char* data, std::size_t size) { detail::writeFully(fd, data, size); });
+  }
+  // What serialize() writes, encoded into memory under the shared latch: writers wait for the
+  // encoding only, not for wherever the caller sends it. Takes room for the whole snapshot.
+  std::string snapshot() const {
+    std::string encoded;
+    writeSnapshot([&](const char* data, std::size_t size) { encoded.append(data, size); });
+    return encoded;
+  }
+
+  // Builds a tree from a snapshot written by serialize(), without a single insert: the entries fill
+  // the leaves in order, full, and the inner levels grow along their right edge. Blocks are read in
+  // rounds; each round is checked and decoded on the scheduler's workers before it is appended.
+  // Nodes along the right edge may be underfull until compact(). Throws std::runtime_error if the
+  // snapshot is truncated, corrupted or of another format version.
+  static BPlusTree deserialize(std::istream& in, BPlusTreeOptions options = {}) {
+    return readSnapshot(
+        [&](char* data, std::size_t size) {
+          in.read(data, static_cast<std::streamsize>(size));
+          return static_cast<std::size_t>(in.gcount());
+        },
+        std::move(options));
+  }
+  static BPlusTree deserialize(int fd, BPlusTreeOptions options = {}) {
+    return readSnapshot([fd](char* data, std::size_t size) { return detail::readFully(fd, data, size); }, std::move(options));
+  }
+
+  // Calls fn(key, value) for the entries with lo <= key < hi in key order; fn may return false to
+  // stop early. Scans run concurrently with writers: the latch is held only while one leaf is
+  // copied out, and fn runs without it. The next leaf is taken from the sibling link if the leaf
+  // just copied is unchanged (same version, no node freed since); otherwise the scan re-positions
+  // by the last key it visited. Either way a concurrent split or merge never makes it skip or
+  // repeat a key. A batch applied by apply() is seen entirely or not at all: the scan reads as of
+  // the batches committed when it started. fn may call back into the tree, writes and batches
+  // included.
+  template <typename Fn>
+  void scan(const Key& lo, const Key& hi, Fn&& fn) const {
+    const ScanPin pin(*this);
+    scanRange(lo, hi, pin.start(), fn);
+  }
+
+  // scan() over [lo, hi) cut into chunks at internal-node separators, spread over up to `threads`
+  // workers of the shared work-stealing scheduler (0: all of them). fn is called concurrently and
+  // sees keys in order only within a chunk; returning false stops the whole scan. An exception
+  // thrown by fn is rethrown here.
+  template <typename Fn>
+  void parallel_scan(const Key& lo, const Key& hi, Fn&& fn, unsigned threads = 0) const {
+    const unsigned workers = workerCount(threads);
+    const ScanPin pin(*this);
+    const std::vector<Key> bounds = chunkBounds(lo, hi, workers * kChunksPerWorker);
+    std::atomic<bool> stop{false};
+    runChunks(bounds.size() - 1, workers, [&](std::size_t chunk) {
+      scanRange(bounds[chunk], bounds[chunk + 1], pin.start(), [&](const Key& key, const Value& value) {
+        if (stop.load(std::memory_order_relaxed)) return false;
+        if (visitEntry(fn, key, value)) return true;
+        stop.store(true, std::memory_order_relaxed);
+        return false;
+      });
+    });
+  }
+
+  // Folds [lo, hi) in parallel: each chunk folds its entries with acc = fn(acc, key, value) starting
+  // from `identity`, and the chunk results are merged left to right with combine(left, right), so
+  // combine must be associative but need not be commutative.
+  template <typename T, typename Fn, typename Combine>
+  T parallel_reduce(const Key& lo, const Key& hi, T identity, Fn&& fn, Combine&& combine, unsigned threads = 0) const {
+    const unsigned workers = workerCount(threads);
+    const ScanPin pin(*this);
+    const std::vector<Key> bounds = chunkBounds(lo, hi, workers * kChunksPerWorker);
+    struct Partial {
+      T value;
+    };
+    std::vector<Partial> partials(bounds.size() - 1, Partial{identity});
+    runChunks(partials.size(), workers, [&](std::size_t chunk) {
+      T& acc = partials[chunk].value;
+      scanRange(bounds[chunk], bounds[chunk + 1], pin.start(), [&](const Key& key, const Value& value) { acc = fn(std::move(acc), key, value); });
+    });
+    T result = std::move(identity);
+    for (Partial& partial : partials) result = combine(std::move(result), std::move(partial.value));
+    return result;
+  }
+
+  // Walks the whole tree, the root's subtrees in parallel on the shared scheduler; meant for
+  // diagnostics and tests.
+  BPlusTreeStats stats() const {
+    std::shared_lock<std::shared_mutex> lock(latch_);
+    BPlusTreeStats stats;
+    settleCounts();
+    stats.entries = size_;
+    stats.height = 1;
+    tallyNode(root_, stats);
+    if (!root_->leaf) {
+      const std::size_t fanout = root_->children.size();
+      std::vector<BPlusTreeStats> subtrees(fanout);
+      runChunks(fanout, workerCount(0), [&](std::size_t i) { subtrees[i].height = tallySubtree(childAt(root_, i), subtrees[i]); });
+      for (const BPlusTreeStats& subtree : subtrees) {
+        stats.height = std::max(stats.height, subtree.height + 1);
+        stats.leaves += subtree.leaves;
+        stats.internal_nodes += subtree.internal_nodes;
+        stats.node_bytes += subtree.node_bytes;
+        stats.evicted_leaves += subtree.evicted_leaves;
+        stats.frozen_leaves += subtree.frozen_leaves;
+      }
+    }
+    stats.leaf_fill = static_cast<double>(stats.entries) / static_cast<double>(stats.leaves * maxKeys());
+    stats.resident_bytes = resident_bytes_;
+    stats.arena_bytes = arena_->reserved_bytes();
+    stats.huge_page_bytes = arena_->huge_page_bytes();
+    return stats;
+  }
+private:
+    static constexpr std::size_t maxKeys() { return Order - 1; }
+
+    Node* newNode(bool leaf) {
+        const NodeId id = nodes_.create(leaf, arena_.get());
+        Node* created = node(id);
+        created->self = id;
+        return created;
+    }
+    // Adds one node to the counts of stats().
+    static void tallyNode(const Node* node, BPlusTreeStats& stats) {
+        stats.node_bytes += sizeof(Node) + detail::allocatedBytes(node->keys) + detail::allocatedBytes(node->values) +
+                            detail::allocatedBytes(node->children) + detail::allocatedBytes(node->fingerprints) +
+                            node->frozen_words * sizeof(std::uint64_t);
+        if (node->leaf) {
+            ++stats.leaves;
+            stats.evicted_leaves += node->evicted ? 1 : 0;
+            stats.frozen_leaves += node->frozen ? 1 : 0;
+        } else {
+            ++stats.internal_nodes;
+        }
+    }
+
+    // Tallies the subtree under `node` and returns its height.
+    std::size_t tallySubtree(const Node* node, BPlusTreeStats& stats) const {
+        tallyNode(node, stats);
+        std::size_t height = 0;
+        for (NodeId child : node->children) height = std::max(height, tallySubtree(this->node(child), stats));
+        return height + 1;
+    }
+
+    // Frees the node together with its subtree.
+    void destroyNode(Node* node) {
+        for (NodeId child : node->children) destroyNode(this->node(child));
+        // The spill file may outlive this tree (split_at() shares it), so give the region back.
+        if (spill_ && node->leaf) spill_->release(node->spill);
+        releaseFrozen(node);
+        nodes_.destroy(node->self);
+        ++node_epoch_;
+    }
+
+    Node* node(NodeId id) const { return nodes_.get(id); }
+    static bool isRoot(const Node* node) { return node->parent == kNoNode; }
+    Node* parentOf(const Node* node) const { return isRoot(node) ? nullptr : this->node(node->parent); }
+    Node* childAt(const Node* parent, std::size_t index) const { return node(parent->children[index]); }
+
+    void swapWith(BPlusTree& other) noexcept {
+        std::swap(arena_, other.arena_);
+        nodes_.swap(other.nodes_);
+        std::swap(root_, other.root_);
+        std::swap(options_, other.options_);
+        std::swap(size_, other.size_);
+        std::swap(compact_cursor_, other.compact_cursor_);
+        std::swap(spill_, other.spill_);
+        std::swap(resident_bytes_, other.resident_bytes_);
+        std::swap(clock_hand_, other.clock_hand_);
+        const bool stale = counts_stale_.load(std::memory_order_relaxed);
+        counts_stale_.store(other.counts_stale_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        other.counts_stale_.store(stale, std::memory_order_relaxed);
+        std::swap(version_clock_, other.version_clock_);
+        std::swap(node_epoch_, other.node_epoch_);
+        std::swap(split_epoch_, other.split_epoch_);
+        std::swap(batch_sequence_, other.batch_sequence_);
+        std::swap(batch_undo_, other.batch_undo_);
+        std::swap(change_hook_, other.change_hook_);
+    }
+
+    // Where a key lives in a leaf, or where it belongs in the sorted part if it is absent.
+    struct Slot {
+        std::size_t index;
+        bool found;
+    };
+
+    static Slot locate(const Node* leaf, const Key& key) {
+        if (leaf->frozen) return locateFrozen(leaf, key);
+        const auto sorted_end = leaf->keys.end() - static_cast<std::ptrdiff_t>(leaf->tail);
+        auto it = std::lower_bound(leaf->keys.begin(), sorted_end, key);
+        const std::size_t index = static_cast<std::size_t>(std::distance(leaf->keys.begin(), it));
+        if (it != sorted_end && *it == key) return {index, true};
+        if (leaf->tail != 0) {
+            const std::size_t tail_begin = leaf->keys.size() - leaf->tail;
+            const std::uint8_t print = detail::fingerprint(key);
+            const std::uint8_t* prints = leaf->fingerprints.data();
+            const std::uint8_t* end = prints + leaf->tail;
+            for (const std::uint8_t* hit = prints;
+                 (hit = static_cast<const std::uint8_t*>(std::memchr(hit, print, static_cast<std::size_t>(end - hit))));
+                 ++hit) {
+                const std::size_t i = tail_begin + static_cast<std::size_t>(hit - prints);
+                if (leaf->keys[i] == key) return {i, true};
+            }
+        }
+        return {index, false};
+    }
+
+    template <typename K, typename... Args>
+    bool tryEmplaceImpl(K&& key, Args&&... args) {
+        std::unique_lock<std::shared_mutex> lock(latch_);
+        Node* leaf = findLeafForInsert(key);
+        const Slot slot = locate(leaf, key);
+        if (slot.found) return false;
+        insertIntoLeaf(leaf, slot.index, std::forward<K>(key), std::forward<Args>(args)...);
+        enforceMemoryBudget();
+        return true;
+    }
+
+    template <typename K, typename M>
+    bool insertOrAssignImpl(K&& key, M&& obj) {
+        std::unique_lock<std::shared_mutex> lock(latch_);
+        Node* leaf = findLeafForInsert(key);
+        const Slot slot = locate(leaf, key);
+
+        // The key is already registered, updating the value.
+        if (slot.found) {
+            bumpVersion(leaf);
+            release(leaf->keys[slot.index], leaf->values[slot.index]);
+            leaf->values[slot.index] = std::forward<M>(obj);
+            charge(leaf->keys[slot.index], leaf->values[slot.index]);
+            logChange(MutationKind::Put, leaf->keys[slot.index], nullptr, &leaf->values[slot.index]);
+            enforceMemoryBudget();
+            return false;
+        }
+        insertIntoLeaf(leaf, slot.index, std::forward<K>(key), std::forward<M>(obj));
+        enforceMemoryBudget();
+        return true;
+    }
+
+    Node* findLeafForInsert(const Key& key) {
+        Node* leaf = findLeaf(key);
+        touchLeaf(leaf);
+        thawLeaf(leaf);
+        // Leaves come out of a split already spread; this covers the root leaf and any leaf packed since.
+        if (options_.leaf_layout == LeafLayout::Gapped && !leaf->gapped && !leaf->keys.empty()) {
+            spreadLeaf(leaf);
+        }
+        return leaf;
+    }
+
+    static std::size_t entryCount(const Node* leaf) {
+        return leaf->gapped || leaf->evicted || leaf->frozen ? leaf->live : leaf->keys.size();
+    }
+
+    template <typename K, typename... Args>
+    void insertIntoLeaf(Node* leaf, std::size_t index, K&& key, Args&&... args) {
+        ++size_;
+        bumpVersion(leaf);
+        if (leaf->gapped) {
+            index = insertIntoGap(leaf, index, Key(std::forward<K>(key)), Value(std::forward<Args>(args)...));
+        } else if (options_.leaf_layout == LeafLayout::Append) {
+            index = appendToTail(leaf, std::forward<K>(key), std::forward<Args>(args)...);
+        } else {
+            const auto offset = static_cast<std::ptrdiff_t>(index);
+            leaf->keys.emplace(leaf->keys.begin() + offset, std::forward<K>(key));
+            leaf->values.emplace(leaf->values.begin() + offset, std::forward<Args>(args)...);
+        }
+        charge(leaf->keys[index], leaf->values[index]);
+        logChange(MutationKind::Put, leaf->keys[index], nullptr, &leaf->values[index]);
+
+        // If it overflows, recursively split the buckets. (splitLeaf -> insertIntoParent -> splitLeaf -> ...)
+        // TODO(hikettei): splitInternal and splitLeaf are just doing the same stuff thus they should not be separated.
+        if (entryCount(leaf) > maxKeys()) {
+            handleLeafOverflow(leaf);
+        } else if (leaf->tail > appendTailLimit()) {
+            sortTail(leaf);
+        } else if (!isRoot(leaf) && index == 0) {
+            // Keep parent separators in sync when this leaf now owns a new minimal key.
+            updateParentKeyForChild(leaf);
+        }
+    }
+    Node* findLeaf(const Key& key) const {
+        Node* node = root_;
+        while (!node->leaf) {
+            auto it = std::upper_bound(node->keys.begin(), node->keys.end(), key);
+            std::size_t index = static_cast<std::size_t>(std::distance(node->keys.begin(), it));
+            node = childAt(node, index);
+        }
+        return node;
+    }
+
+    // Reports a change to the hook, if one is set (see set_change_hook()).
+    void logChange(MutationKind kind, const Key& key, const Key* end = nullptr, const Value* value = nullptr) const {
+        if (change_hook_) change_hook_(Mutation<Key, Value>{kind, &key, end, value});
+    }
+
+    // --- Gapped leaves ---------------------------------------------------------------------------
+    static bool isOccupied(const Node* leaf, std::size_t slot) {
+        return (leaf->occupied[slot / 64] >> (slot % 64)) & 1u;
+    }
+    static void markOccupied(Node* leaf, std::size_t slot) {
+        leaf->occupied[slot / 64] |= std::uint64_t{1} << (slot % 64);
+    }
+
+    // First slot at or after `from` whose occupancy equals `want_occupied`, or Order if there is none.
+    static std::size_t nextSlot(const Node* leaf, std::size_t from, bool want_occupied) {
+        for (std::size_t word = from / 64; word < leaf->occupied.size(); ++word) {
+            std::uint64_t bits = want_occupied ? leaf->occupied[word] : ~leaf->occupied[word];
+            if (word == from / 64) bits &= ~std::uint64_t{0} << (from % 64);
+            if (bits != 0) return std::min<std::size_t>(word * 64 + detail::countTrailingZeros(bits), Order);
+        }
+        return Order;
+    }
+
+    // Last slot before `before` whose occupancy equals `want_occupied`, or Order if there is none.
+    static std::size_t previousSlot(const Node* leaf, std::size_t before, bool want_occupied) {
+        if (before == 0) return Order;
+        const std::size_t last = before - 1;
+        for (std::size_t word = last / 64 + 1; word-- > 0;) {
+            std::uint64_t bits = want_occupied ? leaf->occupied[word] : ~leaf->occupied[word];
+            if (word == last / 64 && last % 64 != 63) bits &= (std::uint64_t{2} << (last % 64)) - 1;
+            if (bits != 0) return word * 64 + 63 - detail::countLeadingZeros(bits);
+        }
+        return Order;
+    }
+
+    // Places the key just in front of slot `pos` (its lower_bound) and returns the slot it ended up in.
+    std::size_t insertIntoGap(Node* leaf, std::size_t pos, Key key, Value value) {
+        auto& keys = leaf->keys;
+        auto& values = leaf->values;
+        std::size_t slot;
+        if (pos > 0 && !isOccupied(leaf, pos - 1)) {
+            // Take the first gap after the preceding entry; the rest of that run now repeats the new key.
+            slot = previousSlot(leaf, pos, true) + 1;
+            for (std::size_t gap = slot + 1; gap < pos; ++gap) keys[gap] = key;
+        } else {
+            // Shift towards whichever gap is closer. A leaf below capacity always has one.
+            const std::size_t right = nextSlot(leaf, pos, false);
+            const std::size_t left = previousSlot(leaf, pos == 0 ? 0 : pos - 1, false);
+            if (left == Order || (right != Order && right - pos <= pos - 1 - left)) {
+                std::move_backward(keys.begin() + static_cast<std::ptrdiff_t>(pos),
+                                   keys.begin() + static_cast<std::ptrdiff_t>(right),
+                                   keys.begin() + static_cast<std::ptrdiff_t>(right + 1));
+                std::move_backward(values.begin() + static_cast<std::ptrdiff_t>(pos),
+                                   values.begin() + static_cast<std::ptrdiff_t>(right),
+                                   values.begin() + static_cast<std::ptrdiff_t>(right + 1));
+                markOccupied(leaf, right);
+                slot = pos;
+            } else {
+                std::move(keys.begin() + static_cast<std::ptrdiff_t>(left + 1),
+                          keys.begin() + static_cast<std::ptrdiff_t>(pos), keys.begin() + static_cast<std::ptrdiff_t>(left));
+                std::move(values.begin() + static_cast<std::ptrdiff_t>(left + 1),
+                          values.begin() + static_cast<std::ptrdiff_t>(pos), values.begin() + static_cast<std::ptrdiff_t>(left));
+                markOccupied(leaf, left);
+                slot = pos - 1;
+            }
+        }
+        keys[slot] = std::move(key);
+        values[slot] = std::move(value);
+        markOccupied(leaf, slot);
+        ++leaf->live;
+        chargeGaps(leaf);
+        return slot;
+    }
+
+    void eraseFromGap(Node* leaf, std::size_t slot) {
+        if (leaf->live == 1) {
+            leaf->keys.clear();
+            leaf->values.clear();
+            leaf->occupied.fill(0);
+            leaf->gapped = false;
+            leaf->live = 0;
+            chargeGaps(leaf);
+            return;
+        }
+        if (slot == 0) {
+            // Slot 0 must stay live: pull the next entry forward and free its slot instead.
+            const std::size_t next = nextSlot(leaf, 1, true);
+            leaf->keys[0] = std::move(leaf->keys[next]);
+            leaf->values[0] = std::move(leaf->values[next]);
+            slot = next;
+        }
+        leaf->occupied[slot / 64] &= ~(std::uint64_t{1} << (slot % 64));
+        --leaf->live;
+        // The gap run now following the previous entry has to repeat that entry's key.
+        const std::size_t before = previousSlot(leaf, slot, true);
+        for (std::size_t gap = before + 1; gap < Order && !isOccupied(leaf, gap); ++gap) {
+            leaf->keys[gap] = leaf->keys[before];
+        }
+        chargeGaps(leaf);
+    }
+
+    // Gaps repeat the key before them, and those copies hold memory like any key (a std::string
+    // key's heap buffer, say). A budgeted tree charges them per leaf, refreshed whenever the gaps change.
+    void chargeGaps(Node* leaf) const {
+        if constexpr (kSpillable) {
+            if (!budgeted()) return;
+            std::size_t bytes = 0;
+            if (leaf->gapped && std::is_trivially_copyable_v<Key>) {
+                bytes = (Order - leaf->live) * sizeof(Key);
+            } else if (leaf->gapped) {
+                for (std::size_t slot = nextSlot(leaf, 0, false); slot < Order; slot = nextSlot(leaf, slot + 1, false)) {
+                    bytes += detail::Codec<Key>::footprint(leaf->keys[slot]);
+                }
+            }
+            resident_bytes_ = resident_bytes_ - leaf->gap_bytes + bytes;
+            leaf->gap_bytes = bytes;
+        } else {
+            (void)leaf;
+        }
+    }
+
+    // --- Append leaves ----------------------------------------------------------------------------
+    std::size_t appendTailLimit() const {
+        if (options_.append_tail_limit != 0) return options_.append_tail_limit;
+        return std::max<std::size_t>(Order / 4, 1);
+    }
+
+    // Returns the index of the new entry. Separators need no refresh for tail entries: keys routed
+    // here are never smaller than the one bounding this leaf.
+    template <typename K, typename... Args>
+    std::size_t appendToTail(Node* leaf, K&& key, Args&&... args) {
+        leaf->fingerprints.push_back(detail::fingerprint(key));
+        leaf->keys.emplace_back(std::forward<K>(key));
+        leaf->values.emplace_back(std::forward<Args>(args)...);
+        ++leaf->tail;
+        return leaf->keys.size() - 1;
+    }
+
+    // Sorts the tail and merges it into the sorted part of the leaf. Only the tail is buffered;
+    // the merge runs backwards in place.
+    static void sortTail(Node* leaf) {
+        auto& keys = leaf->keys;
+        auto& values = leaf->values;
+        std::size_t sorted_end = keys.size() - leaf->tail;
+        std::vector<std::size_t> order(leaf->tail);
+        std::iota(order.begin(), order.end(), sorted_end);
+        std::sort(order.begin(), order.end(), [&keys](std::size_t a, std::size_t b) { return keys[a] < keys[b]; });
+        std::vector<std::pair<Key, Value>> tail;
+        tail.reserve(order.size());
+        for (std::size_t index : order) tail.emplace_back(std::move(keys[index]), std::move(values[index]));
+
+        std::size_t out = keys.size();
+        for (std::size_t pending = tail.size(); pending > 0;) {
+            --out;
+            if (sorted_end > 0 && tail[pending - 1].first < keys[sorted_end - 1]) {
+                --sorted_end;
+                keys[out] = std::move(keys[sorted_end]);
+                values[out] = std::move(values[sorted_end]);
+            } else {
+                --pending;
+                keys[out] = std::move(tail[pending].first);
+                values[out] = std::move(tail[pending].second);
+            }
+        }
+        leaf->tail = 0;
+        leaf->fingerprints.clear();
+    }
+
+    // Spreads the entries of a dense leaf evenly over all Order slots.
+    void spreadLeaf(Node* leaf) const {
+        const std::size_t count = leaf->keys.size();
+        leaf->keys.resize(Order);
+        leaf->values.resize(Order);
+        // Entry i goes to slot i * Order / count; walking backwards never overwrites a pending entry.
+        for (std::size_t i = count; i-- > 1;) {
+            const std::size_t slot = i * Order / count;
+            if (slot == i) break;  // every remaining entry is already in place
+            leaf->keys[slot] = std::move(leaf->keys[i]);
+            leaf->values[slot] = std::move(leaf->values[i]);
+        }
+        leaf->occupied.fill(0);
+        std::size_t next = 0;
+        for (std::size_t slot = 0; slot < Order; ++slot) {
+            if (next < count && slot == next * Order / count) {
+                markOccupied(leaf, slot);
+                ++next;
+            } else {
+                leaf->keys[slot] = leaf->keys[slot - 1];
+            }
+        }
+        leaf->gapped = true;
+        leaf->live = count;
+        chargeGaps(leaf);
+    }
+
+    // Turns a gapped or append leaf back into a dense sorted leaf.
+    // Leaves the leaf's entries dense and sorted in keys/values.
+    void packLeaf(Node* leaf) const {
+        thawLeaf(leaf);
+        if (leaf->tail != 0) sortTail(leaf);
+        if (!leaf->gapped) return;
+        std::size_t out = 0;
+        for (std::size_t slot = 0; slot < Order; ++slot) {
+            if (!isOccupied(leaf, slot)) continue;
+            if (slot != out) {
+                leaf->keys[out] = std::move(leaf->keys[slot]);
+                leaf->values[out] = std::move(leaf->values[slot]);
+            }
+            ++out;
+        }
+        leaf->keys.resize(out);
+        leaf->values.resize(out);
+        leaf->occupied.fill(0);
+        leaf->gapped = false;
+        leaf->live = 0;
+        chargeGaps(leaf);
+    }
+
+    // --- Frozen leaves ----------------------------------------------------------------------------
+    void freezeLeaf(Node* leaf) {
+        if constexpr (detail::kDeltaEncodable<Key>) {
+            packLeaf(leaf);
+            const std::size_t count = leaf->keys.size();
+            const std::uint64_t base = detail::orderedBits(leaf->keys.front());
+            const std::uint64_t span = detail::orderedBits(leaf->keys.back()) - base;
+            const unsigned width = span == 0 ? 1 : 64 - detail::countLeadingZeros(span);
+            // One spare word lets frozenDelta() always read two.
+            const std::size_t words = (count * width + 63) / 64 + 1;
+            auto* bits = static_cast<std::uint64_t*>(arena_->allocate(words * sizeof(std::uint64_t), alignof(std::uint64_t)));
+            std::fill(bits, bits + words, 0);
+            for (std::size_t i = 0; i < count; ++i) {
+                const std::uint64_t delta = detail::orderedBits(leaf->keys[i]) - base;
+                const std::size_t bit = i * width;
+                const unsigned shift = bit % 64;
+                bits[bit / 64] |= delta << shift;
+                if (shift + width > 64) bits[bit / 64 + 1] |= delta >> (64 - shift);
+            }
+            leaf->frozen_bits = bits;
+            leaf->frozen_words = static_cast<std::uint32_t>(words);
+            leaf->frozen_width = static_cast<std::uint8_t>(width);
+            leaf->frozen_base = base;
+            leaf->live = count;
+            leaf->frozen = true;
+            leaf->keys.clear();
+            leaf->keys.shrink_to_fit();
+        } else {
+            (void)leaf;
+        }
+    }
+
+    // Unpacks a frozen leaf's keys; other leaves are left alone.
+    void thawLeaf(Node* leaf) const {
+        if (!leaf->frozen) return;
+        for (std::size_t i = 0; i < leaf->live; ++i) leaf->keys.push_back(frozenKey(leaf, i));
+        releaseFrozen(leaf);
+        leaf->frozen = false;
+        leaf->live = 0;
+    }
+
+    void releaseFrozen(Node* node) const {
+        if (node->frozen_bits) arena_->deallocate(node->frozen_bits, node->frozen_words * sizeof(std::uint64_t), alignof(std::uint64_t));
+        node->frozen_bits = nullptr;
+        node->frozen_words = 0;
+    }
+
+    static std::uint64_t frozenDelta(const Node* leaf, std::size_t index) {
+        const unsigned width = leaf->frozen_width;
+        const std::size_t bit = index * width;
+        const unsigned shift = bit % 64;
+        const std::uint64_t* word = leaf->frozen_bits + bit / 64;
+        // Branch-free: the second word contributes nothing when shift is 0 or the value fits the first.
+        const std::uint64_t delta = (word[0] >> shift) | ((word[1] << 1) << (63 - shift));
+        return delta & ((std::uint64_t{2} << (width - 1)) - 1);
+    }
+
+    static Key frozenKey(const Node* leaf, std::size_t index) {
+        if constexpr (detail::kDeltaEncodable<Key>) {
+            return detail::fromOrderedBits<Key>(leaf->frozen_base + frozenDelta(leaf, index));
+        } else {
+            (void)leaf;
+            (void)index;
+            return Key{};
+        }
+    }
+
+    // locate() for a frozen leaf: a binary search over the packed distances, without decoding keys.
+    static Slot locateFrozen(const Node* leaf, const Key& key) {
+        if constexpr (detail::kDeltaEncodable<Key>) {
+            const std::uint64_t bits = detail::orderedBits(key);
+            if (bits < leaf->frozen_base) return {0, false};
+            const std::uint64_t delta = bits - leaf->frozen_base;
+            // Binary search over the packed deltas; each probe extracts one in O(1).
+            std::size_t lo = 0;
+            std::size_t hi = leaf->live;
+            while (lo < hi) {
+                const std::size_t mid = lo + (hi - lo) / 2;
+                if (frozenDelta(leaf, mid) < delta) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            return {lo, lo < leaf->live && frozenDelta(leaf, lo) == delta};
+        } else {
+            (void)leaf;
+            (void)key;
+            return {0, false};
+        }
+    }
+
+    // --- Erase and compaction ---------------------------------------------------------------------
+    void eraseFromLeaf(Node* leaf, std::size_t index) {
+        thawLeaf(leaf);
+        --size_;
+        bumpVersion(leaf);
+        release(leaf->keys[index], leaf->values[index]);
+        if (leaf->gapped) {
+            eraseFromGap(leaf, index);
+        } else if (index >= leaf->keys.size() - leaf->tail) {
+            // The tail is unordered, so its last entry can simply fill the hole.
+            const std::size_t last = leaf->keys.size() - 1;
+            if (index != last) {
+                leaf->keys[index] = std::move(leaf->keys[last]);
+                leaf->values[index] = std::move(leaf->values[last]);
+                leaf->fingerprints[index - (leaf->keys.size() - leaf->tail)] = leaf->fingerprints.back();
+            }
+            leaf->keys.pop_back();
+            leaf->values.pop_back();
+            leaf->fingerprints.pop_back();
+            --leaf->tail;
+        } else {
+            const auto offset = static_cast<std::ptrdiff_t>(index);
+            leaf->keys.erase(leaf->keys.begin() + offset);
+            leaf->values.erase(leaf->values.begin() + offset);
+        }
+        if (entryCount(leaf) == 0 && !isRoot(leaf)) {
+            removeChild(leaf);
+        }
+    }
+
+    // Unlinks (and frees) a node from its parent together with one adjacent separator.
+    void removeChild(Node* child) {
+        forgetLeaf(child);
+        if (child->leaf) unlinkLeaf(child);
+        Node* parent = parentOf(child);
+        const std::size_t idx = childIndex(parent, child);
+        parent->children.erase(parent->children.begin() + static_cast<std::ptrdiff_t>(idx));
+        if (!parent->keys.empty()) {
+            parent->keys.erase(parent->keys.begin() + static_cast<std::ptrdiff_t>(idx > 0 ? idx - 1 : 0));
+        }
+        destroyNode(child);
+        if (!parent->children.empty()) {
+            collapseRoot();
+        } else if (!isRoot(parent)) {
+            removeChild(parent);
+        } else {
+            destroyNode(root_);
+            root_ = newNode(true);
+        }
+    }
 
-public:
-  using key_type = Key;
-  using mapped_type = Value;
-  BPlusTree() : root_(std::make_unique<Node>(true)) {}
-  void insert(const Key& key, const Value& value) {
-    Node* leaf = findLeaf(key);
+    // Drops internal roots that are left with a single child.
+    void collapseRoot() {
+        while (!root_->leaf && root_->children.size() == 1) {
+            Node* child = childAt(root_, 0);
+            child->parent = kNoNode;
+            root_->children.clear();
+            destroyNode(root_);
+            root_ = child;
+        }
+    }
 
-    auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
-    const std::size_t index = static_cast<std::size_t>(std::distance(leaf->keys.begin(), it));
+    std::size_t eraseWithinLeaf(Node* leaf, const Key& lo, const Key& hi) {
+        const bool reloaded = touchLeaf(leaf);
+        packLeaf(leaf);
+        const auto first = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), lo);
+        const auto last = std::lower_bound(first, leaf->keys.end(), hi);
+        const auto begin = static_cast<std::size_t>(first - leaf->keys.begin());
+        const auto end = static_cast<std::size_t>(last - leaf->keys.begin());
+        if (begin != end) {
+            bumpVersion(leaf);
+            for (std::size_t i = begin; i < end; ++i) release(leaf->keys[i], leaf->values[i]);
+            leaf->keys.erase(first, last);
+            leaf->values.erase(leaf->values.begin() + static_cast<std::ptrdiff_t>(begin),
+                               leaf->values.begin() + static_cast<std::ptrdiff_t>(end));
+            size_ -= end - begin;
+            if (leaf->keys.empty() && !isRoot(leaf)) removeChild(leaf);
+        }
+        if (reloaded) enforceMemoryBudget();
+        return end - begin;
+    }
 
-    // The key is already registered, updating the value.
-    if (it != leaf->keys.end() && *it == key) {
-      leaf->values[index] = value;
-      return;
+    // One bottom-up pass over the path to `key` that merges every node with its siblings where the
+    // result fits in one node. Returns whether anything was merged; merging at one level can make
+    // nodes below it siblings, so callers repeat until it returns false.
+    bool mergeAlongPath(const Key& key) {
+        bool merged = false;
+        for (Node* node = findLeaf(key); node;) {
+            while (mergeWithRightSibling(node)) merged = true;
+            Node* parent = parentOf(node);
+            if (!parent) break;
+            const std::size_t idx = childIndex(parent, node);
+            Node* left = idx > 0 ? childAt(parent, idx - 1) : nullptr;
+            if (left && mergeWithRightSibling(left)) {
+                merged = true;
+                node = left;
+            }
+            node = parentOf(node);
+        }
+        return merged;
     }
 
-    leaf->keys.insert(it, key);
-    leaf->values.insert(leaf->values.begin() + index, value);
+    // Merges the next sibling under the same parent into `node` if the result fits in one node.
+    bool mergeWithRightSibling(Node* node) {
+        Node* parent = parentOf(node);
+        if (!parent) return false;
+        const std::size_t idx = childIndex(parent, node);
+        if (idx + 1 >= parent->children.size()) return false;
+        Node* right = childAt(parent, idx + 1);
+        if (node->leaf) {
+            // Merging cold leaves would pull them back into memory.
+            if (node->evicted || right->evicted) return false;
+            if (entryCount(node) + entryCount(right) > maxKeys()) return false;
+            packLeaf(node);
+            packLeaf(right);
+            moveEntries(right, 0, right->keys.size(), node, node->keys.size());
+        } else {
+            if (node->children.size() + right->children.size() > Order) return false;
+            // The separator between the two moves down between their key ranges.
+            node->keys.push_back(std::move(parent->keys[idx]));
+            node->keys.insert(node->keys.end(), std::make_move_iterator(right->keys.begin()),
+                              std::make_move_iterator(right->keys.end()));
+            for (NodeId child : right->children) this->node(child)->parent = node->self;
+            node->children.insert(node->children.end(), right->children.begin(), right->children.end());
+            right->children.clear();
+        }
+        removeChild(right);
+        return true;
+    }
 
-    // If it overflows, recursively split the buckets. (splitLeaf -> insertIntoParent -> splitLeaf -> ...)
-    // TODO(hikettei): splitInternal and splitLeaf are just doing the same stuff thus they should not be separated.
-    if (leaf->keys.size() > maxKeys()) {
-      splitLeaf(leaf);
-    } else if (leaf->parent && index == 0) {
-      // Keep parent separators in sync when this leaf now owns a new minimal key.
-      updateParentKeyForChild(leaf);
+    static void shrinkNode(Node* node) {
+        node->keys.shrink_to_fit();
+        node->values.shrink_to_fit();
+        node->children.shrink_to_fit();
+        node->fingerprints.shrink_to_fit();
     }
-  }
-  std::optional<Value> find(const Key& key) const {
-    const Node* leaf = findLeaf(key);
-    auto it = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
-    if (it != leaf->keys.end() && *it == key) {
-      return leaf->values[static_cast<std::size_t>(std::distance(leaf->keys.begin(), it))];
+
+    Node* leftmostLeaf(Node* node) const {
+        while (!node->leaf) node = childAt(node, 0);
+        return node;
     }
-    return std::nullopt;
-  }
-private:
-    static constexpr std::size_t maxKeys() { return Order - 1; }
-    Node* findLeaf(const Key& key) const {
-        Node* node = root_.get();
+    Node* rightmostLeaf(Node* node) const {
+        while (!node->leaf) node = childAt(node, node->children.size() - 1);
+        return node;
+    }
+
+    // Smallest key routed to this node by its ancestors, or nullopt for the leftmost node.
+    std::optional<Key> lowerFence(const Node* node) const {
+        for (; !isRoot(node); node = parentOf(node)) {
+            const Node* parent = parentOf(node);
+            auto it = std::find(parent->children.begin(), parent->children.end(), node->self);
+            if (it != parent->children.begin()) return parent->keys[static_cast<std::size_t>(it - parent->children.begin()) - 1];
+        }
+        return std::nullopt;
+    }
+
+    Node* nextLeaf(const Node* leaf) const { return leaf->next == kNoNode ? nullptr : node(leaf->next); }
+
+    // Inserts `added` into the leaf chain right after `leaf`.
+    void linkLeafAfter(Node* leaf, Node* added) {
+        added->prev = leaf->self;
+        added->next = leaf->next;
+        if (leaf->next != kNoNode) node(leaf->next)->prev = added->self;
+        leaf->next = added->self;
+    }
+    void unlinkLeaf(Node* leaf) {
+        if (leaf->prev != kNoNode) node(leaf->prev)->next = leaf->next;
+        if (leaf->next != kNoNode) node(leaf->next)->prev = leaf->prev;
+    }
+
+    void bumpVersion(Node* leaf) { leaf->version = ++version_clock_; }
+
+    ScanPosition positionOf(const Node* leaf) const { return {leaf->self, leaf->version, nodes_.generation(leaf->self)}; }
+    // The generation is checked first, so the version of a freed leaf is never read.
+    bool unchanged(const ScanPosition& position) const {
+        return nodes_.generation(position.leaf) == position.generation && node(position.leaf)->version == position.version;
+    }
+
+    // --- Scans -------------------------------------------------------------------------------------
+    // Registers a scan with the batch sequence it reads at for as long as it runs, so that batches
+    // committed meanwhile keep their undo images.
+    class ScanPin {
+    public:
+        explicit ScanPin(const BPlusTree& tree) : tree_(tree) {
+            std::shared_lock<std::shared_mutex> lock(tree.latch_);
+            std::lock_guard<std::mutex> guard(tree.scans_mutex_);
+            start_ = tree.scan_starts_.insert(tree.batch_sequence_);
+        }
+        ScanPin(const ScanPin&) = delete;
+        ScanPin& operator=(const ScanPin&) = delete;
+        ~ScanPin() {
+            std::lock_guard<std::mutex> guard(tree_.scans_mutex_);
+            tree_.scan_starts_.erase(start_);
+        }
+        std::uint64_t start() const { return *start_; }
+
+    private:
+        const BPlusTree& tree_;
+        std::multiset<std::uint64_t>::iterator start_;
+    };
+
+    // scan() for a scan pinned at batch sequence `start`.
+    template <typename Fn>
+    void scanRange(const Key& lo, const Key& hi, std::uint64_t start, Fn&& fn) const {
+        std::vector<std::pair<Key, Value>> batch;
+        std::optional<Key> last;  // last key handed to fn
+        ScanPosition position;
+        for (bool more = true; more;) {
+            batch.clear();
+            {
+                std::shared_lock<std::shared_mutex> lock(latch_);
+                more = copyScanBatch(lo, hi, last, start, position, batch);
+            }
+            for (const auto& entry : batch) {
+                if (!visitEntry(fn, entry.first, entry.second)) return;
+            }
+            if (!batch.empty()) last = std::move(batch.back().first);
+        }
+    }
+
+    // Parallel scans cut the range finer than the worker count so that fast workers pick up the slack.
+    static constexpr unsigned kChunksPerWorker = 4;
+
+    static unsigned workerCount(unsigned threads) {
+        return threads != 0 ? threads : detail::WorkStealingScheduler::instance().worker_count();
+    }
+
+    // lo, up to parts - 1 separators inside (lo, hi) taken from the shallowest internal level that
+    // has enough of them (so the chunks cover roughly equal subtrees), and hi.
+    std::vector<Key> chunkBounds(const Key& lo, const Key& hi, std::size_t parts) const {
+        std::shared_lock<std::shared_mutex> lock(latch_);
+        std::vector<Key> separators;
+        std::vector<const Node*> level{root_};
+        while (!level.empty() && !level.front()->leaf && separators.size() + 1 < parts) {
+            std::vector<const Node*> next;
+            for (const Node* node : level) {
+                for (std::size_t i = 0; i < node->children.size(); ++i) {
+                    // Only children whose key range [keys[i - 1], keys[i]) overlaps [lo, hi).
+                    if (i < node->keys.size() && !(lo < node->keys[i])) continue;
+                    if (i > 0 && !(node->keys[i - 1] < hi)) break;
+                    if (i > 0 && lo < node->keys[i - 1]) separators.push_back(node->keys[i - 1]);
+                    next.push_back(childAt(node, i));
+                }
+            }
+            level = std::move(next);
+        }
+        std::sort(separators.begin(), separators.end());
+        std::vector<Key> bounds{lo};
+        const std::size_t picks = std::min(separators.size(), parts - 1);
+        for (std::size_t i = 1; i <= picks; ++i) bounds.push_back(separators[i * separators.size() / (picks + 1)]);
+        bounds.push_back(hi);
+        bounds.erase(std::unique(bounds.begin(), bounds.end(), [](const Key& a, const Key& b) { return !(a < b) && !(b < a); }),
+                     bounds.end());
+        if (bounds.size() == 1) bounds.push_back(hi);  // lo == hi: one empty chunk
+        return bounds;
+    }
+
+    // Calls task(i) for every i < count on the scheduler, one chunk per task and at most `workers`
+    // tasks at once; with one worker the chunks run in order on the calling thread.
+    template <typename Task>
+    static void runChunks(std::size_t count, unsigned workers, Task&& task) {
+        detail::WorkStealingScheduler::instance().parallel_for(0, count, 1, workers, task);
+    }
+
+    // Calls fn, which may return whether to go on or nothing.
+    template <typename Fn>
+    static bool visitEntry(Fn& fn, const Key& key, const Value& value) {
+        if constexpr (std::is_same_v<std::invoke_result_t<Fn&, const Key&, const Value&>, bool>) {
+            return fn(key, value);
+        } else {
+            fn(key, value);
+            return true;
+        }
+    }
+
+    // Copies the entries in [lo, hi) after `last` from the next leaf that has any, as of batch
+    // sequence `start`. Returns false once nothing is left to scan. Runs under the shared latch.
+    bool copyScanBatch(const Key& lo, const Key& hi, const std::optional<Key>& last, std::uint64_t start,
+                       ScanPosition& position, std::vector<std::pair<Key, Value>>& batch) const {
+        const Node* leaf;
+        if (position.leaf != kNoNode && unchanged(position)) {
+            leaf = nextLeaf(node(position.leaf));
+        } else {
+            leaf = findLeaf(last ? *last : lo);
+        }
+        while (leaf) {
+            const std::size_t first = batch.size();
+            const bool past_hi = copyLeafRange(leaf, lo, hi, last, batch);
+            position = positionOf(leaf);
+            const Node* next = past_hi ? nullptr : nextLeaf(leaf);
+            if (batch_sequence_ != start) {
+                // The copy stands for every key up to the next leaf's first one.
+                Key upper = hi;
+                if (next) {
+                    Key boundary = leafBoundary(next, false);
+                    if (boundary < hi) upper = std::move(boundary);
+                }
+                undoBatches(start, lo, last, upper, batch, first);
+            }
+            if (past_hi) return false;
+            leaf = next;
+            if (!batch.empty()) return leaf != nullptr;
+        }
+        return false;
+    }
+
+    // Rewrites batch[first, end), the entries in [lo, upper) after `last`, to how they were at
+    // batch sequence `start`: a key touched by a later batch takes the value from before the first
+    // of them.
+    void undoBatches(std::uint64_t start, const Key& lo, const std::optional<Key>& last, const Key& upper,
+                     std::vector<std::pair<Key, Value>>& batch, std::size_t first) const {
+        auto by_key = [](const auto& entry, const Key& key) { return entry.first < key; };
+        std::map<Key, const std::optional<Value>*> earlier;
+        for (const BatchUndo& undo : batch_undo_) {
+            if (undo.sequence <= start) continue;
+            auto it = std::lower_bound(undo.before.begin(), undo.before.end(), last ? *last : lo, by_key);
+            if (last && it != undo.before.end() && !(*last < it->first)) ++it;
+            for (; it != undo.before.end() && it->first < upper; ++it) earlier.emplace(it->first, &it->second);
+        }
+        if (earlier.empty()) return;
+        std::vector<std::pair<Key, Value>> merged;
+        auto copied = batch.begin() + static_cast<std::ptrdiff_t>(first);
+        for (const auto& [key, value] : earlier) {
+            while (copied != batch.end() && copied->first < key) merged.push_back(std::move(*copied++));
+            if (copied != batch.end() && !(key < copied->first)) ++copied;
+            if (*value) merged.emplace_back(key, **value);
+        }
+        std::move(copied, batch.end(), std::back_inserter(merged));
+        batch.erase(batch.begin() + static_cast<std::ptrdiff_t>(first), batch.end());
+        std::move(merged.begin(), merged.end(), std::back_inserter(batch));
+    }
+
+    // The value `key` had at batch sequence `start`, if a batch has touched it since.
+    const std::optional<Value>* undoneValue(const Key& key, std::uint64_t start) const {
+        for (const BatchUndo& undo : batch_undo_) {
+            if (undo.sequence <= start) continue;
+            const auto it = std::lower_bound(undo.before.begin(), undo.before.end(), key,
+                                             [](const auto& entry, const Key& probe) { return entry.first < probe; });
+            if (it != undo.before.end() && !(key < it->first)) return &it->second;
+        }
+        return nullptr;
+    }
+
+    // Appends the leaf's entries in [lo, hi) after `last`, sorted. Returns true if the leaf holds
+    // keys at or beyond hi. Evicted leaves are decoded from the spill file without reloading them.
+    bool copyLeafRange(const Node* leaf, const Key& lo, const Key& hi, const std::optional<Key>& last,
+                       std::vector<std::pair<Key, Value>>& batch) const {
+        const std::size_t first = batch.size();
+        bool past_hi = false;
+        auto take = [&](const Key& key, const Value& value) {
+            if (!(key < hi)) {
+                past_hi = true;
+            } else if (!(key < lo) && (!last || *last < key)) {
+                batch.emplace_back(key, value);
+            }
+        };
+        forEachEntry(leaf, take);
+        if (leaf->tail != 0) {
+            std::sort(batch.begin() + static_cast<std::ptrdiff_t>(first), batch.end(),
+                      [](const auto& a, const auto& b) { return a.first < b.first; });
+        }
+        return past_hi;
+    }
+
+    // Calls fn(key, value) for every entry of the leaf in slot order, which for an append leaf leaves
+    // the tail unsorted. Evicted leaves are decoded from the spill file.
+    template <typename Fn>
+    void forEachEntry(const Node* leaf, Fn&& fn) const {
+        if (leaf->evicted) {
+            forEachSpilled(leaf, fn);
+        } else if (leaf->frozen) {
+            for (std::size_t i = 0; i < leaf->live; ++i) fn(frozenKey(leaf, i), leaf->values[i]);
+        } else if (leaf->gapped) {
+            for (std::size_t slot = nextSlot(leaf, 0, true); slot < Order; slot = nextSlot(leaf, slot + 1, true)) {
+                fn(leaf->keys[slot], leaf->values[slot]);
+            }
+        } else {
+            for (std::size_t i = 0; i < leaf->keys.size(); ++i) fn(leaf->keys[i], leaf->values[i]);
+        }
+    }
+
+    // --- Batch lookups -----------------------------------------------------------------------------
+    // Root-to-leaf path of the last seek with the exclusive upper bound of every node's key range
+    // (nullptr: unbounded). Valid while the latch is held.
+    struct Finger {
+        std::vector<Node*> nodes;
+        std::vector<const Key*> uppers;
+    };
+
+    // Leaf for `key`, which must not be smaller than the key of the previous seek on this finger.
+    // Climbs to the lowest node whose range still covers the key and descends from there.
+    Node* seekAscending(Finger& finger, const Key& key) const {
+        if (finger.nodes.empty()) {
+            finger.nodes.push_back(root_);
+            finger.uppers.push_back(nullptr);
+        }
+        while (finger.nodes.size() > 1 && finger.uppers.back() && !(key < *finger.uppers.back())) {
+            finger.nodes.pop_back();
+            finger.uppers.pop_back();
+        }
+        Node* node = finger.nodes.back();
+        const Key* upper = finger.uppers.back();
         while (!node->leaf) {
             auto it = std::upper_bound(node->keys.begin(), node->keys.end(), key);
-            std::size_t index = static_cast<std::size_t>(std::distance(node->keys.begin(), it));
-            node = node->children[index].get();
+            if (it != node->keys.end()) upper = &*it;
+            node = childAt(node, static_cast<std::size_t>(std::distance(node->keys.begin(), it)));
+            finger.nodes.push_back(node);
+            finger.uppers.push_back(upper);
+        }
+        return node;
+    }
+
+    // Indices of `keys` in key order.
+    static std::vector<std::size_t> probeOrder(const std::vector<Key>& keys) {
+        std::vector<std::size_t> order(keys.size());
+        std::iota(order.begin(), order.end(), std::size_t{0});
+        std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b) { return keys[a] < keys[b]; });
+        return order;
+    }
+
+    // Stores the value of keys[*p] in results[*p] for every p in [first, last), which is sorted by key.
+    // With `start` set, the probes are resolved as of that batch sequence (see ScanPin).
+    void resolveProbes(const std::vector<Key>& keys, const std::size_t* first, const std::size_t* last,
+                       std::vector<std::optional<Value>>& results, std::optional<std::uint64_t> start = std::nullopt) const {
+        if (first == last) return;
+        // Same latching as find(): a budgeted tree may reload and evict leaves along the way.
+        std::shared_lock<std::shared_mutex> shared(latch_, std::defer_lock);
+        std::unique_lock<std::shared_mutex> exclusive(latch_, std::defer_lock);
+        if (budgeted()) {
+            exclusive.lock();
+        } else {
+            shared.lock();
+        }
+        Finger finger;
+        for (const std::size_t* probe = first; probe != last; ++probe) {
+            const Key& key = keys[*probe];
+            Node* leaf = seekAscending(finger, key);
+            const bool reloaded = touchLeaf(leaf);
+            const Slot slot = locate(leaf, key);
+            if (slot.found) results[*probe] = leaf->values[slot.index];
+            if (reloaded) enforceMemoryBudget();
+            if (start && batch_sequence_ != *start) {
+                if (const std::optional<Value>* before = undoneValue(key, *start)) results[*probe] = *before;
+            }
+        }
+    }
+
+    // --- Merging -----------------------------------------------------------------------------------
+    std::size_t mergeFrom(const BPlusTree& other, ConflictPolicy policy) {
+        std::size_t added = 0;
+        Finger finger;
+        std::vector<std::pair<Key, Value>> batch;
+        for (const Node* source = other.leftmostLeaf(other.root_); source; source = other.nextLeaf(source)) {
+            batch.clear();
+            other.forEachEntry(source, [&](const Key& key, const Value& value) { batch.emplace_back(key, value); });
+            if (source->tail != 0) {
+                std::sort(batch.begin(), batch.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+            }
+            added += mergeSorted(batch.begin(), batch.end(), policy, finger);
+        }
+        return added;
+    }
+
+    // Sorts (key, value) entries by key and keeps only the last entry given for each key.
+    template <typename Entry>
+    static void sortKeepingLast(std::vector<Entry>& entries) {
+        std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+        std::size_t kept = 0;
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            if (kept != 0 && !(entries[kept - 1].first < entries[i].first)) {
+                entries[kept - 1] = std::move(entries[i]);
+            } else {
+                if (kept != i) entries[kept] = std::move(entries[i]);
+                ++kept;
+            }
+        }
+        entries.erase(entries.begin() + static_cast<std::ptrdiff_t>(kept), entries.end());
+    }
+
+    // Applies sorted, distinct erases and puts (no key in both) under the exclusive latch.
+    // applySorted() as one write batch. While scans are running, the current state of the keys is
+    // kept for them first; undo images no running scan needs any more are dropped.
+    void installBatch(std::vector<std::pair<Key, Value>>& puts, const std::vector<Key>& erases) {
+        ++batch_sequence_;
+        bool scanning;
+        {
+            std::lock_guard<std::mutex> guard(scans_mutex_);
+            scanning = !scan_starts_.empty();
+            const std::uint64_t oldest = scanning ? *scan_starts_.begin() : batch_sequence_;
+            while (!batch_undo_.empty() && batch_undo_.front().sequence <= oldest) batch_undo_.pop_front();
+        }
+        if (scanning) batch_undo_.push_back({batch_sequence_, currentValues(puts, erases)});
+        applySorted(puts, erases);
+    }
+
+    // The values the keys of `puts` and `erases` (each sorted, the two disjoint) have now, in key order.
+    std::vector<std::pair<Key, std::optional<Value>>> currentValues(const std::vector<std::pair<Key, Value>>& puts,
+                                                                   const std::vector<Key>& erases) {
+        std::vector<const Key*> keys;
+        keys.reserve(puts.size() + erases.size());
+        for (const auto& put : puts) keys.push_back(&put.first);
+        for (const Key& key : erases) keys.push_back(&key);
+        std::inplace_merge(keys.begin(), keys.begin() + static_cast<std::ptrdiff_t>(puts.size()), keys.end(),
+                           [](const Key* a, const Key* b) { return *a < *b; });
+        std::vector<std::pair<Key, std::optional<Value>>> values;
+        values.reserve(keys.size());
+        Finger finger;
+        for (const Key* key : keys) {
+            Node* leaf = seekAscending(finger, *key);
+            const bool reloaded = touchLeaf(leaf);
+            const Slot slot = locate(leaf, *key);
+            values.emplace_back(*key, slot.found ? std::optional<Value>(leaf->values[slot.index]) : std::nullopt);
+            if (reloaded) enforceMemoryBudget();
+        }
+        return values;
+    }
+
+    void applySorted(std::vector<std::pair<Key, Value>>& puts, const std::vector<Key>& erases) {
+        eraseSorted(erases);
+        Finger finger;
+        mergeSorted(puts.begin(), puts.end(), ConflictPolicy::Overwrite, finger);
+    }
+
+    // Erases the keys that are present among `keys`, which are sorted and distinct, following them
+    // with a finger that is dropped whenever an emptied leaf was freed.
+    void eraseSorted(const std::vector<Key>& keys) {
+        Finger finger;
+        std::uint64_t epoch = node_epoch_;
+        for (const Key& key : keys) {
+            if (node_epoch_ != epoch) {
+                finger = Finger{};
+                epoch = node_epoch_;
+            }
+            Node* leaf = seekAscending(finger, key);
+            const bool reloaded = touchLeaf(leaf);
+            const Slot slot = locate(leaf, key);
+            if (slot.found) {
+                logChange(MutationKind::Erase, key);
+                eraseFromLeaf(leaf, slot.index);
+            }
+            if (reloaded) enforceMemoryBudget();
+        }
+    }
+
+    // Merges the entries [first, end), sorted and with distinct keys, and returns how many keys were
+    // new. Each run bound for one leaf goes to mergeIntoLeaf() in one piece.
+    template <typename It>
+    std::size_t mergeSorted(It first, It end, ConflictPolicy policy, Finger& finger) {
+        std::size_t added = 0;
+        while (first != end) {
+            Node* leaf = seekAscending(finger, first->first);
+            const Key* upper = finger.uppers.back();
+            auto last = std::next(first);
+            while (last != end && (!upper || last->first < *upper)) ++last;
+            added += mergeIntoLeaf(leaf, first, last, policy, finger);
+            first = last;
+        }
+        return added;
+    }
+
+    // Merges the sorted entries [first, last), all routed to `leaf`, into it and returns how many keys
+    // were new. A single entry that fits is inserted in place; otherwise the leaf is rebuilt in one
+    // pass and, if the result overflows, spread evenly over new leaves after it (resetting the finger,
+    // whose path the splits may have changed).
+    template <typename It>
+    std::size_t mergeIntoLeaf(Node* leaf, It first, It last, ConflictPolicy policy, Finger& finger) {
+        touchLeaf(leaf);
+        thawLeaf(leaf);
+        if (std::next(first) == last && entryCount(leaf) < maxKeys()) {
+            const Slot slot = locate(leaf, first->first);
+            if (!slot.found) {
+                insertIntoLeaf(leaf, slot.index, std::move(first->first), std::move(first->second));
+            } else if (policy == ConflictPolicy::Overwrite) {
+                bumpVersion(leaf);
+                release(leaf->keys[slot.index], leaf->values[slot.index]);
+                leaf->values[slot.index] = std::move(first->second);
+                charge(leaf->keys[slot.index], leaf->values[slot.index]);
+                logChange(MutationKind::Put, leaf->keys[slot.index], nullptr, &leaf->values[slot.index]);
+            }
+            enforceMemoryBudget();
+            return slot.found ? 0 : 1;
+        }
+
+        packLeaf(leaf);
+        bumpVersion(leaf);
+        std::vector<std::pair<Key, Value>> merged;
+        merged.reserve(leaf->keys.size() + static_cast<std::size_t>(std::distance(first, last)));
+        std::size_t added = 0;
+        for (std::size_t i = 0; i < leaf->keys.size() || first != last;) {
+            if (first == last || (i < leaf->keys.size() && leaf->keys[i] < first->first)) {
+                merged.emplace_back(std::move(leaf->keys[i]), std::move(leaf->values[i]));
+                ++i;
+                continue;
+            }
+            const bool conflict = i < leaf->keys.size() && !(first->first < leaf->keys[i]);
+            if (!conflict || policy == ConflictPolicy::Overwrite) {
+                if (conflict) release(leaf->keys[i], leaf->values[i]);
+                merged.emplace_back(std::move(first->first), std::move(first->second));
+                charge(merged.back().first, merged.back().second);
+                logChange(MutationKind::Put, merged.back().first, nullptr, &merged.back().second);
+            } else {
+                merged.emplace_back(std::move(leaf->keys[i]), std::move(leaf->values[i]));
+            }
+            added += conflict ? 0 : 1;
+            i += conflict ? 1 : 0;
+            ++first;
+        }
+        size_ += added;
+
+        const std::size_t pieces = (merged.size() + maxKeys() - 1) / maxKeys();
+        Node* previous = nullptr;
+        Node* target = leaf;
+        for (std::size_t piece = 0; piece < pieces; ++piece) {
+            if (piece > 0) {
+                previous = target;
+                target = newNode(true);
+                linkLeafAfter(previous, target);
+                bumpVersion(target);
+            }
+            target->keys.clear();
+            target->values.clear();
+            for (std::size_t i = merged.size() * piece / pieces; i < merged.size() * (piece + 1) / pieces; ++i) {
+                target->keys.push_back(std::move(merged[i].first));
+                target->values.push_back(std::move(merged[i].second));
+            }
+            if (pieces > 1 && options_.leaf_layout == LeafLayout::Gapped) spreadLeaf(target);
+            if (piece == 0) {
+                updateParentKeyForChild(leaf);
+            } else {
+                insertIntoParent(previous, target->keys.front(), target);
+            }
+        }
+        if (pieces > 1) finger = Finger{};
+        enforceMemoryBudget();
+        return added;
+    }
+
+    // --- Cursors -----------------------------------------------------------------------------------
+    // Leaf whose range holds `key`, or with `before` the leaf holding the keys just below it. Like
+    // seekAscending() but in both directions and across calls: climbs the cursor's path to the lowest
+    // node whose range still covers the key and descends from there, recording the ranges on the way.
+    // Runs under the latch.
+    Node* cursorLeaf(CursorPath& path, const Key& key, bool before) const {
+        if (path.nodes.empty() || path.epoch != node_epoch_ || path.splits != split_epoch_) {
+            path.nodes.assign(1, root_->self);
+            path.lowers.assign(1, std::nullopt);
+            path.uppers.assign(1, std::nullopt);
+            path.epoch = node_epoch_;
+            path.splits = split_epoch_;
+        } else if (node(path.nodes.back())->leaf && node(path.nodes.back())->version != path.version && path.nodes.size() > 1) {
+            // The leaf may have handed keys to a neighbour; its ancestors' ranges still hold.
+            path.nodes.pop_back();
+            path.lowers.pop_back();
+            path.uppers.pop_back();
+        }
+        auto covers = [&](std::size_t level) {
+            const std::optional<Key>& lower = path.lowers[level];
+            const std::optional<Key>& upper = path.uppers[level];
+            if (before) return (!lower || *lower < key) && (!upper || !(*upper < key));
+            return (!lower || !(key < *lower)) && (!upper || key < *upper);
+        };
+        while (path.nodes.size() > 1 && !covers(path.nodes.size() - 1)) {
+            path.nodes.pop_back();
+            path.lowers.pop_back();
+            path.uppers.pop_back();
+        }
+        Node* node = this->node(path.nodes.back());
+        while (!node->leaf) {
+            auto it = before ? std::lower_bound(node->keys.begin(), node->keys.end(), key)
+                             : std::upper_bound(node->keys.begin(), node->keys.end(), key);
+            const auto index = static_cast<std::size_t>(std::distance(node->keys.begin(), it));
+            std::optional<Key> lower = index > 0 ? std::optional<Key>(node->keys[index - 1]) : path.lowers.back();
+            std::optional<Key> upper = it != node->keys.end() ? std::optional<Key>(*it) : path.uppers.back();
+            node = childAt(node, index);
+            path.nodes.push_back(node->self);
+            path.lowers.push_back(std::move(lower));
+            path.uppers.push_back(std::move(upper));
         }
+        path.version = node->version;
         return node;
     }
 
+    // --- Transactions ------------------------------------------------------------------------------
+    // find() that records the leaf it looked at.
+    std::optional<Value> transactionalFind(const Key& key, std::vector<ScanPosition>& reads) const {
+        std::shared_lock<std::shared_mutex> shared(latch_, std::defer_lock);
+        std::unique_lock<std::shared_mutex> exclusive(latch_, std::defer_lock);
+        if (budgeted()) {
+            exclusive.lock();
+        } else {
+            shared.lock();
+        }
+        Node* leaf = findLeaf(key);
+        const bool reloaded = touchLeaf(leaf);
+        reads.push_back(positionOf(leaf));
+        const Slot slot = locate(leaf, key);
+        std::optional<Value> result;
+        if (slot.found) result = leaf->values[slot.index];
+        if (reloaded) enforceMemoryBudget();
+        return result;
+    }
+
+    // Copies the entries in [lo, hi) and records every leaf whose key range meets it, up to the
+    // first leaf holding a key at or beyond hi: a key inserted into [lo, hi) lands in one of them.
+    void transactionalRange(const Key& lo, const Key& hi, std::vector<std::pair<Key, Value>>& entries,
+                            std::vector<ScanPosition>& reads) const {
+        std::shared_lock<std::shared_mutex> lock(latch_);
+        for (const Node* leaf = findLeaf(lo); leaf; leaf = nextLeaf(leaf)) {
+            reads.push_back(positionOf(leaf));
+            if (copyLeafRange(leaf, lo, hi, std::nullopt, entries)) break;
+        }
+    }
+
+    bool commitTransaction(const std::vector<ScanPosition>& reads, std::vector<std::pair<Key, Value>>& puts,
+                           const std::vector<Key>& erases) {
+        auto current = [&] {
+            return std::all_of(reads.begin(), reads.end(), [&](const ScanPosition& read) { return unchanged(read); });
+        };
+        // Validating under the shared latch first lets a stale transaction fail without blocking
+        // anyone; a read-only one only needs the leaves to hold still while they are checked.
+        {
+            std::shared_lock<std::shared_mutex> lock(latch_);
+            if (!current()) return false;
+            if (puts.empty() && erases.empty()) return true;
+        }
+        std::unique_lock<std::shared_mutex> lock(latch_);
+        if (!current()) return false;
+        installBatch(puts, erases);
+        return true;
+    }
+
+    // --- Split and join ----------------------------------------------------------------------------
+    struct SharedStorage {};
+
+    // Tree without a root yet that allocates from the same arena and spill file as `origin`; the
+    // caller hands it its nodes. Node slots may be freed through any tree sharing the arena.
+    BPlusTree(const BPlusTree& origin, SharedStorage)
+        : arena_(origin.arena_), nodes_(arena_.get()), options_(origin.options_), spill_(origin.spill_),
+          version_clock_(origin.version_clock_) {}
+
+    // Moves the entries >= key into `right`, a rootless tree sharing this tree's arena. Every node on
+    // the path to key is cut in two: the right halves become the left spine of `right`. With `count`
+    // set both trees' counts go stale, each bounded by this tree's resident bytes; otherwise the
+    // sizes are left to the caller: both trees keep their old totals.
+    void splitOff(const Key& key, BPlusTree& right, bool count) {
+        Node* leaf = findLeaf(key);
+        touchLeaf(leaf);
+        packLeaf(leaf);
+        Node* right_part = newNode(true);
+        const auto cut = std::lower_bound(leaf->keys.begin(), leaf->keys.end(), key);
+        moveEntries(leaf, static_cast<std::size_t>(cut - leaf->keys.begin()), leaf->keys.size(), right_part, 0);
+        right_part->next = leaf->next;
+        if (leaf->next != kNoNode) node(leaf->next)->prev = right_part->self;
+        leaf->next = kNoNode;
+        Node* right_leaf = right_part;
+        for (Node* left_part = leaf; !isRoot(left_part);) {
+            Node* parent = parentOf(left_part);
+            const std::size_t idx = childIndex(parent, left_part);
+            Node* right_parent = newNode(false);
+            right_parent->children.push_back(right_part->self);
+            right_parent->children.insert(right_parent->children.end(), parent->children.begin() + static_cast<std::ptrdiff_t>(idx + 1),
+                                          parent->children.end());
+            right_parent->keys.insert(right_parent->keys.end(), std::make_move_iterator(parent->keys.begin() + static_cast<std::ptrdiff_t>(idx)),
+                                      std::make_move_iterator(parent->keys.end()));
+            for (NodeId child : right_parent->children) node(child)->parent = right_parent->self;
+            parent->children.resize(idx + 1);
+            parent->keys.resize(idx);
+            left_part = parent;
+            right_part = right_parent;
+        }
+        right.root_ = right_part;
+
+        if (count) {
+            right.resident_bytes_ = resident_bytes_;
+            counts_stale_.store(true, std::memory_order_relaxed);
+            right.counts_stale_.store(true, std::memory_order_relaxed);
+        }
+        right.version_clock_ = version_clock_;
+        // Either half of the cut leaf may be empty; the cut nodes above keep at least one child.
+        if (entryCount(leaf) == 0 && !isRoot(leaf)) removeChild(leaf);
+        collapseRoot();
+        if (entryCount(right_leaf) == 0 && !isRoot(right_leaf)) right.removeChild(right_leaf);
+        right.collapseRoot();
+        clock_hand_ = nullptr;
+        ++node_epoch_;
+    }
+
+    // join() for trees sharing an arena: other's nodes become this tree's without being touched,
+    // except for the node that takes the shorter tree's root as a new child.
+    void graft(BPlusTree& other) {
+        ++split_epoch_;
+        if (root_->leaf && entryCount(root_) == 0) {
+            std::swap(root_, other.root_);
+        } else {
+            Node* last = rightmostLeaf(root_);
+            Node* first = other.leftmostLeaf(other.root_);
+            Key separator = leafBoundary(first, false);
+            last->next = first->self;
+            first->prev = last->self;
+            const std::size_t height = heightOf(root_);
+            const std::size_t other_height = heightOf(other.root_);
+            if (height >= other_height) {
+                Node* anchor = root_;
+                for (std::size_t level = height; level > other_height; --level) anchor = childAt(anchor, anchor->children.size() - 1);
+                insertIntoParent(anchor, std::move(separator), other.root_);
+            } else {
+                Node* anchor = other.root_;
+                for (std::size_t level = other_height; level > height; --level) anchor = childAt(anchor, 0);
+                Node* parent = parentOf(anchor);
+                Node* grafted = root_;
+                root_ = other.root_;
+                grafted->parent = parent->self;
+                parent->keys.insert(parent->keys.begin(), std::move(separator));
+                parent->children.insert(parent->children.begin(), grafted->self);
+                if (parent->keys.size() > maxKeys()) splitInternal(parent);
+            }
+            other.root_ = newNode(true);
+        }
+        size_ += other.size_;
+        resident_bytes_ += other.resident_bytes_;
+        version_clock_ = std::max(version_clock_, other.version_clock_);
+        other.size_ = 0;
+        other.resident_bytes_ = 0;
+        other.clock_hand_ = nullptr;
+        other.compact_cursor_.reset();
+        ++other.node_epoch_;
+    }
+
+    // join() for trees with separate arenas: re-inserts other's entries in key order.
+    void appendEntries(BPlusTree& other) {
+        auto append = [&](Key& key, Value& value) {
+            Node* leaf = findLeafForInsert(key);
+            insertIntoLeaf(leaf, locate(leaf, key).index, std::move(key), std::move(value));
+            enforceMemoryBudget();
+        };
+        for (Node* leaf = other.leftmostLeaf(other.root_); leaf; leaf = other.nextLeaf(leaf)) {
+            if (leaf->evicted) {
+                other.forEachSpilled(leaf, append);
+                continue;
+            }
+            other.packLeaf(leaf);
+            for (std::size_t i = 0; i < leaf->keys.size(); ++i) append(leaf->keys[i], leaf->values[i]);
+        }
+        other.destroyNode(other.root_);
+        other.root_ = other.newNode(true);
+        other.size_ = 0;
+        other.resident_bytes_ = 0;
+        other.clock_hand_ = nullptr;
+        other.compact_cursor_.reset();
+    }
+
+    std::size_t heightOf(const Node* node) const {
+        std::size_t height = 1;
+        for (; !node->leaf; node = childAt(node, 0)) ++height;
+        return height;
+    }
+
+    // Smallest or largest key of a non-empty leaf; evicted leaves are decoded without reloading them.
+    Key leafBoundary(const Node* leaf, bool largest) const {
+        std::optional<Key> result;
+        auto visit = [&](const Key& key) {
+            if (!result || (largest ? *result < key : key < *result)) result = key;
+        };
+        if (leaf->evicted) {
+            forEachSpilled(leaf, [&](const Key& key, const Value&) { visit(key); });
+        } else if (leaf->frozen) {
+            visit(frozenKey(leaf, largest ? leaf->live - 1 : 0));
+        } else if (leaf->gapped) {
+            for (std::size_t slot = nextSlot(leaf, 0, true); slot < Order; slot = nextSlot(leaf, slot + 1, true)) visit(leaf->keys[slot]);
+        } else {
+            for (const Key& key : leaf->keys) visit(key);
+        }
+        return *result;
+    }
+
+    // Bytes the leaf's entries are charged against the memory budget.
+    std::size_t residentBytes(const Node* leaf) const {
+        std::size_t bytes = 0;
+        if constexpr (kSpillable) {
+            if (!budgeted() || leaf->evicted) return 0;
+            if (leaf->frozen) {
+                // Frozen keys are integers, charged at their full size like any other key.
+                for (std::size_t i = 0; i < leaf->live; ++i) bytes += sizeof(Key) + detail::Codec<Value>::footprint(leaf->values[i]);
+                return bytes;
+            }
+            for (std::size_t i = 0; i < leaf->keys.size(); ++i) {
+                if (leaf->gapped && !isOccupied(leaf, i)) continue;
+                bytes += detail::Codec<Key>::footprint(leaf->keys[i]) + detail::Codec<Value>::footprint(leaf->values[i]);
+            }
+            bytes += leaf->gap_bytes;
+        } else {
+            (void)leaf;
+        }
+        return bytes;
+    }
+
+    // --- Snapshots --------------------------------------------------------------------------------
+    template <typename Sink>
+    void writeSnapshot(Sink&& sink) const {
+        static_assert(kSpillable, "serialize() needs trivially copyable or std::string keys and values");
+        std::shared_lock<std::shared_mutex> lock(latch_);
+        settleCounts();
+        char header[detail::kSnapshotHeaderBytes];
+        std::memcpy(header, detail::kSnapshotMagic, sizeof(detail::kSnapshotMagic));
+        detail::putFixed(header + 8, detail::kSnapshotVersion, 4);
+        detail::putFixed(header + 12, detail::kDeltaEncodable<Key> ? detail::kSnapshotDeltaKeys : 0, 4);
+        sink(header, sizeof(header));
+
+        // The block header is filled in once the payload behind it is complete.
+        std::string block(detail::kSnapshotBlockHeaderBytes, '\0');
+        std::size_t count = 0;
+        std::uint64_t previous = 0;
+        auto flush = [&] {
+            const std::size_t payload = block.size() - detail::kSnapshotBlockHeaderBytes;
+            if (payload > UINT32_MAX) throw std::length_error("B+Tree snapshot block exceeds 4 GiB");
+            detail::putFixed(&block[0], count, 4);
+            detail::putFixed(&block[4], payload, 4);
+            detail::putFixed(&block[8], detail::blockChecksum(block.data() + detail::kSnapshotBlockHeaderBytes, payload), 8);
+            sink(block.data(), block.size());
+            block.resize(detail::kSnapshotBlockHeaderBytes);
+            count = 0;
+            previous = 0;
+        };
+        auto put = [&](const Key& key, const Value& value) {
+            if constexpr (detail::kDeltaEncodable<Key>) {
+                const std::uint64_t bits = detail::orderedBits(key);
+                detail::putVarint(block, bits - previous);
+                previous = bits;
+            } else {
+                detail::Codec<Key>::encode(block, key);
+            }
+            detail::Codec<Value>::encode(block, value);
+            ++count;
+            if (block.size() - detail::kSnapshotBlockHeaderBytes >= detail::kSnapshotBlockBytes) flush();
+        };
+        std::vector<std::pair<Key, Value>> unsorted;
+        for (const Node* leaf = leftmostLeaf(root_); leaf; leaf = nextLeaf(leaf)) {
+            if (leaf->tail == 0) {
+                forEachEntry(leaf, put);
+                continue;
+            }
+            unsorted.clear();
+            forEachEntry(leaf, [&](const Key& key, const Value& value) { unsorted.emplace_back(key, value); });
+            std::sort(unsorted.begin(), unsorted.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+            for (const auto& entry : unsorted) put(entry.first, entry.second);
+        }
+        if (count != 0) flush();
+        detail::putVarint(block, size_);
+        flush();
+    }
+
+    // One block of a snapshot being loaded: read by the loading thread, decoded by a worker.
+    struct SnapshotBlock {
+        std::size_t count = 0;
+        std::uint64_t checksum = 0;
+        std::string payload;
+        std::vector<Key> keys;
+        std::vector<Value> values;
+        bool valid = false;
+    };
+
+    template <typename Source>
+    static BPlusTree readSnapshot(Source&& source, BPlusTreeOptions options) {
+        static_assert(kSpillable, "deserialize() needs trivially copyable or std::string keys and values");
+        auto corrupted = [](const char* what) { return std::runtime_error(std::string("Corrupted B+Tree snapshot: ") + what); };
+        auto read = [&](char* data, std::size_t size) {
+            if (size != 0 && source(data, size) != size) throw corrupted("truncated");
+        };
+        char header[detail::kSnapshotHeaderBytes];
+        read(header, sizeof(header));
+        if (std::memcmp(header, detail::kSnapshotMagic, sizeof(detail::kSnapshotMagic)) != 0) throw corrupted("bad magic");
+        if (detail::getFixed(header + 8, 4) != detail::kSnapshotVersion) throw std::runtime_error("Unsupported B+Tree snapshot version");
+        if (detail::getFixed(header + 12, 4) != (detail::kDeltaEncodable<Key> ? detail::kSnapshotDeltaKeys : 0)) {
+            throw corrupted("key encoding does not match the key type");
+        }
+
+        BPlusTree tree(std::move(options));
+        std::vector<Node*> spine{tree.root_};
+        std::optional<Key> last;
+        std::optional<std::uint64_t> total;
+        const unsigned workers = workerCount(0);
+        std::vector<SnapshotBlock> round(workers * kChunksPerWorker);
+        while (!total) {
+            std::size_t filled = 0;
+            while (filled < round.size() && !total) {
+                char head[detail::kSnapshotBlockHeaderBytes];
+                read(head, sizeof(head));
+                SnapshotBlock& block = round[filled];
+                block.count = static_cast<std::size_t>(detail::getFixed(head, 4));
+                block.checksum = detail::getFixed(head + 8, 8);
+                // The size is not checked yet: grow the buffer as the bytes arrive, so that a corrupted
+                // one ends as "truncated" instead of a multi-GiB allocation.
+                const auto size = static_cast<std::size_t>(detail::getFixed(head + 4, 4));
+                block.payload.clear();
+                while (block.payload.size() < size) {
+                    const std::size_t done = block.payload.size();
+                    const std::size_t piece = std::min(size - done, std::max(done, detail::kSnapshotBlockBytes));
+                    block.payload.resize(done + piece);
+                    read(&block.payload[done], piece);
+                }
+                if (block.count != 0) {
+                    ++filled;
+                    continue;
+                }
+                const char* in = block.payload.data();
+                std::uint64_t entries = 0;
+                if (detail::blockChecksum(in, block.payload.size()) != block.checksum ||
+                    !detail::getVarint(in, in + block.payload.size(), entries)) {
+                    throw corrupted("bad end block");
+                }
+                total = entries;
+            }
+            runChunks(filled, workers, [&](std::size_t i) { round[i].valid = decodeSnapshotBlock(round[i]); });
+            for (std::size_t i = 0; i < filled; ++i) {
+                SnapshotBlock& block = round[i];
+                if (!block.valid) throw corrupted("bad block");
+                if (last && !(*last < block.keys.front())) throw corrupted("keys out of order");
+                last = block.keys.back();
+                for (std::size_t j = 0; j < block.count; ++j) tree.bulkAppend(spine, std::move(block.keys[j]), std::move(block.values[j]));
+            }
+        }
+        if (*total != tree.size_) throw corrupted("entry count mismatch");
+        tree.enforceMemoryBudget();
+        return tree;
+    }
+
+    // Checks a block against its checksum and decodes its entries, which must be in ascending order.
+    static bool decodeSnapshotBlock(SnapshotBlock& block) {
+        block.keys.clear();
+        block.values.clear();
+        if (detail::blockChecksum(block.payload.data(), block.payload.size()) != block.checksum) return false;
+        // Every entry takes at least a byte, which bounds what a corrupted count can reserve.
+        block.keys.reserve(std::min(block.count, block.payload.size()));
+        block.values.reserve(std::min(block.count, block.payload.size()));
+        const char* in = block.payload.data();
+        const char* end = in + block.payload.size();
+        std::uint64_t previous = 0;
+        Key key{};
+        Value value{};
+        for (std::size_t i = 0; i < block.count; ++i) {
+            if constexpr (detail::kDeltaEncodable<Key>) {
+                std::uint64_t delta = 0;
+                if (!detail::getVarint(in, end, delta)) return false;
+                previous += delta;
+                key = detail::fromOrderedBits<Key>(previous);
+                if (detail::orderedBits(key) != previous) return false;
+            } else {
+                if (!detail::Codec<Key>::decode(in, end, key)) return false;
+            }
+            if (!detail::Codec<Value>::decode(in, end, value)) return false;
+            if (i != 0 && !(block.keys.back() < key)) return false;
+            block.keys.push_back(std::move(key));
+            block.values.push_back(std::move(value));
+        }
+        return in == end;
+    }
+
+    // Appends an entry greater than every key in the tree. spine[0] is the last leaf and spine[i] its
+    // ancestor i levels up, each the rightmost node of its level.
+    void bulkAppend(std::vector<Node*>& spine, Key&& key, Value&& value) {
+        Node* leaf = spine.front();
+        if (leaf->keys.size() == maxKeys()) {
+            // The full leaf is final, so it may be evicted now.
+            enforceMemoryBudget();
+            leaf = newNode(true);
+            bumpVersion(leaf);
+            linkLeafAfter(spine.front(), leaf);
+            bulkAttach(spine, 1, Key(key), leaf);
+            spine.front() = leaf;
+        }
+        charge(key, value);
+        leaf->keys.push_back(std::move(key));
+        leaf->values.push_back(std::move(value));
+        ++size_;
+    }
+
+    // Hangs `child` under the rightmost node `level` levels up, behind `separator`. A full node is
+    // followed by a new one, which is hung one level up in turn; above the root that means a new root.
+    void bulkAttach(std::vector<Node*>& spine, std::size_t level, Key&& separator, Node* child) {
+        if (level == spine.size()) {
+            root_ = newNode(false);
+            root_->children.push_back(spine.back()->self);
+            spine.back()->parent = root_->self;
+            spine.push_back(root_);
+        }
+        Node* parent = spine[level];
+        if (parent->children.size() == Order) {
+            parent = newNode(false);
+            bulkAttach(spine, level + 1, std::move(separator), parent);
+            spine[level] = parent;
+        } else {
+            parent->keys.push_back(std::move(separator));
+        }
+        parent->children.push_back(child->self);
+        child->parent = parent->self;
+    }
+
+    // --- Memory budget ----------------------------------------------------------------------------
+    bool budgeted() const { return options_.memory_budget != 0; }
+
+    void charge(const Key& key, const Value& value) const {
+        if constexpr (kSpillable) {
+            if (budgeted()) resident_bytes_ += detail::Codec<Key>::footprint(key) + detail::Codec<Value>::footprint(value);
+        }
+    }
+    void release(const Key& key, const Value& value) const {
+        if constexpr (kSpillable) {
+            if (budgeted()) resident_bytes_ -= detail::Codec<Key>::footprint(key) + detail::Codec<Value>::footprint(value);
+        }
+    }
+
+    // Marks the leaf as recently used, reloading it if it was evicted. Returns true if it was reloaded.
+    bool touchLeaf(Node* leaf) const {
+        if (!budgeted()) return false;
+        leaf->referenced = true;
+        if (!leaf->evicted) return false;
+        reloadLeaf(leaf);
+        return true;
+    }
+
+    void reloadLeaf(Node* leaf) const {
+        forEachSpilled(leaf, [&](Key& key, Value& value) {
+            charge(key, value);
+            leaf->keys.push_back(std::move(key));
+            leaf->values.push_back(std::move(value));
+        });
+        leaf->evicted = false;
+        leaf->live = 0;
+    }
+
+    // Decodes an evicted leaf's entries in key order, calling fn(Key&, Value&) for each.
+    template <typename Fn>
+    void forEachSpilled(const Node* leaf, Fn&& fn) const {
+        if constexpr (kSpillable) {
+            const std::string bytes = spill_->read(leaf->spill);
+            const char* in = bytes.data();
+            const char* end = in + bytes.size();
+            std::uint64_t count = 0;
+            bool ok = detail::getVarint(in, end, count);
+            Key key{};
+            Value value{};
+            for (std::size_t i = 0; ok && i < count; ++i) {
+                ok = detail::Codec<Key>::decode(in, end, key) && detail::Codec<Value>::decode(in, end, value);
+                if (ok) fn(key, value);
+            }
+            if (!ok) throw std::runtime_error("Corrupted leaf in B+Tree spill file");
+        } else {
+            (void)leaf;
+            (void)fn;
+        }
+    }
+
+    void evictLeaf(Node* leaf) const {
+        if constexpr (kSpillable) {
+            packLeaf(leaf);
+            std::string bytes;
+            detail::putVarint(bytes, leaf->keys.size());
+            for (std::size_t i = 0; i < leaf->keys.size(); ++i) {
+                detail::Codec<Key>::encode(bytes, leaf->keys[i]);
+                detail::Codec<Value>::encode(bytes, leaf->values[i]);
+                release(leaf->keys[i], leaf->values[i]);
+            }
+            leaf->spill = spill_->write(bytes, leaf->spill);
+            leaf->live = leaf->keys.size();
+            leaf->keys.clear();
+            leaf->values.clear();
+            shrinkNode(leaf);
+            leaf->evicted = true;
+        }
+    }
+
+    // Recounts size_ and resident_bytes_ after split_at(). Needs the latch in either mode.
+    void settleCounts() const {
+        if (!counts_stale_.load(std::memory_order_acquire)) return;
+        std::lock_guard<std::mutex> lock(count_mutex_);
+        if (!counts_stale_.load(std::memory_order_relaxed)) return;
+        std::size_t entries = 0;
+        std::size_t resident = 0;
+        for (const Node* leaf = leftmostLeaf(root_); leaf; leaf = nextLeaf(leaf)) {
+            entries += entryCount(leaf);
+            resident += residentBytes(leaf);
+        }
+        size_ = entries;
+        resident_bytes_ = resident;
+        counts_stale_.store(false, std::memory_order_release);
+    }
+
+    // Evicts cold leaves until the resident entries fit the budget again. The root leaf stays put.
+    void enforceMemoryBudget() const {
+        if (!budgeted()) return;
+        // A stale total is an upper bound, so there is only something to recount when it is over.
+        if (resident_bytes_ > options_.memory_budget) settleCounts();
+        while (resident_bytes_ > options_.memory_budget) {
+            Node* victim = nextClockVictim();
+            if (!victim) return;
+            evictLeaf(victim);
+        }
+    }
+
+    // CLOCK: sweeps the leaves in key order, clearing referenced bits until it meets an unreferenced one.
+    Node* nextClockVictim() const {
+        Node* leaf = clock_hand_ ? clock_hand_ : leftmostLeaf(root_);
+        for (int wraps = 0; wraps < 3;) {
+            Node* next = nextLeaf(leaf);
+            if (!leaf->evicted && !isRoot(leaf)) {
+                if (!leaf->referenced) {
+                    clock_hand_ = next;
+                    return leaf;
+                }
+                leaf->referenced = false;
+            }
+            if (!next) {
+                ++wraps;
+                next = leftmostLeaf(root_);
+            }
+            leaf = next;
+        }
+        return nullptr;
+    }
+
+    // Drops the memory budget bookkeeping of a leaf that is about to be freed.
+    void forgetLeaf(Node* node) {
+        if (node == clock_hand_) clock_hand_ = nullptr;
+    }
+
+    // --- Overflow ---------------------------------------------------------------------------------
+    void handleLeafOverflow(Node* leaf) {
+        packLeaf(leaf);
+        if (options_.overflow_policy == OverflowPolicy::Redistribute && !isRoot(leaf)) {
+            Node* parent = parentOf(leaf);
+            const std::size_t idx = childIndex(parent, leaf);
+            Node* left = idx > 0 ? childAt(parent, idx - 1) : nullptr;
+            Node* right = idx + 1 < parent->children.size() ? childAt(parent, idx + 1) : nullptr;
+            // Cold siblings are left alone rather than reloaded.
+            if (left && left->evicted) left = nullptr;
+            if (right && right->evicted) right = nullptr;
+            if (left && entryCount(left) < maxKeys()) {
+                packLeaf(left);
+                const std::size_t shift = (leaf->keys.size() - left->keys.size()) / 2;
+                moveEntries(leaf, 0, shift, left, left->keys.size());
+                updateParentKeyForChild(leaf);
+                return;
+            }
+            if (right && entryCount(right) < maxKeys()) {
+                packLeaf(right);
+                const std::size_t shift = (leaf->keys.size() - right->keys.size()) / 2;
+                moveEntries(leaf, leaf->keys.size() - shift, leaf->keys.size(), right, 0);
+                updateParentKeyForChild(right);
+                return;
+            }
+            if (right || left) {
+                splitTwoIntoThree(right ? leaf : left, right ? right : leaf);
+                return;
+            }
+        }
+        splitLeaf(leaf);
+    }
+
+    // Moves the entries [first, last) of `from` into `to` in front of position `at`. Both leaves are packed.
+    void moveEntries(Node* from, std::size_t first, std::size_t last, Node* to, std::size_t at) {
+        bumpVersion(from);
+        bumpVersion(to);
+        const auto begin = static_cast<std::ptrdiff_t>(first);
+        const auto end = static_cast<std::ptrdiff_t>(last);
+        to->keys.insert(to->keys.begin() + static_cast<std::ptrdiff_t>(at), std::make_move_iterator(from->keys.begin() + begin),
+                        std::make_move_iterator(from->keys.begin() + end));
+        to->values.insert(to->values.begin() + static_cast<std::ptrdiff_t>(at),
+                          std::make_move_iterator(from->values.begin() + begin),
+                          std::make_move_iterator(from->values.begin() + end));
+        from->keys.erase(from->keys.begin() + begin, from->keys.begin() + end);
+        from->values.erase(from->values.begin() + begin, from->values.begin() + end);
+    }
+
+    // Redistributes two adjacent full leaves (left, right) of the same parent over three leaves.
+    void splitTwoIntoThree(Node* left, Node* right) {
+        packLeaf(left);
+        packLeaf(right);
+        const std::size_t total = left->keys.size() + right->keys.size();
+        const std::size_t left_count = total / 3;
+        const std::size_t right_count = (total - left_count) / 2;
+
+        Node* third = newNode(true);
+        linkLeafAfter(right, third);
+        moveEntries(right, right_count - (left->keys.size() - left_count), right->keys.size(), third, 0);
+        moveEntries(left, left_count, left->keys.size(), right, 0);
+        updateParentKeyForChild(right);
+        if (options_.leaf_layout == LeafLayout::Gapped) {
+            spreadLeaf(left);
+            spreadLeaf(right);
+            spreadLeaf(third);
+        }
+        insertIntoParent(right, third->keys.front(), third);
+    }
+
     void splitLeaf(Node* leaf) {
-        auto new_leaf = std::make_unique<Node>(true);
+        packLeaf(leaf);
+        Node* new_leaf = newNode(true);
+        linkLeafAfter(leaf, new_leaf);
+        bumpVersion(leaf);
         std::size_t mid = leaf->keys.size() / 2;
-        new_leaf->keys.assign(leaf->keys.begin() + static_cast<std::ptrdiff_t>(mid), leaf->keys.end());
-        new_leaf->values.assign(leaf->values.begin() + static_cast<std::ptrdiff_t>(mid), leaf->values.end());
+        new_leaf->keys.assign(std::make_move_iterator(leaf->keys.begin() + static_cast<std::ptrdiff_t>(mid)),
+                              std::make_move_iterator(leaf->keys.end()));
+        new_leaf->values.assign(std::make_move_iterator(leaf->values.begin() + static_cast<std::ptrdiff_t>(mid)),
+                                std::make_move_iterator(leaf->values.end()));
 
         leaf->keys.resize(mid);
         leaf->values.resize(mid);
-        insertIntoParent(leaf, new_leaf->keys.front(), std::move(new_leaf));
+        if (options_.leaf_layout == LeafLayout::Gapped) {
+            spreadLeaf(leaf);
+            spreadLeaf(new_leaf);
+        }
+        insertIntoParent(leaf, new_leaf->keys.front(), new_leaf);
         updateParentKeyForChild(leaf);
     }
 
     void splitInternal(Node* node) {
-        auto new_node = std::make_unique<Node>(false);
+        ++split_epoch_;
+        Node* new_node = newNode(false);
         std::size_t mid = node->keys.size() / 2;
-        Key up_key = node->keys[mid];
+        Key up_key = std::move(node->keys[mid]);
 
-        new_node->keys.assign(node->keys.begin() + static_cast<std::ptrdiff_t>(mid + 1), node->keys.end());
+        new_node->keys.assign(std::make_move_iterator(node->keys.begin() + static_cast<std::ptrdiff_t>(mid + 1)),
+                              std::make_move_iterator(node->keys.end()));
         node->keys.resize(mid);
         // split and distribute children
         for (std::size_t i = mid + 1; i < node->children.size(); ++i) {
-            std::unique_ptr<Node> child = std::move(node->children[i]);
-            child->parent = new_node.get();
-            new_node->children.push_back(std::move(child));
+            childAt(node, i)->parent = new_node->self;
         }
+        new_node->children.assign(node->children.begin() + static_cast<std::ptrdiff_t>(mid + 1), node->children.end());
         node->children.resize(mid + 1);
-        insertIntoParent(node, up_key, std::move(new_node));
-    }
-
-    void insertIntoParent(Node* left, const Key& key, std::unique_ptr<Node> right) {
-        if (!left->parent) {
-            auto new_root = std::make_unique<Node>(false);
-            new_root->keys.push_back(key);
-            new_root->children.push_back(std::move(root_));
-            new_root->children.push_back(std::move(right));
-            new_root->children[0]->parent = new_root.get();
-            new_root->children[1]->parent = new_root.get();
-            root_ = std::move(new_root);
+        insertIntoParent(node, std::move(up_key), new_node);
+    }
+
+    // `right` becomes the sibling after `left`; the parent takes ownership of it.
+    void insertIntoParent(Node* left, Key key, Node* right) {
+        if (isRoot(left)) {
+            ++split_epoch_;
+            Node* new_root = newNode(false);
+            new_root->keys.push_back(std::move(key));
+            new_root->children.push_back(root_->self);
+            new_root->children.push_back(right->self);
+            root_->parent = new_root->self;
+            right->parent = new_root->self;
+            root_ = new_root;
             return;
         }
 
-        Node* parent = left->parent;
-        Node* right_raw = right.get();
-        right_raw->parent = parent;
-        auto pos = std::find_if(parent->children.begin(), parent->children.end(),
-                                [left](const std::unique_ptr<Node>& child) { return child.get() == left; });
+        Node* parent = parentOf(left);
+        right->parent = parent->self;
+        auto pos = std::find(parent->children.begin(), parent->children.end(), left->self);
         if (pos == parent->children.end()) {
             throw std::logic_error("Broken parent/child relationship in B+Tree");
         }
         std::size_t index = static_cast<std::size_t>(std::distance(parent->children.begin(), pos));
 
-        parent->keys.insert(parent->keys.begin() + static_cast<std::ptrdiff_t>(index), key);
-        parent->children.insert(parent->children.begin() + static_cast<std::ptrdiff_t>(index + 1), std::move(right));
+        parent->keys.insert(parent->keys.begin() + static_cast<std::ptrdiff_t>(index), std::move(key));
+        parent->children.insert(parent->children.begin() + static_cast<std::ptrdiff_t>(index + 1), right->self);
         if (parent->keys.size() > maxKeys()) {
             splitInternal(parent);
         }
     }
     // note(hikettei): why is it needed??
     void updateParentKeyForChild(Node* child) {
-        if (!child->parent) return;
-        Node* parent = child->parent;
+        if (isRoot(child)) return;
+        Node* parent = parentOf(child);
         std::size_t idx = childIndex(parent, child);
         if (idx == 0) return; // The first child is unconstrained by parent keys
         parent->keys[idx - 1] = child->keys.front();
     }
 
     std::size_t childIndex(const Node* parent, const Node* child) const {
-        auto it = std::find_if(parent->children.begin(), parent->children.end(),
-                               [child](const std::unique_ptr<Node>& candidate) { return candidate.get() == child; });
+        auto it = std::find(parent->children.begin(), parent->children.end(), child->self);
         if (it == parent->children.end()) throw std::logic_error("Child missing from parent in B+Tree");
         return static_cast<std::size_t>(std::distance(parent->children.begin(), it));
     }
@@ -161,10 +3523,144 @@ private:
 };
 
 #ifdef B_PLUS_TREE_DEMO
+#include <csignal>
 #include <iostream>
 #include <string>
 
-int main() {
+#include "replication.hpp"
+
+namespace {
+// Value of `--name value` in argv, or `fallback`.
+std::string option(int argc, char** argv, const std::string& name, const std::string& fallback) {
+    for (int i = 2; i + 1 < argc; ++i) {
+        if (argv[i] == "--" + name) return argv[i + 1];
+    }
+    return fallback;
+}
+
+// --port/--unix, or with a prefix --leader-port/--leader-unix and the like.
+kv::Endpoint endpointOption(int argc, char** argv, const std::string& prefix = "", const std::string& port = "7070") {
+    kv::Endpoint endpoint;
+    endpoint.unix_path = option(argc, argv, prefix + "unix", "");
+    endpoint.port = static_cast<std::uint16_t>(std::stoul(option(argc, argv, prefix + "port", port)));
+    return endpoint;
+}
+
+std::string describe(const kv::Endpoint& endpoint) {
+    return endpoint.unix_path.empty() ? "127.0.0.1:" + std::to_string(endpoint.port) : endpoint.unix_path;
+}
+
+kv::LoadOptions loadOptions(int argc, char** argv) {
+    kv::LoadOptions options;
+    options.connections = static_cast<unsigned>(std::stoul(option(argc, argv, "connections", "4")));
+    options.depth = static_cast<unsigned>(std::stoul(option(argc, argv, "depth", "32")));
+    options.requests = std::stoull(option(argc, argv, "requests", "1000000"));
+    options.keys = std::stoull(option(argc, argv, "keys", "100000"));
+    options.get_ratio = std::stod(option(argc, argv, "gets", "0.9"));
+    return options;
+}
+
+void printReport(const kv::LoadOptions& options, const kv::LoadReport& report) {
+    std::cout << report.requests << " requests over " << options.connections << " connections (depth " << options.depth
+              << ", " << options.get_ratio * 100 << "% GET) in " << report.seconds << " s: "
+              << static_cast<double>(report.requests) / report.seconds << " requests/s, " << report.hits << " GET hits\n";
+}
+
+// Serves `tree` until SIGINT or SIGTERM.
+int serveUntilSignalled(int argc, char** argv, kv::Tree& tree) {
+    kv::Server server(tree, endpointOption(argc, argv), static_cast<unsigned>(std::stoul(option(argc, argv, "workers", "0"))));
+    std::cout << "listening on " << describe(server.endpoint()) << '\n' << std::flush;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    int signal = 0;
+    sigwait(&signals, &signal);
+    server.stop();
+    std::cout << "stopped with " << tree.size() << " entries\n";
+    return 0;
+}
+
+// Blocks SIGINT and SIGTERM before any thread starts, so that only sigwait() sees them.
+void blockStopSignals() {
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+}
+
+int serve(int argc, char** argv) {
+    blockStopSignals();
+    kv::Tree tree;
+    std::unique_ptr<kv::ReplicationLeader<>> leader;
+    if (!option(argc, argv, "replication-port", "").empty() || !option(argc, argv, "replication-unix", "").empty()) {
+        leader = std::make_unique<kv::ReplicationLeader<>>(tree, endpointOption(argc, argv, "replication-", "0"));
+        std::cout << "shipping changes on " << describe(leader->endpoint()) << '\n';
+    }
+    return serveUntilSignalled(argc, argv, tree);
+}
+
+int follow(int argc, char** argv) {
+    blockStopSignals();
+    kv::ReplicationFollower<> follower(endpointOption(argc, argv, "leader-"));
+    std::cout << "following " << describe(endpointOption(argc, argv, "leader-")) << " from change " << follower.sequence() << '\n';
+    return serveUntilSignalled(argc, argv, follower.tree());
+}
+
+// Inserts `requests` random keys into a tree as fast as one thread can, while a follower on a Unix
+// socket replays them, and reports both rates and how long the follower took to catch up.
+int replicate(int argc, char** argv) {
+    const kv::LoadOptions options = loadOptions(argc, argv);
+    kv::Tree tree;
+    kv::Endpoint endpoint;
+    endpoint.unix_path = "/tmp/b_plus_tree_demo." + std::to_string(::getpid()) + ".replication.sock";
+    kv::ReplicationLeader<> leader(tree, endpoint);
+    kv::ReplicationFollower<> follower(leader.endpoint());
+    std::mt19937_64 rng(71);
+    std::uniform_int_distribution<std::uint64_t> key(0, options.keys - 1);
+    const std::string value(options.value_bytes, 'v');
+    const auto start = std::chrono::steady_clock::now();
+    for (std::uint64_t i = 0; i < options.requests; ++i) tree.insert(kv::loadKey(key(rng)), value);
+    const auto written = std::chrono::steady_clock::now();
+    const bool synced = follower.wait_for(leader.sequence(), std::chrono::minutes(5));
+    const auto caught_up = std::chrono::steady_clock::now();
+    const double write_seconds = std::chrono::duration<double>(written - start).count();
+    const double total_seconds = std::chrono::duration<double>(caught_up - start).count();
+    std::cout << options.requests << " inserts: leader " << static_cast<double>(options.requests) / write_seconds
+              << " /s, follower " << static_cast<double>(options.requests) / total_seconds << " /s, caught up "
+              << std::chrono::duration<double, std::milli>(caught_up - written).count() << " ms after the last write ("
+              << (synced && follower.tree().size() == tree.size() ? "in sync" : "NOT in sync") << ")\n";
+    return synced ? 0 : 1;
+}
+}  // namespace
+
+// b_plus_tree_demo                      inserts three strings
+// b_plus_tree_demo serve    [--port 7070 | --unix PATH] [--workers N] [--replication-port P | --replication-unix PATH]
+// b_plus_tree_demo follow   --leader-port P | --leader-unix PATH [--port 7070 | --unix PATH] [--workers N]
+// b_plus_tree_demo replicate [--requests 1000000] [--keys 100000]   measures a follower against one writer
+// b_plus_tree_demo load     [--port 7070 | --unix PATH] [--connections 4] [--depth 32] [--requests 1000000]
+//                           [--keys 100000] [--gets 0.9]
+// b_plus_tree_demo loopback [load options]   serves on a Unix socket and loads it in one process
+int main(int argc, char** argv) {
+    const std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "serve") return serve(argc, argv);
+    if (mode == "follow") return follow(argc, argv);
+    if (mode == "replicate") return replicate(argc, argv);
+    if (mode == "load" || mode == "loopback") {
+        const kv::LoadOptions options = loadOptions(argc, argv);
+        kv::Tree tree;
+        std::unique_ptr<kv::Server> server;
+        kv::Endpoint endpoint = endpointOption(argc, argv);
+        if (mode == "loopback") {
+            endpoint.unix_path = "/tmp/b_plus_tree_demo." + std::to_string(::getpid()) + ".sock";
+            server = std::make_unique<kv::Server>(tree, endpoint, static_cast<unsigned>(std::stoul(option(argc, argv, "workers", "0"))));
+        }
+        kv::preload(endpoint, options);
+        printReport(options, kv::runLoad(endpoint, options));
+        return 0;
+    }
+
     BPlusTree<std::string, std::string, 4> tree;
     tree.insert("B", "ten");
     tree.insert("A", "twenty");
@@ -0,0 +1,376 @@
+#pragma once
+
+// Log shipping for hot standbys: a leader streams every change made to a BPlusTree (captured by its
+// change hook) to followers that keep a copy of it, typically in other processes. Include main.cpp
+// first.
+//
+// A follower connects to the leader's endpoint and receives, framed as in server.hpp, a Hello
+// frame, a snapshot of the tree in the serialize() format, then a Batch frame per group of changes:
+//   Hello  varint sequence
+//   Batch  varint sequence of its last change, varint n, n times (u8 MutationKind, key, then the
+//          end key for EraseRange or the value for Put; detail::Codec encoding)
+// Sequence numbers count the changes since the leader started logging. The follower is registered
+// before the snapshot is taken, so the snapshot may already contain the first changes it is sent;
+// replaying them is harmless (see BPlusTree::set_change_hook()). A follower whose unsent changes
+// outgrow the leader's cap is disconnected; it has to connect again and load a fresh snapshot.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+
+#include "server.hpp"
+
+namespace kv {
+inline constexpr std::uint8_t kHelloFrame = 16;
+inline constexpr std::uint8_t kBatchFrame = 17;
+// Default cap on a follower's unsent changes: room for the Batch frame header and varints, so that
+// the follower never receives a frame it would reject.
+inline constexpr std::size_t kMaxPendingBytes = kMaxFrameBytes - 32;
+
+// Captures the changes of `tree` and ships them to every follower connected to `endpoint`. Each
+// follower has its own sender thread; the changes logged while it sends one batch make up the next,
+// so batches grow with the write rate and a follower that falls behind catches up in larger steps,
+// up to `max_pending` bytes; one that falls further behind is dropped. Capturing happens inside the
+// tree's writers, under its exclusive latch: the change is encoded once and appended to the pending
+// buffer of every follower. The snapshot is encoded under the tree's latch but sent after it is
+// released (see BPlusTree::snapshot()), so a slow follower does not hold up the writers.
+template <typename T = Tree>
+class ReplicationLeader {
+public:
+  using Key = typename T::key_type;
+  using Value = typename T::mapped_type;
+
+  ReplicationLeader(T& tree, Endpoint endpoint, std::size_t max_pending = kMaxPendingBytes)
+      : tree_(tree), endpoint_(std::move(endpoint)), max_pending_(max_pending) {
+    listen_fd_ = listenOn(endpoint_);
+    stop_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd_ < 0) fail("cannot create eventfd");
+    tree_.set_change_hook([this](const Mutation<Key, Value>& mutation) { capture(mutation); });
+    acceptor_ = std::thread([this] { acceptLoop(); });
+  }
+  ReplicationLeader(const ReplicationLeader&) = delete;
+  ReplicationLeader& operator=(const ReplicationLeader&) = delete;
+  ~ReplicationLeader() {
+    stop();
+    ::close(stop_fd_);
+    ::close(listen_fd_);
+    if (!endpoint_.unix_path.empty()) ::unlink(endpoint_.unix_path.c_str());
+  }
+
+  // The endpoint actually listened on (with the port picked by the kernel if 0 was asked for).
+  const Endpoint& endpoint() const { return endpoint_; }
+
+  // Number of changes logged so far; a follower is in sync once its sequence() reaches it.
+  std::uint64_t sequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sequence_;
+  }
+
+  // Followers currently being served: connected and not dropped.
+  std::size_t follower_count() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return static_cast<std::size_t>(
+        std::count_if(followers_.begin(), followers_.end(), [](const auto& follower) { return !follower->failed; }));
+  }
+
+  // Disconnects the followers and detaches from the tree; idempotent.
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopped_) return;
+      stopped_ = true;
+      // Also fails a snapshot that is being written.
+      for (auto& follower : followers_) ::shutdown(follower->fd, SHUT_RDWR);
+    }
+    wake_.notify_all();
+    const std::uint64_t one = 1;
+    if (::write(stop_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) fail("cannot signal acceptor");
+    acceptor_.join();
+    for (auto& follower : followers_) {
+      follower->thread.join();
+      ::close(follower->fd);
+    }
+    tree_.set_change_hook({});
+  }
+
+private:
+  struct Follower {
+    int fd = -1;
+    std::string pending;     // encoded changes not sent yet
+    std::size_t count = 0;   // changes in `pending`
+    std::uint64_t last = 0;  // sequence of the last one
+    bool failed = false;
+    bool done = false;       // its thread has finished and can be joined
+    std::thread thread;
+  };
+
+  // Stops sending to a follower; its sender notices and quits. Needs mutex_.
+  static void drop(Follower& follower) {
+    follower.failed = true;
+    follower.pending.clear();
+    follower.count = 0;
+    ::shutdown(follower.fd, SHUT_RDWR);
+  }
+
+  void capture(const Mutation<Key, Value>& mutation) {
+    // A sender only waits while its buffer is empty, so only the first change of a batch wakes it.
+    bool wake = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      ++sequence_;
+      if (followers_.empty()) return;
+      change_.clear();
+      change_.push_back(static_cast<char>(mutation.kind));
+      detail::Codec<Key>::encode(change_, *mutation.key);
+      if (mutation.kind == MutationKind::EraseRange) detail::Codec<Key>::encode(change_, *mutation.end);
+      if (mutation.kind == MutationKind::Put) detail::Codec<Value>::encode(change_, *mutation.value);
+      for (auto& follower : followers_) {
+        if (follower->failed) continue;
+        if (follower->pending.size() + change_.size() > max_pending_) {
+          drop(*follower);
+          wake = true;
+          continue;
+        }
+        follower->pending += change_;
+        wake = wake || follower->count == 0;
+        ++follower->count;
+        follower->last = sequence_;
+      }
+    }
+    if (wake) wake_.notify_all();
+  }
+
+  void acceptLoop() {
+    pollfd fds[2] = {{listen_fd_, POLLIN, 0}, {stop_fd_, POLLIN, 0}};
+    for (;;) {
+      if (::poll(fds, 2, -1) < 0) {
+        if (errno == EINTR) continue;
+        return;
+      }
+      if (fds[1].revents != 0) return;
+      const int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd < 0) continue;
+      if (endpoint_.unix_path.empty()) {
+        const int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      }
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopped_) {
+        ::close(fd);
+        return;
+      }
+      // Followers that went away or were dropped are reaped as new ones come in.
+      for (auto it = followers_.begin(); it != followers_.end();) {
+        if (!(*it)->done) {
+          ++it;
+          continue;
+        }
+        (*it)->thread.join();
+        ::close((*it)->fd);
+        it = followers_.erase(it);
+      }
+      followers_.push_back(std::make_unique<Follower>());
+      Follower& follower = *followers_.back();
+      follower.fd = fd;
+      follower.thread = std::thread([this, &follower, start = sequence_] {
+        ship(follower, start);
+        std::lock_guard<std::mutex> done_lock(mutex_);
+        follower.done = true;
+      });
+    }
+  }
+
+  void ship(Follower& follower, std::uint64_t start) {
+    try {
+      std::string frame;
+      std::string hello;
+      detail::putVarint(hello, start);
+      appendFrame(frame, kHelloFrame, hello);
+      sendFully(follower.fd, frame);
+      // Encoded under the tree's latch; the socket is written after it is released.
+      sendFully(follower.fd, tree_.snapshot());
+      std::string batch;
+      for (;;) {
+        std::size_t count = 0;
+        std::uint64_t last = 0;
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          wake_.wait(lock, [&] { return stopped_ || follower.failed || follower.count != 0; });
+          if (stopped_ || follower.failed) return;
+          batch.swap(follower.pending);
+          follower.pending.clear();
+          std::swap(count, follower.count);
+          last = follower.last;
+        }
+        frame.assign(kFrameHeaderBytes, '\0');
+        frame[0] = static_cast<char>(kBatchFrame);
+        detail::putVarint(frame, last);
+        detail::putVarint(frame, count);
+        frame += batch;
+        detail::putFixed(&frame[1], frame.size() - kFrameHeaderBytes, 4);
+        sendFully(follower.fd, frame);
+      }
+    } catch (const std::exception&) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      drop(follower);
+    }
+  }
+
+  T& tree_;
+  Endpoint endpoint_;
+  int listen_fd_ = -1;
+  int stop_fd_ = -1;
+  std::size_t max_pending_;
+  std::thread acceptor_;
+  mutable std::mutex mutex_;  // guards everything below
+  std::condition_variable wake_;
+  bool stopped_ = false;
+  std::uint64_t sequence_ = 0;
+  std::string change_;
+  std::vector<std::unique_ptr<Follower>> followers_;
+};
+
+// Keeps a copy of a leader's tree: loads its snapshot when constructed, then applies its batches on
+// a background thread, the puts of a batch (up to the next erase) with one insert_batch(). The copy
+// is meant for reads; writes to it are not shipped anywhere and may be undone by the leader's.
+template <typename T = Tree>
+class ReplicationFollower {
+public:
+  using Key = typename T::key_type;
+  using Value = typename T::mapped_type;
+
+  // Blocks until the snapshot is loaded. Throws std::runtime_error if the leader cannot be reached
+  // or sends something else.
+  explicit ReplicationFollower(const Endpoint& leader, BPlusTreeOptions options = {})
+      : fd_(openSocket(leader, false)), reader_(fd_) {
+    try {
+      // Read unbuffered, as the snapshot follows right behind.
+      char header[kFrameHeaderBytes];
+      std::string hello;
+      if (detail::readFully(fd_, header, sizeof(header)) == sizeof(header) &&
+          static_cast<std::uint8_t>(header[0]) == kHelloFrame) {
+        hello.resize(static_cast<std::size_t>(detail::getFixed(header + 1, 4)));
+      }
+      const char* in = hello.data();
+      if (hello.empty() || detail::readFully(fd_, &hello[0], hello.size()) != hello.size() ||
+          !detail::getVarint(in, in + hello.size(), sequence_)) {
+        throw std::runtime_error("replication leader sent no hello");
+      }
+      tree_ = T::deserialize(fd_, std::move(options));
+    } catch (...) {
+      ::close(fd_);
+      throw;
+    }
+    thread_ = std::thread([this] { apply(); });
+  }
+  ReplicationFollower(const ReplicationFollower&) = delete;
+  ReplicationFollower& operator=(const ReplicationFollower&) = delete;
+  ~ReplicationFollower() {
+    stop();
+    ::close(fd_);
+  }
+
+  T& tree() { return tree_; }
+  const T& tree() const { return tree_; }
+
+  // Sequence number of the last change applied.
+  std::uint64_t sequence() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return sequence_;
+  }
+  // False once the leader has gone or sent something malformed; the copy stays as it was then.
+  bool connected() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return connected_;
+  }
+  // Waits until the changes up to `sequence` are applied; returns false on timeout or disconnect.
+  bool wait_for(std::uint64_t sequence, std::chrono::milliseconds timeout) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    applied_.wait_for(lock, timeout, [&] { return sequence_ >= sequence || !connected_; });
+    return sequence_ >= sequence;
+  }
+
+  // Disconnects from the leader; idempotent.
+  void stop() {
+    if (!thread_.joinable()) return;
+    ::shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+  }
+
+private:
+  void apply() {
+    std::uint8_t tag = 0;
+    std::string body;
+    std::vector<std::pair<Key, Value>> puts;
+    auto flush = [&] {
+      if (!puts.empty()) tree_.insert_batch(std::move(puts));
+      puts.clear();
+    };
+    try {
+      while (reader_.next(tag, body)) {
+        const char* in = body.data();
+        const char* end = in + body.size();
+        std::uint64_t last = 0;
+        std::uint64_t count = 0;
+        if (tag != kBatchFrame || !detail::getVarint(in, end, last) || !detail::getVarint(in, end, count)) break;
+        bool valid = true;
+        Key key{};
+        Key bound{};
+        Value value{};
+        for (std::uint64_t i = 0; i < count && valid; ++i) {
+          const auto kind = in != end ? static_cast<MutationKind>(*in++) : MutationKind{0xFF};
+          valid = detail::Codec<Key>::decode(in, end, key);
+          if (valid && kind == MutationKind::Put) {
+            valid = detail::Codec<Value>::decode(in, end, value);
+            if (valid) puts.emplace_back(std::move(key), std::move(value));
+            continue;
+          }
+          flush();
+          if (!valid) break;
+          if (kind == MutationKind::Erase) {
+            tree_.erase(key);
+          } else if (kind == MutationKind::EraseRange && detail::Codec<Key>::decode(in, end, bound)) {
+            tree_.erase_range(key, bound);
+          } else if (kind == MutationKind::EraseFrom) {
+            tree_.erase_from(key);
+          } else {
+            valid = false;
+          }
+        }
+        flush();
+        if (!valid) break;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          sequence_ = last;
+        }
+        applied_.notify_all();
+      }
+    } catch (const std::exception&) {
+      // A failed read ends the stream like a closed connection does.
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      connected_ = false;
+    }
+    applied_.notify_all();
+  }
+
+  int fd_;
+  FrameReader reader_;
+  T tree_;
+  std::thread thread_;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable applied_;
+  std::uint64_t sequence_ = 0;
+  bool connected_ = true;
+};
+}  // namespace kv
@@ -0,0 +1,375 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace detail {
+// Chase–Lev work-stealing deque of pointers: the owning worker pushes and pops at the bottom,
+// other workers steal from the top. The ring grows on demand; replaced rings are kept until the
+// deque dies because a thief may still be reading one.
+template <typename T>
+class WorkStealingDeque {
+  static_assert(std::is_pointer_v<T>, "WorkStealingDeque stores pointers");
+
+public:
+  explicit WorkStealingDeque(std::size_t capacity = 64) : ring_(new Ring(capacity)) {}
+  WorkStealingDeque(const WorkStealingDeque&) = delete;
+  WorkStealingDeque& operator=(const WorkStealingDeque&) = delete;
+  ~WorkStealingDeque() {
+    delete ring_.load(std::memory_order_relaxed);
+    for (Ring* ring : retired_) delete ring;
+  }
+
+  // Owner only.
+  void push(T item) {
+    const std::int64_t bottom = bottom_.load(std::memory_order_relaxed);
+    const std::int64_t top = top_.load(std::memory_order_acquire);
+    Ring* ring = ring_.load(std::memory_order_relaxed);
+    if (bottom - top >= static_cast<std::int64_t>(ring->capacity)) ring = grow(ring, top, bottom);
+    ring->put(bottom, item);
+    bottom_.store(bottom + 1, std::memory_order_release);
+  }
+
+  // Owner only. Returns nullptr when the deque is empty or a thief took the last item.
+  T pop() {
+    const std::int64_t bottom = bottom_.load(std::memory_order_relaxed) - 1;
+    Ring* ring = ring_.load(std::memory_order_relaxed);
+    bottom_.store(bottom, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::int64_t top = top_.load(std::memory_order_relaxed);
+    if (top > bottom) {
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    T item = ring->get(bottom);
+    if (top == bottom) {
+      // Last item: race the thieves for it.
+      if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        item = nullptr;
+      }
+      bottom_.store(bottom + 1, std::memory_order_relaxed);
+    }
+    return item;
+  }
+
+  // Any thread. Returns nullptr when the deque is empty or another thread won the race.
+  T steal() {
+    std::int64_t top = top_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    const std::int64_t bottom = bottom_.load(std::memory_order_acquire);
+    if (top >= bottom) return nullptr;
+    T item = ring_.load(std::memory_order_acquire)->get(top);
+    if (!top_.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+      return nullptr;
+    }
+    return item;
+  }
+
+private:
+  struct Ring {
+    explicit Ring(std::size_t size) : capacity(size), slots(new std::atomic<T>[size]) {}
+    void put(std::int64_t index, T item) {
+      slots[static_cast<std::size_t>(index) & (capacity - 1)].store(item, std::memory_order_relaxed);
+    }
+    T get(std::int64_t index) const {
+      return slots[static_cast<std::size_t>(index) & (capacity - 1)].load(std::memory_order_relaxed);
+    }
+    std::size_t capacity;  // a power of two
+    std::unique_ptr<std::atomic<T>[]> slots;
+  };
+
+  Ring* grow(Ring* ring, std::int64_t top, std::int64_t bottom) {
+    Ring* bigger = new Ring(ring->capacity * 2);
+    for (std::int64_t i = top; i < bottom; ++i) bigger->put(i, ring->get(i));
+    retired_.push_back(ring);
+    ring_.store(bigger, std::memory_order_release);
+    return bigger;
+  }
+
+  alignas(64) std::atomic<std::int64_t> top_{0};
+  alignas(64) std::atomic<std::int64_t> bottom_{0};
+  std::atomic<Ring*> ring_;
+  std::vector<Ring*> retired_;
+};
+
+// Fixed pool of workers, each owning a WorkStealingDeque. parallel_for forks by pushing the upper
+// half of its range onto the calling worker's deque and joins by popping it back, or, if it was
+// stolen, by running other tasks until the thief is done. Idle workers steal from random victims
+// and sleep when there is nothing to take.
+class WorkStealingScheduler {
+public:
+  explicit WorkStealingScheduler(unsigned workers) {
+    workers_.reserve(std::max(1u, workers));
+    for (unsigned i = 0; i < std::max(1u, workers); ++i) workers_.push_back(std::make_unique<Worker>(this, i));
+    for (auto& worker : workers_) worker->thread = std::thread([this, raw = worker.get()] { workerLoop(raw); });
+  }
+  WorkStealingScheduler(const WorkStealingScheduler&) = delete;
+  WorkStealingScheduler& operator=(const WorkStealingScheduler&) = delete;
+  ~WorkStealingScheduler() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      stopping_ = true;
+      ++signal_;
+    }
+    sleep_cv_.notify_all();
+    for (auto& worker : workers_) worker->thread.join();
+  }
+
+  // Process-wide scheduler with one worker per hardware thread, started on first use.
+  static WorkStealingScheduler& instance() {
+    static WorkStealingScheduler scheduler(std::thread::hardware_concurrency());
+    return scheduler;
+  }
+
+  unsigned worker_count() const { return static_cast<unsigned>(workers_.size()); }
+
+  // Calls fn(i) for every i in [begin, end), splitting the range in halves down to `grain` indices.
+  // Blocks until every call has returned. The first exception thrown by fn cancels the calls that
+  // have not started yet and is rethrown here. May be nested: a worker that calls it keeps working
+  // on its own and stolen tasks while it waits.
+  template <typename Fn>
+  void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, Fn&& fn) {
+    if (begin >= end) return;
+    RangeJob<std::remove_reference_t<Fn>> job{this, &fn, std::max<std::size_t>(grain, 1)};
+    if (current_ && current_->scheduler == this) {
+      job.run(begin, end);
+    } else {
+      // Outside the pool: hand the whole range to a worker and wait for it.
+      RootTask<std::remove_reference_t<Fn>> root(&job, begin, end);
+      {
+        std::lock_guard<std::mutex> lock(injected_mutex_);
+        injected_.push_back(&root);
+      }
+      wake();
+      root.wait();
+    }
+    if (job.error) std::rethrow_exception(job.error);
+  }
+
+  // parallel_for() with at most `max_concurrency` calls of fn running at once (0: no limit beyond
+  // the pool). That many lanes each claim the next `grain` indices until the range is used up; with
+  // a limit of 1 the calls run in order on the calling thread.
+  template <typename Fn>
+  void parallel_for(std::size_t begin, std::size_t end, std::size_t grain, unsigned max_concurrency, Fn&& fn) {
+    if (begin >= end) return;
+    grain = std::max<std::size_t>(grain, 1);
+    const std::size_t pieces = (end - begin + grain - 1) / grain;
+    if (max_concurrency == 1) {
+      for (std::size_t i = begin; i < end; ++i) fn(i);
+      return;
+    }
+    if (max_concurrency == 0 || max_concurrency >= worker_count() || max_concurrency >= pieces) {
+      parallel_for(begin, end, grain, fn);
+      return;
+    }
+    std::atomic<std::size_t> next{begin};
+    std::atomic<bool> failed{false};
+    const std::size_t lanes = std::min<std::size_t>(max_concurrency, pieces);
+    parallel_for(0, lanes, 1, [&](std::size_t) {
+      while (!failed.load(std::memory_order_relaxed)) {
+        const std::size_t first = next.fetch_add(grain, std::memory_order_relaxed);
+        if (first >= end) return;
+        try {
+          for (std::size_t i = first; i < std::min(first + grain, end); ++i) fn(i);
+        } catch (...) {
+          failed.store(true, std::memory_order_relaxed);
+          throw;
+        }
+      }
+    });
+  }
+
+private:
+  struct Task {
+    virtual void execute() = 0;
+    std::atomic<bool> done{false};
+
+  protected:
+    ~Task() = default;
+  };
+
+  struct Worker {
+    Worker(WorkStealingScheduler* owner, unsigned worker_index)
+        : scheduler(owner), index(worker_index), rng(0x9E3779B97F4A7C15ull * (worker_index + 1)) {}
+    WorkStealingScheduler* scheduler;
+    unsigned index;
+    WorkStealingDeque<Task*> deque;
+    std::uint64_t rng;  // xorshift state for picking victims
+    std::thread thread;
+  };
+
+  template <typename Fn>
+  struct RangeJob {
+    RangeJob(WorkStealingScheduler* owner, Fn* body, std::size_t min_size) : scheduler(owner), fn(body), grain(min_size) {}
+
+    WorkStealingScheduler* scheduler;
+    Fn* fn;
+    std::size_t grain;
+    std::atomic<bool> failed{false};
+    std::mutex error_mutex;
+    std::exception_ptr error;
+
+    void run(std::size_t begin, std::size_t end) {
+      if (end - begin > grain) {
+        const std::size_t mid = begin + (end - begin) / 2;
+        SplitTask<Fn> upper(this, mid, end);
+        scheduler->spawn(&upper);
+        run(begin, mid);
+        scheduler->join(&upper);
+        return;
+      }
+      for (std::size_t i = begin; i < end && !failed.load(std::memory_order_relaxed); ++i) {
+        try {
+          (*fn)(i);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(error_mutex);
+          if (!error) error = std::current_exception();
+          failed.store(true, std::memory_order_relaxed);
+        }
+      }
+    }
+  };
+
+  template <typename Fn>
+  struct SplitTask final : Task {
+    SplitTask(RangeJob<Fn>* owner, std::size_t first, std::size_t last) : job(owner), begin(first), end(last) {}
+    void execute() override {
+      job->run(begin, end);
+      done.store(true, std::memory_order_release);
+    }
+    RangeJob<Fn>* job;
+    std::size_t begin;
+    std::size_t end;
+  };
+
+  template <typename Fn>
+  struct RootTask final : Task {
+    RootTask(RangeJob<Fn>* owner, std::size_t first, std::size_t last) : job(owner), begin(first), end(last) {}
+    void execute() override {
+      job->run(begin, end);
+      std::lock_guard<std::mutex> lock(mutex);
+      done.store(true, std::memory_order_release);
+      finished.notify_one();
+    }
+    void wait() {
+      std::unique_lock<std::mutex> lock(mutex);
+      finished.wait(lock, [this] { return done.load(std::memory_order_acquire); });
+    }
+    RangeJob<Fn>* job;
+    std::size_t begin;
+    std::size_t end;
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  void spawn(Task* task) {
+    current_->deque.push(task);
+    // Pairs with the fence in idle(): either this sees the sleeper or the sleeper sees the task.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleepers_.load(std::memory_order_relaxed) > 0) wake();
+  }
+
+  void join(Task* task) {
+    Worker* self = current_;
+    while (!task->done.load(std::memory_order_acquire)) {
+      // Everything pushed after `task` has been joined already, so the bottom is `task` unless it was stolen.
+      Task* next = self->deque.pop();
+      if (!next) next = steal(self);
+      if (next) {
+        next->execute();
+      } else {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+  Task* steal(Worker* self) {
+    const std::size_t count = workers_.size();
+    self->rng ^= self->rng << 13;
+    self->rng ^= self->rng >> 7;
+    self->rng ^= self->rng << 17;
+    const std::size_t start = static_cast<std::size_t>(self->rng % count);
+    for (std::size_t i = 0; i < count; ++i) {
+      Worker* victim = workers_[(start + i) % count].get();
+      if (victim == self) continue;
+      if (Task* task = victim->deque.steal()) return task;
+    }
+    return nullptr;
+  }
+
+  Task* takeInjected() {
+    std::lock_guard<std::mutex> lock(injected_mutex_);
+    if (injected_.empty()) return nullptr;
+    Task* task = injected_.back();
+    injected_.pop_back();
+    return task;
+  }
+
+  Task* findWork(Worker* self) {
+    Task* task = self->deque.pop();
+    if (!task) task = steal(self);
+    if (!task) task = takeInjected();
+    return task;
+  }
+
+  void workerLoop(Worker* self) {
+    current_ = self;
+    for (;;) {
+      if (Task* task = findWork(self)) {
+        task->execute();
+        continue;
+      }
+      if (!idle(self)) return;
+    }
+  }
+
+  // Sleeps until new work may have appeared. Returns false once the scheduler is stopping.
+  bool idle(Worker* self) {
+    std::uint64_t seen;
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      if (stopping_) return false;
+      seen = signal_;
+    }
+    sleepers_.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (Task* task = findWork(self)) {
+      sleepers_.fetch_sub(1, std::memory_order_relaxed);
+      task->execute();
+      return true;
+    }
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    sleep_cv_.wait(lock, [&] { return signal_ != seen || stopping_; });
+    sleepers_.fetch_sub(1, std::memory_order_relaxed);
+    return !stopping_;
+  }
+
+  void wake() {
+    {
+      std::lock_guard<std::mutex> lock(sleep_mutex_);
+      ++signal_;
+    }
+    sleep_cv_.notify_all();
+  }
+
+  static inline thread_local Worker* current_ = nullptr;
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::mutex injected_mutex_;
+  std::vector<Task*> injected_;  // parallel_for calls from outside the pool
+  std::atomic<int> sleepers_{0};
+  std::mutex sleep_mutex_;
+  std::condition_variable sleep_cv_;
+  std::uint64_t signal_ = 0;  // bumped under sleep_mutex_ whenever sleepers should look for work
+  bool stopping_ = false;
+};
+}  // namespace detail
@@ -0,0 +1,639 @@
+#pragma once
+
+// Key-value service on top of BPlusTree<std::string, std::string, N>: an epoll server speaking a
+// pipelined binary protocol, a blocking client, and the load generator behind `b_plus_tree_demo
+// load`. Include main.cpp first.
+//
+// Every message is a frame: u8 tag, u32 body length (little-endian), body. Strings in a body are
+// a varint length followed by the bytes (detail::Codec<std::string>).
+//   request  GET   key                     response  Ok value | NotFound
+//            PUT   key value                         Ok
+//            MGET  varint n, n keys                  Ok varint n, n times (u8 found, value if found)
+//            SCAN  lo hi varint limit                Ok varint n, n times (key value); keys in [lo, hi)
+// A malformed request gets an Error frame whose body is the message. Clients may send any number of
+// requests before reading; responses come back in request order.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace kv {
+using Tree = BPlusTree<std::string, std::string, 64>;
+
+enum class Op : std::uint8_t { Get = 1, Put = 2, MGet = 3, Scan = 4 };
+enum class Status : std::uint8_t { Ok = 0, NotFound = 1, Error = 2 };
+
+inline constexpr std::size_t kFrameHeaderBytes = 5;
+// Larger frames are taken for garbage and close the connection.
+inline constexpr std::size_t kMaxFrameBytes = std::size_t{64} << 20;
+
+// Where the server listens: a Unix socket if `unix_path` is set, else 127.0.0.1:`port`.
+struct Endpoint {
+  std::string unix_path;
+  std::uint16_t port = 0;
+};
+
+inline void appendFrame(std::string& out, std::uint8_t tag, std::string_view body) {
+  char header[kFrameHeaderBytes];
+  header[0] = static_cast<char>(tag);
+  detail::putFixed(header + 1, body.size(), 4);
+  out.append(header, sizeof(header));
+  out.append(body.data(), body.size());
+}
+
+inline void putString(std::string& out, std::string_view text) {
+  detail::putVarint(out, text.size());
+  out.append(text.data(), text.size());
+}
+
+[[noreturn]] inline void fail(const char* what) { throw std::runtime_error(std::string(what) + ": " + std::strerror(errno)); }
+
+inline int openSocket(const Endpoint& endpoint, bool listening) {
+  const int fd = ::socket(endpoint.unix_path.empty() ? AF_INET : AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) fail("cannot create socket");
+  int rc;
+  if (endpoint.unix_path.empty()) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(endpoint.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int on = 1;
+    if (listening) {
+      ::setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      rc = ::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    } else {
+      ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      rc = ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+  } else {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (endpoint.unix_path.size() >= sizeof(address.sun_path)) {
+      ::close(fd);
+      throw std::invalid_argument("Unix socket path too long");
+    }
+    std::memcpy(address.sun_path, endpoint.unix_path.c_str(), endpoint.unix_path.size() + 1);
+    if (listening) {
+      ::unlink(endpoint.unix_path.c_str());
+      rc = ::bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    } else {
+      rc = ::connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+    }
+  }
+  if (rc != 0) {
+    const int error = errno;
+    ::close(fd);
+    errno = error;
+    fail(listening ? "cannot bind socket" : "cannot connect");
+  }
+  return fd;
+}
+
+// Opens a listening socket. A port of 0 in `endpoint` is replaced by the one the kernel picked.
+inline int listenOn(Endpoint& endpoint) {
+  const int fd = openSocket(endpoint, true);
+  if (::listen(fd, SOMAXCONN) != 0) fail("cannot listen");
+  if (endpoint.unix_path.empty()) {
+    sockaddr_in address{};
+    socklen_t length = sizeof(address);
+    ::getsockname(fd, reinterpret_cast<sockaddr*>(&address), &length);
+    endpoint.port = ntohs(address.sin_port);
+  }
+  return fd;
+}
+
+// Writes all of `data` to a blocking socket; a closed peer makes it throw rather than raise SIGPIPE.
+inline void sendFully(int fd, std::string_view data) {
+  for (std::size_t done = 0; done < data.size();) {
+    const ssize_t written = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) fail("cannot send");
+    done += static_cast<std::size_t>(written);
+  }
+}
+
+// Buffered reader of the frames arriving on a blocking socket.
+class FrameReader {
+public:
+  explicit FrameReader(int fd) : fd_(fd) {}
+
+  // Returns false if the peer closed the connection before a whole frame arrived.
+  bool next(std::uint8_t& tag, std::string& body) {
+    while (in_.size() - in_pos_ < kFrameHeaderBytes || in_.size() - in_pos_ < kFrameHeaderBytes + frameLength()) {
+      if (in_pos_ != 0) {
+        in_.erase(0, in_pos_);
+        in_pos_ = 0;
+      }
+      char buffer[64 * 1024];
+      const ssize_t got = ::read(fd_, buffer, sizeof(buffer));
+      if (got < 0 && errno == EINTR) continue;
+      if (got < 0) fail("cannot receive frame");
+      if (got == 0) return false;
+      in_.append(buffer, static_cast<std::size_t>(got));
+    }
+    tag = static_cast<std::uint8_t>(in_[in_pos_]);
+    const std::size_t length = frameLength();
+    body.assign(in_, in_pos_ + kFrameHeaderBytes, length);
+    in_pos_ += kFrameHeaderBytes + length;
+    return true;
+  }
+
+private:
+  std::size_t frameLength() const { return static_cast<std::size_t>(detail::getFixed(in_.data() + in_pos_ + 1, 4)); }
+
+  int fd_;
+  std::string in_;
+  std::size_t in_pos_ = 0;
+};
+
+// One request as parsed by the server.
+struct Request {
+  Op op = Op::Get;
+  std::string key;    // GET, PUT; SCAN: lo
+  std::string value;  // PUT; SCAN: hi
+  std::vector<std::string> keys;  // MGET
+  std::uint64_t limit = 0;        // SCAN
+};
+
+inline bool parseRequest(std::uint8_t tag, const char* in, const char* end, Request& request) {
+  using StringCodec = detail::Codec<std::string>;
+  request.op = static_cast<Op>(tag);
+  switch (request.op) {
+    case Op::Get:
+      if (!StringCodec::decode(in, end, request.key)) return false;
+      break;
+    case Op::Put:
+      if (!StringCodec::decode(in, end, request.key) || !StringCodec::decode(in, end, request.value)) return false;
+      break;
+    case Op::MGet: {
+      std::uint64_t count = 0;
+      if (!detail::getVarint(in, end, count) || count > static_cast<std::uint64_t>(end - in)) return false;
+      request.keys.resize(static_cast<std::size_t>(count));
+      for (std::string& key : request.keys) {
+        if (!StringCodec::decode(in, end, key)) return false;
+      }
+      break;
+    }
+    case Op::Scan:
+      if (!StringCodec::decode(in, end, request.key) || !StringCodec::decode(in, end, request.value) ||
+          !detail::getVarint(in, end, request.limit)) {
+        return false;
+      }
+      break;
+    default:
+      return false;
+  }
+  return in == end;
+}
+
+// epoll server. Every worker thread runs its own epoll loop; the listening socket is registered
+// with all of them (EPOLLEXCLUSIVE), and a connection stays with the worker that accepted it.
+// The requests a connection has pipelined are answered in batches: a run of GET/MGET becomes one
+// find_batch() and a run of PUT one insert_batch(), so many connections share the tree through its
+// reader-writer latch without taking it once per request.
+class Server {
+public:
+  Server(Tree& tree, Endpoint endpoint, unsigned workers = 0) : tree_(tree), endpoint_(std::move(endpoint)) {
+    listen_fd_ = listenOn(endpoint_);
+    setNonBlocking(listen_fd_);
+    stop_fd_ = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd_ < 0) fail("cannot create eventfd");
+    if (workers == 0) workers = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < workers; ++i) {
+      const int epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+      if (epoll_fd < 0) fail("cannot create epoll instance");
+      epoll_event listen_event{};
+      listen_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+      listen_event.data.ptr = &listen_fd_;
+      epoll_event stop_event{};
+      stop_event.events = EPOLLIN;
+      stop_event.data.ptr = &stop_fd_;
+      if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd_, &listen_event) != 0 ||
+          ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_fd_, &stop_event) != 0) {
+        fail("cannot register with epoll");
+      }
+      epoll_fds_.push_back(epoll_fd);
+    }
+    for (int epoll_fd : epoll_fds_) threads_.emplace_back([this, epoll_fd] { serve(epoll_fd); });
+  }
+  Server(const Server&) = delete;
+  Server& operator=(const Server&) = delete;
+  ~Server() {
+    stop();
+    for (int epoll_fd : epoll_fds_) ::close(epoll_fd);
+    ::close(stop_fd_);
+    ::close(listen_fd_);
+    if (!endpoint_.unix_path.empty()) ::unlink(endpoint_.unix_path.c_str());
+  }
+
+  // The endpoint actually listened on (with the port picked by the kernel if 0 was asked for).
+  const Endpoint& endpoint() const { return endpoint_; }
+
+  // Closes every connection and joins the workers; idempotent.
+  void stop() {
+    const std::uint64_t one = 1;
+    if (::write(stop_fd_, &one, sizeof(one)) < 0 && errno != EAGAIN) fail("cannot signal workers");
+    for (std::thread& thread : threads_) {
+      if (thread.joinable()) thread.join();
+    }
+  }
+
+private:
+  struct Connection {
+    int fd = -1;
+    std::string in;
+    std::size_t in_pos = 0;
+    std::string out;
+    std::size_t out_pos = 0;
+    bool writing = false;   // registered for EPOLLOUT
+    bool draining = false;  // the peer is done sending; close once `out` is written
+  };
+
+  static void setNonBlocking(int fd) {
+    const int flags = ::fcntl(fd, F_GETFL);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) != 0) fail("cannot make socket non-blocking");
+  }
+
+  void serve(int epoll_fd) {
+    std::unordered_map<int, std::unique_ptr<Connection>> connections;
+    epoll_event events[64];
+    for (;;) {
+      const int ready = ::epoll_wait(epoll_fd, events, 64, -1);
+      if (ready < 0 && errno == EINTR) continue;
+      if (ready < 0) fail("epoll_wait failed");
+      for (int i = 0; i < ready; ++i) {
+        if (events[i].data.ptr == &stop_fd_) {
+          for (auto& entry : connections) ::close(entry.first);
+          return;
+        }
+        if (events[i].data.ptr == &listen_fd_) {
+          acceptAll(epoll_fd, connections);
+          continue;
+        }
+        auto* connection = static_cast<Connection*>(events[i].data.ptr);
+        if (!service(epoll_fd, *connection, events[i].events)) {
+          ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection->fd, nullptr);
+          ::close(connection->fd);
+          connections.erase(connection->fd);
+        }
+      }
+    }
+  }
+
+  void acceptAll(int epoll_fd, std::unordered_map<int, std::unique_ptr<Connection>>& connections) {
+    for (;;) {
+      const int fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) return;  // EAGAIN: another worker took it, or nothing left
+      if (endpoint_.unix_path.empty()) {
+        const int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+      }
+      auto connection = std::make_unique<Connection>();
+      connection->fd = fd;
+      epoll_event event{};
+      event.events = EPOLLIN | EPOLLRDHUP;
+      event.data.ptr = connection.get();
+      if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        ::close(fd);
+        continue;
+      }
+      connections.emplace(fd, std::move(connection));
+    }
+  }
+
+  // Reads what arrived, answers every complete request and writes back what the socket takes.
+  // Returns false once the connection should be closed.
+  bool service(int epoll_fd, Connection& connection, std::uint32_t events) {
+    bool open = !connection.draining;
+    if (open && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+      char buffer[64 * 1024];
+      for (;;) {
+        const ssize_t got = ::read(connection.fd, buffer, sizeof(buffer));
+        if (got > 0) {
+          connection.in.append(buffer, static_cast<std::size_t>(got));
+          continue;
+        }
+        if (got < 0 && errno == EINTR) continue;
+        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) open = false;
+        break;
+      }
+      if (!answer(connection)) return false;
+    }
+    while (connection.out_pos < connection.out.size()) {
+      const ssize_t written =
+          ::send(connection.fd, connection.out.data() + connection.out_pos, connection.out.size() - connection.out_pos, MSG_NOSIGNAL);
+      if (written < 0 && errno == EINTR) continue;
+      if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      if (written < 0) return false;
+      connection.out_pos += static_cast<std::size_t>(written);
+    }
+    if (connection.out_pos == connection.out.size()) {
+      connection.out.clear();
+      connection.out_pos = 0;
+    }
+    const bool writing = !connection.out.empty();
+    // A peer that stopped sending still gets the answers it is owed; only writability matters then.
+    if (!open && !writing) return false;
+    if (writing != connection.writing || open == connection.draining) {
+      epoll_event event{};
+      event.events = open ? EPOLLIN | EPOLLRDHUP | (writing ? EPOLLOUT : 0u) : EPOLLOUT;
+      event.data.ptr = &connection;
+      ::epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.fd, &event);
+      connection.writing = writing;
+      connection.draining = !open;
+    }
+    return true;
+  }
+
+  // Parses the complete frames in the input buffer and appends their responses, batching runs of
+  // reads and runs of writes. Returns false on an oversized frame.
+  bool answer(Connection& connection) {
+    std::vector<Request> requests;
+    std::vector<bool> valid;
+    const std::string& in = connection.in;
+    while (in.size() - connection.in_pos >= kFrameHeaderBytes) {
+      const char* header = in.data() + connection.in_pos;
+      const auto length = static_cast<std::size_t>(detail::getFixed(header + 1, 4));
+      if (length > kMaxFrameBytes) return false;
+      if (in.size() - connection.in_pos < kFrameHeaderBytes + length) break;
+      const char* body = header + kFrameHeaderBytes;
+      requests.emplace_back();
+      valid.push_back(parseRequest(static_cast<std::uint8_t>(header[0]), body, body + length, requests.back()));
+      connection.in_pos += kFrameHeaderBytes + length;
+    }
+    connection.in.erase(0, connection.in_pos);
+    connection.in_pos = 0;
+
+    for (std::size_t first = 0; first < requests.size();) {
+      if (!valid[first]) {
+        appendFrame(connection.out, static_cast<std::uint8_t>(Status::Error), "malformed request");
+        ++first;
+        continue;
+      }
+      const Op op = requests[first].op;
+      if (op == Op::Scan) {
+        answerScan(requests[first], connection.out);
+        ++first;
+        continue;
+      }
+      const bool reads = op == Op::Get || op == Op::MGet;
+      std::size_t last = first + 1;
+      while (last < requests.size() && valid[last] && requests[last].op != Op::Scan &&
+             (requests[last].op == Op::Put) != reads) {
+        ++last;
+      }
+      if (reads) {
+        answerReads(requests, first, last, connection.out);
+      } else {
+        answerWrites(requests, first, last, connection.out);
+      }
+      first = last;
+    }
+    return true;
+  }
+
+  void answerReads(std::vector<Request>& requests, std::size_t first, std::size_t last, std::string& out) {
+    std::vector<std::string> keys;
+    for (std::size_t i = first; i < last; ++i) {
+      if (requests[i].op == Op::Get) {
+        keys.push_back(std::move(requests[i].key));
+      } else {
+        for (std::string& key : requests[i].keys) keys.push_back(std::move(key));
+      }
+    }
+    const std::vector<std::optional<std::string>> values = tree_.find_batch(keys);
+    std::size_t next = 0;
+    std::string body;
+    for (std::size_t i = first; i < last; ++i) {
+      if (requests[i].op == Op::Get) {
+        const auto& value = values[next++];
+        appendFrame(out, static_cast<std::uint8_t>(value ? Status::Ok : Status::NotFound), value ? *value : std::string_view{});
+        continue;
+      }
+      body.clear();
+      detail::putVarint(body, requests[i].keys.size());
+      for (std::size_t k = 0; k < requests[i].keys.size(); ++k) {
+        const auto& value = values[next++];
+        body.push_back(value ? 1 : 0);
+        if (value) putString(body, *value);
+      }
+      appendFrame(out, static_cast<std::uint8_t>(Status::Ok), body);
+    }
+  }
+
+  void answerWrites(std::vector<Request>& requests, std::size_t first, std::size_t last, std::string& out) {
+    std::vector<std::pair<std::string, std::string>> entries;
+    entries.reserve(last - first);
+    for (std::size_t i = first; i < last; ++i) entries.emplace_back(std::move(requests[i].key), std::move(requests[i].value));
+    tree_.insert_batch(std::move(entries));
+    for (std::size_t i = first; i < last; ++i) appendFrame(out, static_cast<std::uint8_t>(Status::Ok), {});
+  }
+
+  void answerScan(const Request& request, std::string& out) {
+    std::string pairs;
+    std::uint64_t count = 0;
+    if (request.limit != 0) {
+      tree_.scan(request.key, request.value, [&](const std::string& key, const std::string& value) {
+        putString(pairs, key);
+        putString(pairs, value);
+        return ++count < request.limit;
+      });
+    }
+    std::string body;
+    detail::putVarint(body, count);
+    body += pairs;
+    appendFrame(out, static_cast<std::uint8_t>(Status::Ok), body);
+  }
+
+  Tree& tree_;
+  Endpoint endpoint_;
+  int listen_fd_ = -1;
+  int stop_fd_ = -1;
+  std::vector<int> epoll_fds_;
+  std::vector<std::thread> threads_;
+};
+
+struct Response {
+  Status status = Status::Ok;
+  std::string body;
+};
+
+// Blocking client. Requests are queued and sent by flush(); read() returns the responses in order,
+// so any number of requests can be in flight.
+class Client {
+public:
+  explicit Client(const Endpoint& endpoint) : fd_(openSocket(endpoint, false)), reader_(fd_) {}
+  Client(const Client&) = delete;
+  Client& operator=(const Client&) = delete;
+  ~Client() { ::close(fd_); }
+
+  void get(std::string_view key) {
+    body_.clear();
+    putString(body_, key);
+    appendFrame(out_, static_cast<std::uint8_t>(Op::Get), body_);
+  }
+  void put(std::string_view key, std::string_view value) {
+    body_.clear();
+    putString(body_, key);
+    putString(body_, value);
+    appendFrame(out_, static_cast<std::uint8_t>(Op::Put), body_);
+  }
+  void mget(const std::vector<std::string>& keys) {
+    body_.clear();
+    detail::putVarint(body_, keys.size());
+    for (const std::string& key : keys) putString(body_, key);
+    appendFrame(out_, static_cast<std::uint8_t>(Op::MGet), body_);
+  }
+  void scan(std::string_view lo, std::string_view hi, std::uint64_t limit) {
+    body_.clear();
+    putString(body_, lo);
+    putString(body_, hi);
+    detail::putVarint(body_, limit);
+    appendFrame(out_, static_cast<std::uint8_t>(Op::Scan), body_);
+  }
+  // Sends a raw frame; for tests of the server's error handling.
+  void raw(std::uint8_t tag, std::string_view body) { appendFrame(out_, tag, body); }
+
+  void flush() {
+    sendFully(fd_, out_);
+    out_.clear();
+  }
+
+  Response read() {
+    std::uint8_t tag = 0;
+    Response response;
+    if (!reader_.next(tag, response.body)) throw std::runtime_error("server closed the connection");
+    response.status = static_cast<Status>(tag);
+    return response;
+  }
+
+  // Decoders for the bodies of MGET and SCAN responses.
+  static std::vector<std::optional<std::string>> values(const Response& response) {
+    const char* in = response.body.data();
+    const char* end = in + response.body.size();
+    std::uint64_t count = 0;
+    detail::getVarint(in, end, count);
+    std::vector<std::optional<std::string>> values;
+    for (std::uint64_t i = 0; i < count && in != end; ++i) {
+      values.emplace_back();
+      if (*in++ == 0) continue;
+      values.back().emplace();
+      detail::Codec<std::string>::decode(in, end, *values.back());
+    }
+    return values;
+  }
+  static std::vector<std::pair<std::string, std::string>> entries(const Response& response) {
+    const char* in = response.body.data();
+    const char* end = in + response.body.size();
+    std::uint64_t count = 0;
+    detail::getVarint(in, end, count);
+    std::vector<std::pair<std::string, std::string>> entries(static_cast<std::size_t>(count));
+    for (auto& [key, value] : entries) {
+      detail::Codec<std::string>::decode(in, end, key);
+      detail::Codec<std::string>::decode(in, end, value);
+    }
+    return entries;
+  }
+
+private:
+  int fd_;
+  FrameReader reader_;
+  std::string out_;
+  std::string body_;
+};
+
+// Load generator: `connections` threads, each with its own connection, keep `depth` requests in
+// flight (GET with probability `get_ratio`, else PUT) on keys drawn uniformly from `keys`.
+struct LoadOptions {
+  unsigned connections = 4;
+  unsigned depth = 32;
+  std::uint64_t requests = 1'000'000;  // in total
+  std::uint64_t keys = 100'000;
+  double get_ratio = 0.9;
+  std::size_t value_bytes = 32;
+};
+
+struct LoadReport {
+  std::uint64_t requests = 0;
+  std::uint64_t hits = 0;  // GETs that found their key
+  double seconds = 0;
+};
+
+inline std::string loadKey(std::uint64_t index) { return "key" + std::to_string(index); }
+
+// Writes every key once (so that GETs hit), in pipelined PUTs over one connection.
+inline void preload(const Endpoint& endpoint, const LoadOptions& options) {
+  Client client(endpoint);
+  const std::string value(options.value_bytes, 'v');
+  for (std::uint64_t first = 0; first < options.keys; first += options.depth) {
+    const std::uint64_t last = std::min(options.keys, first + options.depth);
+    for (std::uint64_t key = first; key < last; ++key) client.put(loadKey(key), value);
+    client.flush();
+    for (std::uint64_t key = first; key < last; ++key) client.read();
+  }
+}
+
+inline LoadReport runLoad(const Endpoint& endpoint, const LoadOptions& options) {
+  std::atomic<std::uint64_t> hits{0};
+  std::vector<std::thread> threads;
+  const auto start = std::chrono::steady_clock::now();
+  for (unsigned c = 0; c < options.connections; ++c) {
+    threads.emplace_back([&, c] {
+      Client client(endpoint);
+      std::mt19937_64 rng(c + 1);
+      std::uniform_int_distribution<std::uint64_t> key(0, options.keys - 1);
+      std::bernoulli_distribution is_get(options.get_ratio);
+      const std::string value(options.value_bytes, 'w');
+      const std::uint64_t share = options.requests / options.connections + (c < options.requests % options.connections ? 1 : 0);
+      std::vector<bool> gets;
+      std::uint64_t found = 0;
+      for (std::uint64_t sent = 0; sent < share;) {
+        gets.clear();
+        for (; gets.size() < options.depth && sent < share; ++sent) {
+          gets.push_back(is_get(rng));
+          if (gets.back()) {
+            client.get(loadKey(key(rng)));
+          } else {
+            client.put(loadKey(key(rng)), value);
+          }
+        }
+        client.flush();
+        for (bool get : gets) {
+          const Response response = client.read();
+          if (get && response.status == Status::Ok) ++found;
+        }
+      }
+      hits += found;
+    });
+  }
+  for (std::thread& thread : threads) thread.join();
+  LoadReport report;
+  report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  report.requests = options.requests;
+  report.hits = hits.load();
+  return report;
+}
+}  // namespace kv
@@ -0,0 +1,679 @@
+#pragma once
+
+// A B+Tree whose nodes live in a POSIX shared memory segment, so that the processes of one host
+// share a single copy of an index instead of each building their own. One process writes at a
+// time; any number of threads in any number of processes read, without taking locks.
+//
+// Nodes are fixed-size slots after a header in the segment and refer to each other by slot index,
+// which stays valid wherever each process maps the segment. Keys and values are stored by copy and
+// must therefore be trivially copyable.
+//
+// Writes are copy-on-write: a writer copies the path from the root to the leaf it changes, then
+// publishes the new root by bumping the generation. The replaced nodes are retired, stamped with
+// that generation, and reused once no reader still works on an older one. Readers register the
+// generation they read in a slot of the header for the length of a lookup or scan, so a scan sees
+// one consistent version of the tree.
+//
+// Crashes: the writer lock is a robust process-shared mutex. Nothing reachable from the published
+// root is ever written, so when a writer dies mid-change the next one just rebuilds the list of
+// reusable slots from the published root (see recover()). A reader that dies inside a lookup leaves
+// its slot registered; it is cleared once its process is found gone, which is only checked when
+// the segment runs out of slots.
+//
+// Deletion drops a node only once it is empty instead of merging neighbours, which would copy
+// a sibling per erase; trees that shrink a lot and grow elsewhere keep sparse leaves.
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+template <typename Key, typename Value, std::size_t Order = 32>
+class SharedBPlusTree {
+  static_assert(Order >= 3, "B+Tree order must be at least 3");
+  static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+                "shared memory nodes hold keys and values by copy");
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "shared memory atomics must be lock-free");
+
+public:
+  using key_type = Key;
+  using mapped_type = Value;
+  static constexpr std::size_t kReaderSlots = 128;
+
+  // Opens the segment `name` (as for shm_open, e.g. "/index"), creating it with room for `max_nodes`
+  // nodes if it does not exist yet. Opening a segment created for another Key, Value or Order
+  // throws. The segment outlives the processes that use it until remove() is called.
+  explicit SharedBPlusTree(const std::string& name, std::size_t max_nodes = std::size_t{1} << 16) {
+    if (max_nodes == 0 || max_nodes >= kNone) throw std::invalid_argument("max_nodes out of range");
+    int fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    const bool creating = fd >= 0;
+    if (!creating) {
+      if (errno != EEXIST) fail("cannot create shared memory segment");
+      fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+      if (fd < 0) fail("cannot open shared memory segment");
+    }
+    try {
+      if (creating) {
+        mapping_bytes_ = nodesOffset() + max_nodes * sizeof(Node);
+        if (::ftruncate(fd, static_cast<off_t>(mapping_bytes_)) != 0) fail("cannot size shared memory segment");
+      } else {
+        mapping_bytes_ = waitForSize(fd);
+      }
+      void* base = ::mmap(nullptr, mapping_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (base == MAP_FAILED) fail("cannot map shared memory segment");
+      base_ = static_cast<char*>(base);
+      header_ = reinterpret_cast<Header*>(base_);
+      if (creating) {
+        initialize(max_nodes);
+      } else {
+        checkLayout();
+      }
+    } catch (...) {
+      if (base_) ::munmap(base_, mapping_bytes_);
+      ::close(fd);
+      if (creating) ::shm_unlink(name.c_str());
+      throw;
+    }
+    ::close(fd);
+  }
+  SharedBPlusTree(const SharedBPlusTree&) = delete;
+  SharedBPlusTree& operator=(const SharedBPlusTree&) = delete;
+  ~SharedBPlusTree() { ::munmap(base_, mapping_bytes_); }
+
+  // Unlinks the segment; processes that have it mapped keep using it.
+  static void remove(const std::string& name) { ::shm_unlink(name.c_str()); }
+
+  std::optional<Value> find(const Key& key) const {
+    ReadGuard guard(*this);
+    const Node* node = this->node(guard.root);
+    while (!node->leaf) node = this->node(node->children[childIndex(node, key)]);
+    const Key* keys_end = node->keys + node->count;
+    const Key* it = std::lower_bound(node->keys, keys_end, key);
+    if (it == keys_end || key < *it) return std::nullopt;
+    return node->values[it - node->keys];
+  }
+  bool contains(const Key& key) const { return find(key).has_value(); }
+
+  // Calls fn(key, value) for the entries with lo <= key < hi, in key order, all from the same
+  // version of the tree. Writers are not held up meanwhile.
+  template <typename Fn>
+  void scan(const Key& lo, const Key& hi, Fn&& fn) const {
+    ReadGuard guard(*this);
+    if (lo < hi) scanNode(node(guard.root), lo, hi, fn);
+  }
+
+  std::size_t size() const {
+    ReadGuard guard(*this);
+    return static_cast<std::size_t>(guard.size);
+  }
+  bool empty() const { return size() == 0; }
+
+  // Number of published versions; every insert() and erase() that changes the tree adds one.
+  std::uint64_t generation() const { return header_->generation.load(); }
+  std::size_t max_nodes() const { return static_cast<std::size_t>(header_->max_nodes); }
+
+  // Inserts the entry, overwriting the value if the key is already registered. Returns true if the
+  // entry was inserted. Throws std::length_error, leaving the tree unchanged, when the segment has
+  // no free slot for the copied path.
+  bool insert(const Key& key, const Value& value) {
+    WriteGuard guard(*this);
+    std::vector<PathStep> path = descend(guard.state.root, key);
+    const Node* leaf = node(path.back().node);
+    const Key* keys_end = leaf->keys + leaf->count;
+    const std::size_t pos = static_cast<std::size_t>(std::lower_bound(leaf->keys, keys_end, key) - leaf->keys);
+    const bool inserted = pos == leaf->count || key < leaf->keys[pos];
+
+    Split split;
+    {
+      Key keys[Order + 1];
+      Value values[Order + 1];
+      std::size_t count = leaf->count;
+      std::copy(leaf->keys, leaf->keys + pos, keys);
+      std::copy(leaf->values, leaf->values + pos, values);
+      keys[pos] = key;
+      values[pos] = value;
+      const std::size_t rest = inserted ? pos : pos + 1;
+      std::copy(leaf->keys + rest, keys_end, keys + pos + 1);
+      std::copy(leaf->values + rest, leaf->values + count, values + pos + 1);
+      if (inserted) ++count;
+      split = writeLeaf(guard, keys, values, count);
+    }
+    retire(guard, path.back().node);
+    path.pop_back();
+    replacePath(guard, path, split);
+    if (inserted) ++guard.state.size;
+    guard.commit();
+    return inserted;
+  }
+
+  // Removes the key; returns true if it was present.
+  bool erase(const Key& key) {
+    WriteGuard guard(*this);
+    std::vector<PathStep> path = descend(guard.state.root, key);
+    const Node* leaf = node(path.back().node);
+    const Key* keys_end = leaf->keys + leaf->count;
+    const Key* it = std::lower_bound(leaf->keys, keys_end, key);
+    if (it == keys_end || key < *it) return false;
+    const std::size_t pos = static_cast<std::size_t>(it - leaf->keys);
+
+    NodeIndex replacement = kNone;
+    if (leaf->count > 1 || path.size() == 1) {
+      replacement = allocate(guard);
+      Node* copy = node(replacement);
+      copy->leaf = true;
+      copy->count = leaf->count - 1;
+      std::copy(leaf->keys, leaf->keys + pos, copy->keys);
+      std::copy(leaf->keys + pos + 1, keys_end, copy->keys + pos);
+      std::copy(leaf->values, leaf->values + pos, copy->values);
+      std::copy(leaf->values + pos + 1, leaf->values + leaf->count, copy->values + pos);
+    }
+    retire(guard, path.back().node);
+    path.pop_back();
+    removeFromPath(guard, path, replacement);
+    --guard.state.size;
+    guard.commit();
+    return true;
+  }
+
+private:
+  using NodeIndex = std::uint32_t;
+  static constexpr NodeIndex kNone = ~NodeIndex{0};
+  static constexpr std::uint64_t kMagic = 0x5348415245444250ull;  // "SHAREDBP"
+
+  // Leaves hold up to Order entries; internal nodes up to Order children, keys[i] being the
+  // smallest key under children[i + 1].
+  struct Node {
+    bool leaf = true;
+    std::uint32_t count = 0;  // entries of a leaf, children of an internal node
+    Key keys[Order];
+    Value values[Order];
+    NodeIndex children[Order];
+    // Writer bookkeeping, never read by readers: the next slot in the reuse queue and the
+    // generation that stopped referencing this one.
+    std::atomic<NodeIndex> next_free{kNone};
+    std::atomic<std::uint64_t> retired{0};
+  };
+
+  // Everything a writer changes, published as a whole with the generation. Retired slots form a
+  // FIFO queue threaded through Node::next_free, in generation order.
+  struct State {
+    std::uint64_t root = kNone;
+    std::uint64_t size = 0;
+    std::uint64_t used = 0;  // slots handed out at least once; the rest were never touched
+    std::uint64_t free_head = kNone;
+    std::uint64_t free_tail = kNone;
+    std::uint64_t free_count = 0;
+  };
+  struct SharedState {
+    std::atomic<std::uint64_t> root;
+    std::atomic<std::uint64_t> size;
+    std::atomic<std::uint64_t> used;
+    std::atomic<std::uint64_t> free_head;
+    std::atomic<std::uint64_t> free_tail;
+    std::atomic<std::uint64_t> free_count;
+  };
+
+  struct alignas(64) ReaderSlot {
+    std::atomic<pid_t> pid{0};                // owner, 0 when the slot is free
+    std::atomic<std::uint64_t> generation{0};  // being read, 0 while none
+  };
+
+  struct Header {
+    std::atomic<std::uint64_t> magic;  // stored last by the creating process
+    std::uint64_t key_size;
+    std::uint64_t value_size;
+    std::uint64_t order;
+    std::uint64_t node_size;
+    std::uint64_t max_nodes;
+    pthread_mutex_t writer;
+    // Generation g is described by states[g % 2]; a writer fills the other one, then bumps this.
+    std::atomic<std::uint64_t> generation;
+    SharedState states[2];
+    ReaderSlot readers[kReaderSlots];
+  };
+
+  struct PathStep {
+    NodeIndex node;
+    std::size_t child;  // which child the descent took (internal nodes only)
+  };
+  // What replaces a node: `left` alone, or `left` and `right` split at `separator`.
+  struct Split {
+    NodeIndex left = kNone;
+    NodeIndex right = kNone;
+    Key separator{};
+  };
+
+  // --- Segment setup -------------------------------------------------------------------------------
+
+  [[noreturn]] static void fail(const char* what) { throw std::runtime_error(std::string(what) + ": " + std::strerror(errno)); }
+
+  static std::size_t nodesOffset() { return (sizeof(Header) + 63) / 64 * 64; }
+
+  // The creator sizes the segment right after creating it; wait until it has.
+  static std::size_t waitForSize(int fd) {
+    for (int attempt = 0; attempt < 10'000; ++attempt) {
+      struct stat st {};
+      if (::fstat(fd, &st) != 0) fail("cannot stat shared memory segment");
+      if (static_cast<std::size_t>(st.st_size) >= nodesOffset()) return static_cast<std::size_t>(st.st_size);
+      std::this_thread::yield();
+    }
+    throw std::runtime_error("shared memory segment was never initialized");
+  }
+
+  void initialize(std::size_t max_nodes) {
+    header_->key_size = sizeof(Key);
+    header_->value_size = sizeof(Value);
+    header_->order = Order;
+    header_->node_size = sizeof(Node);
+    header_->max_nodes = max_nodes;
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    const int error = pthread_mutex_init(&header_->writer, &attr);
+    pthread_mutexattr_destroy(&attr);
+    if (error != 0) {
+      errno = error;
+      fail("cannot initialize writer lock");
+    }
+    for (ReaderSlot& slot : header_->readers) {
+      slot.pid.store(0);
+      slot.generation.store(0);
+    }
+    State state;
+    state.used = 1;
+    state.root = 0;
+    ::new (node(0)) Node();
+    header_->generation.store(1);
+    store(header_->states[1], state);
+    header_->magic.store(kMagic);
+  }
+
+  void checkLayout() const {
+    for (int attempt = 0; header_->magic.load() != kMagic; ++attempt) {
+      if (attempt == 10'000) throw std::runtime_error("shared memory segment was never initialized");
+      std::this_thread::yield();
+    }
+    if (header_->key_size != sizeof(Key) || header_->value_size != sizeof(Value) || header_->order != Order ||
+        header_->node_size != sizeof(Node) || mapping_bytes_ < nodesOffset() + header_->max_nodes * sizeof(Node)) {
+      throw std::runtime_error("shared memory segment holds a different tree type");
+    }
+  }
+
+  Node* node(std::uint64_t index) const { return reinterpret_cast<Node*>(base_ + nodesOffset() + index * sizeof(Node)); }
+
+  // Sequentially consistent, so that a reader whose generation re-check comes out unchanged cannot
+  // have seen a field the writer stored for a later generation: that store precedes the bump of
+  // generation the re-check would then have seen.
+  static void store(SharedState& shared, const State& state) {
+    shared.root.store(state.root);
+    shared.size.store(state.size);
+    shared.used.store(state.used);
+    shared.free_head.store(state.free_head);
+    shared.free_tail.store(state.free_tail);
+    shared.free_count.store(state.free_count);
+  }
+  static State load(const SharedState& shared) {
+    State state;
+    state.root = shared.root.load();
+    state.size = shared.size.load();
+    state.used = shared.used.load();
+    state.free_head = shared.free_head.load();
+    state.free_tail = shared.free_tail.load();
+    state.free_count = shared.free_count.load();
+    return state;
+  }
+
+  // --- Readers -------------------------------------------------------------------------------------
+
+  // Claims a reader slot and pins the current generation for the guard's lifetime.
+  class ReadGuard {
+  public:
+    explicit ReadGuard(const SharedBPlusTree& tree) : header_(tree.header_) {
+      const pid_t self = ::getpid();
+      const std::size_t first = std::hash<std::thread::id>()(std::this_thread::get_id()) % kReaderSlots;
+      for (std::size_t index = first;; index = (index + 1) % kReaderSlots) {
+        pid_t expected = 0;
+        if (header_->readers[index].pid.compare_exchange_strong(expected, self)) {
+          slot_ = &header_->readers[index];
+          break;
+        }
+        if ((index + 1) % kReaderSlots != first) continue;
+        // A full sweep found every slot taken; readers that died inside a lookup may hold them.
+        tree.releaseDeadReaders();
+        std::this_thread::yield();
+      }
+      // Registering and then checking that the generation did not move ensures that a writer
+      // reclaiming slots afterwards sees the registration. The state of generation g is only
+      // rewritten for g + 2, after g + 1 was published, so a copy taken before an unchanged
+      // re-check is intact.
+      for (;;) {
+        const std::uint64_t generation = header_->generation.load();
+        slot_->generation.store(generation);
+        const State state = load(header_->states[generation % 2]);
+        if (header_->generation.load() != generation) continue;
+        root = static_cast<NodeIndex>(state.root);
+        size = state.size;
+        break;
+      }
+    }
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+    ~ReadGuard() {
+      slot_->generation.store(0);
+      slot_->pid.store(0);
+    }
+
+    NodeIndex root = kNone;
+    std::uint64_t size = 0;
+
+  private:
+    Header* header_;
+    ReaderSlot* slot_ = nullptr;
+  };
+
+  static std::size_t childIndex(const Node* node, const Key& key) {
+    return static_cast<std::size_t>(std::upper_bound(node->keys, node->keys + node->count - 1, key) - node->keys);
+  }
+
+  template <typename Fn>
+  void scanNode(const Node* node, const Key& lo, const Key& hi, Fn& fn) const {
+    if (node->leaf) {
+      for (const Key* it = std::lower_bound(node->keys, node->keys + node->count, lo); it != node->keys + node->count; ++it) {
+        if (!(*it < hi)) return;
+        fn(*it, node->values[it - node->keys]);
+      }
+      return;
+    }
+    for (std::size_t child = childIndex(node, lo); child < node->count; ++child) {
+      if (child > 0 && !(node->keys[child - 1] < hi)) return;
+      scanNode(this->node(node->children[child]), lo, hi, fn);
+    }
+  }
+
+  // --- Writers -------------------------------------------------------------------------------------
+
+  // Holds the writer lock and the state being built. Nothing is visible to readers until commit();
+  // a guard destroyed without it, e.g. by an exception, leaves the published tree as it was.
+  class WriteGuard {
+  public:
+    explicit WriteGuard(SharedBPlusTree& tree) : tree_(tree) {
+      Header* header = tree_.header_;
+      const int error = pthread_mutex_lock(&header->writer);
+      if (error == EOWNERDEAD) {
+        tree_.recover();
+        pthread_mutex_consistent(&header->writer);
+      } else if (error != 0) {
+        errno = error;
+        fail("cannot take writer lock");
+      }
+      generation = header->generation.load() + 1;
+      state = load(header->states[(generation - 1) % 2]);
+    }
+    WriteGuard(const WriteGuard&) = delete;
+    WriteGuard& operator=(const WriteGuard&) = delete;
+    ~WriteGuard() { pthread_mutex_unlock(&tree_.header_->writer); }
+
+    void commit() {
+      store(tree_.header_->states[generation % 2], state);
+      tree_.header_->generation.store(generation);
+    }
+
+    std::uint64_t generation = 0;  // the one being built
+    std::uint64_t oldest_reader = 0;  // cached by allocate()
+    State state;
+
+  private:
+    SharedBPlusTree& tree_;
+  };
+
+  std::vector<PathStep> descend(std::uint64_t root, const Key& key) const {
+    std::vector<PathStep> path;
+    for (NodeIndex index = static_cast<NodeIndex>(root);;) {
+      const Node* node = this->node(index);
+      if (node->leaf) {
+        path.push_back({index, 0});
+        return path;
+      }
+      const std::size_t child = childIndex(node, key);
+      path.push_back({index, child});
+      index = node->children[child];
+    }
+  }
+
+  // Writes count entries as one leaf, or two if they do not fit.
+  Split writeLeaf(WriteGuard& guard, const Key* keys, const Value* values, std::size_t count) {
+    const std::size_t left_count = count <= Order ? count : (count + 1) / 2;
+    Split split;
+    split.left = allocate(guard);
+    Node* left = node(split.left);
+    left->leaf = true;
+    left->count = static_cast<std::uint32_t>(left_count);
+    std::copy(keys, keys + left_count, left->keys);
+    std::copy(values, values + left_count, left->values);
+    if (left_count == count) return split;
+    split.right = allocate(guard);
+    Node* right = node(split.right);
+    right->leaf = true;
+    right->count = static_cast<std::uint32_t>(count - left_count);
+    std::copy(keys + left_count, keys + count, right->keys);
+    std::copy(values + left_count, values + count, right->values);
+    split.separator = keys[left_count];
+    return split;
+  }
+
+  // Writes an internal node with count children (and count - 1 keys), or two if they do not fit.
+  Split writeInternal(WriteGuard& guard, const Key* keys, const NodeIndex* children, std::size_t count) {
+    const std::size_t left_count = count <= Order ? count : (count + 1) / 2;
+    Split split;
+    split.left = allocate(guard);
+    Node* left = node(split.left);
+    left->leaf = false;
+    left->count = static_cast<std::uint32_t>(left_count);
+    std::copy(keys, keys + left_count - 1, left->keys);
+    std::copy(children, children + left_count, left->children);
+    if (left_count == count) return split;
+    split.right = allocate(guard);
+    Node* right = node(split.right);
+    right->leaf = false;
+    right->count = static_cast<std::uint32_t>(count - left_count);
+    std::copy(keys + left_count, keys + count - 1, right->keys);
+    std::copy(children + left_count, children + count, right->children);
+    split.separator = keys[left_count - 1];
+    return split;
+  }
+
+  // Copies the path bottom-up with the child it descended into replaced by `split`, growing a new
+  // root if the old one splits.
+  void replacePath(WriteGuard& guard, std::vector<PathStep>& path, Split split) {
+    while (!path.empty()) {
+      const PathStep step = path.back();
+      path.pop_back();
+      const Node* parent = node(step.node);
+      Key keys[Order + 1];
+      NodeIndex children[Order + 1];
+      std::size_t count = parent->count;
+      std::copy(parent->keys, parent->keys + count - 1, keys);
+      std::copy(parent->children, parent->children + count, children);
+      children[step.child] = split.left;
+      if (split.right != kNone) {
+        std::copy_backward(keys + step.child, keys + count - 1, keys + count);
+        std::copy_backward(children + step.child + 1, children + count, children + count + 1);
+        keys[step.child] = split.separator;
+        children[step.child + 1] = split.right;
+        ++count;
+      }
+      split = writeInternal(guard, keys, children, count);
+      retire(guard, step.node);
+    }
+    if (split.right == kNone) {
+      guard.state.root = split.left;
+      return;
+    }
+    const Key keys[1] = {split.separator};
+    const NodeIndex children[2] = {split.left, split.right};
+    guard.state.root = writeInternal(guard, keys, children, 2).left;
+  }
+
+  // Copies the path bottom-up with the child it descended into replaced by `child`, or removed if
+  // that is kNone. Nodes left without children are removed in turn, and a root with a single
+  // internal child gives way to it.
+  void removeFromPath(WriteGuard& guard, std::vector<PathStep>& path, NodeIndex child) {
+    while (!path.empty()) {
+      const PathStep step = path.back();
+      path.pop_back();
+      const Node* parent = node(step.node);
+      Key keys[Order];
+      NodeIndex children[Order];
+      std::size_t count = parent->count;
+      std::copy(parent->keys, parent->keys + count - 1, keys);
+      std::copy(parent->children, parent->children + count, children);
+      if (child != kNone) {
+        children[step.child] = child;
+      } else {
+        // The separator to the left of the child goes with it, or the one to its right for the first.
+        const std::size_t key = step.child == 0 ? 0 : step.child - 1;
+        if (count > 1) std::copy(keys + key + 1, keys + count - 1, keys + key);
+        std::copy(children + step.child + 1, children + count, children + step.child);
+        --count;
+      }
+      retire(guard, step.node);
+      child = count == 0 ? kNone : writeInternal(guard, keys, children, count).left;
+    }
+    // The root always keeps two children or gives way to its only one (below), so this is only
+    // defensive.
+    if (child == kNone) {
+      child = allocate(guard);
+      node(child)->leaf = true;
+      node(child)->count = 0;
+    }
+    guard.state.root = child;
+    for (;;) {
+      const Node* root = node(static_cast<NodeIndex>(guard.state.root));
+      if (root->leaf || root->count != 1) return;
+      retire(guard, static_cast<NodeIndex>(guard.state.root));
+      guard.state.root = root->children[0];
+    }
+  }
+
+  // --- Slot reuse ----------------------------------------------------------------------------------
+
+  NodeIndex allocate(WriteGuard& guard) {
+    State& state = guard.state;
+    for (bool cleaned = false;;) {
+      if (state.free_count != 0) {
+        const NodeIndex head = static_cast<NodeIndex>(state.free_head);
+        const std::uint64_t retired = node(head)->retired.load(std::memory_order_relaxed);
+        if (retired > guard.oldest_reader) guard.oldest_reader = oldestReader(guard.generation);
+        if (retired <= guard.oldest_reader) {
+          state.free_head = node(head)->next_free.load(std::memory_order_relaxed);
+          if (--state.free_count == 0) state.free_head = state.free_tail = kNone;
+          return head;
+        }
+      }
+      if (state.used < header_->max_nodes) {
+        const NodeIndex index = static_cast<NodeIndex>(state.used++);
+        ::new (node(index)) Node();
+        return index;
+      }
+      if (cleaned) throw std::length_error("SharedBPlusTree segment is full");
+      // Out of slots: readers that died inside a lookup may be what holds the queue up.
+      releaseDeadReaders();
+      guard.oldest_reader = 0;
+      cleaned = true;
+    }
+  }
+
+  // Queues a node replaced by the generation being built. Appending only writes the old tail's
+  // link, which a discarded WriteGuard leaves unused since the published count excludes it.
+  void retire(WriteGuard& guard, NodeIndex index) {
+    State& state = guard.state;
+    node(index)->retired.store(guard.generation, std::memory_order_relaxed);
+    node(index)->next_free.store(kNone, std::memory_order_relaxed);
+    if (state.free_count == 0) {
+      state.free_head = index;
+    } else {
+      node(static_cast<NodeIndex>(state.free_tail))->next_free.store(index, std::memory_order_relaxed);
+    }
+    state.free_tail = index;
+    ++state.free_count;
+  }
+
+  // Slots retired at a generation no later than this are not reachable by any reader.
+  std::uint64_t oldestReader(std::uint64_t building) const {
+    std::uint64_t oldest = building - 1;
+    for (const ReaderSlot& slot : header_->readers) {
+      const std::uint64_t generation = slot.generation.load();
+      if (generation != 0) oldest = std::min(oldest, generation);
+    }
+    return oldest;
+  }
+
+  // Frees the slots of readers that died holding them. Writers and readers may both run this, so a
+  // slot is first taken over for the calling process: only the one whose exchange succeeds clears
+  // it, and no other reader can have claimed it in between.
+  void releaseDeadReaders() const {
+    const pid_t self = ::getpid();
+    for (ReaderSlot& slot : header_->readers) {
+      pid_t pid = slot.pid.load();
+      if (pid == 0 || pid == self || ::kill(pid, 0) == 0 || errno != ESRCH) continue;
+      if (!slot.pid.compare_exchange_strong(pid, self)) continue;
+      slot.generation.store(0);
+      slot.pid.store(0);
+    }
+  }
+
+  // Called by a writer that found the previous one dead. The published tree is intact, but the
+  // reuse queue may not be: the dead writer may have overwritten slots it had taken from it. Every
+  // slot not reachable from the root is queued again, retired at the current generation so that
+  // readers of older ones keep theirs.
+  void recover() {
+    const std::uint64_t generation = header_->generation.load();
+    State state = load(header_->states[generation % 2]);
+    std::vector<bool> reachable(state.used, false);
+    std::vector<NodeIndex> pending{static_cast<NodeIndex>(state.root)};
+    while (!pending.empty()) {
+      const NodeIndex index = pending.back();
+      pending.pop_back();
+      reachable[index] = true;
+      const Node* node = this->node(index);
+      if (!node->leaf) pending.insert(pending.end(), node->children, node->children + node->count);
+    }
+    state.free_head = state.free_tail = kNone;
+    state.free_count = 0;
+    for (NodeIndex index = 0; index < state.used; ++index) {
+      if (reachable[index]) continue;
+      Node* node = this->node(index);
+      node->retired.store(generation, std::memory_order_relaxed);
+      node->next_free.store(kNone, std::memory_order_relaxed);
+      if (state.free_count == 0) {
+        state.free_head = index;
+      } else {
+        this->node(static_cast<NodeIndex>(state.free_tail))->next_free.store(index, std::memory_order_relaxed);
+      }
+      state.free_tail = index;
+      ++state.free_count;
+    }
+    store(header_->states[(generation + 1) % 2], state);
+    header_->generation.store(generation + 1);
+  }
+
+  char* base_ = nullptr;
+  std::size_t mapping_bytes_ = 0;
+  Header* header_ = nullptr;
+};
@@ -1,14 +1,25 @@
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
 #include <optional>
 #include <random>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 #include <vector>
 
+#include <sys/wait.h>
+
 #include "main.cpp"
+#include "replication.hpp"
+#include "server.hpp"
+#include "shared_tree.hpp"
 
 namespace test {
 namespace {
@@ -315,6 +326,1932 @@ void testHashTableTenThousandEntries() {
     }
 }
 
+struct TrackedValue {
+    static inline int copies = 0;
+    static inline int constructions = 0;
+
+    TrackedValue() = default;
+    explicit TrackedValue(std::string text) : payload(std::move(text)) { ++constructions; }
+    TrackedValue(const TrackedValue& other) : payload(other.payload) { ++copies; }
+    TrackedValue(TrackedValue&&) noexcept = default;
+    TrackedValue& operator=(const TrackedValue& other) {
+        payload = other.payload;
+        ++copies;
+        return *this;
+    }
+    TrackedValue& operator=(TrackedValue&&) noexcept = default;
+
+    std::string payload;
+};
+
+void testMoveAwareInsertion() {
+    test::TestScope scope("move_aware_insertion");
+    constexpr int kCount = 5'000;
+    BPlusTree<int, TrackedValue, 4> tree;
+    TrackedValue::copies = 0;
+
+    // Order 4 splits constantly, so every restructuring path has to move values around.
+    for (int key = 0; key < kCount; ++key) {
+        tree.insert(key * 7 % kCount, TrackedValue(std::string(64, 'x') + std::to_string(key)));
+    }
+    for (int key = kCount; key < kCount * 2; ++key) {
+        CHECK_TRUE(tree.try_emplace(key, std::string("emplaced")));
+    }
+    CHECK_EQ(TrackedValue::copies, 0);
+
+    TrackedValue::constructions = 0;
+    CHECK_FALSE(tree.try_emplace(3, std::string("ignored")));
+    CHECK_EQ(TrackedValue::constructions, 0);
+    CHECK_EQ(tree.find(kCount + 1)->payload, std::string("emplaced"));
+
+    CHECK_FALSE(tree.emplace(3, TrackedValue(std::string("ignored"))));
+    CHECK_TRUE(tree.emplace(-1, TrackedValue(std::string("minus one"))));
+    CHECK_EQ(tree.find(-1)->payload, std::string("minus one"));
+
+    CHECK_FALSE(tree.insert_or_assign(3, TrackedValue(std::string("assigned"))));
+    CHECK_TRUE(tree.insert_or_assign(-2, TrackedValue(std::string("minus two"))));
+    CHECK_EQ(tree.find(3)->payload, std::string("assigned"));
+    CHECK_EQ(tree.find(-2)->payload, std::string("minus two"));
+
+    BPlusTree<std::string, std::string, 5> strings;
+    std::string key = "moved-key";
+    std::string value(4096, 'v');
+    strings.insert(std::move(key), std::move(value));
+    CHECK_EQ(strings.find("moved-key")->size(), std::size_t{4096});
+}
+
+void testTriviallyCopyableNodes() {
+    test::TestScope scope("trivially_copyable_nodes");
+    static_assert(std::is_same_v<detail::NodeArray<std::int64_t, 8>, detail::FixedArray<std::int64_t, 8>>);
+    static_assert(std::is_same_v<detail::NodeArray<std::string, 8>, std::vector<std::string>>);
+
+    detail::FixedArray<int, 6> array;
+    for (int value : {5, 1, 3}) {
+        array.insert(std::lower_bound(array.begin(), array.end(), value), value);
+    }
+    array.emplace(array.begin(), array[2]);  // the argument aliases an element that gets shifted
+    CHECK_EQ(std::vector<int>(array.begin(), array.end()), (std::vector<int>{5, 1, 3, 5}));
+
+    // Large orders exercise the memmove shift in full leaves and the memcpy split.
+    constexpr int kCount = 60'000;
+    BPlusTree<std::int64_t, std::int64_t, 256> tree;
+    std::unordered_map<std::int64_t, std::int64_t> reference;
+    std::mt19937_64 rng(0xA11CEu);
+    for (int i = 0; i < kCount; ++i) {
+        const auto key = static_cast<std::int64_t>(rng() % 200'000);
+        const auto value = static_cast<std::int64_t>(rng());
+        tree.insert(key, value);
+        reference[key] = value;
+    }
+    for (const auto& [key, expected] : reference) {
+        auto actual = tree.find(key);
+        CHECK_TRUE(actual.has_value());
+        CHECK_EQ(*actual, expected);
+    }
+    CHECK_FALSE(tree.find(-1).has_value());
+}
+
+void testGappedLeafLayout() {
+    test::TestScope scope("gapped_leaf_layout");
+    BPlusTreeOptions options;
+    options.leaf_layout = LeafLayout::Gapped;
+
+    BPlusTree<int, std::string, 4> small(options);
+    for (int key : {5, 1, 9, 3, 7, 2, 8, 4, 6, 0}) {
+        small.insert(key, std::to_string(key));
+    }
+    small.insert(3, "three");
+    for (int key = 0; key < 10; ++key) {
+        CHECK_EQ(*small.find(key), key == 3 ? std::string("three") : std::to_string(key));
+    }
+    CHECK_FALSE(small.find(10).has_value());
+
+    // Ascending, descending and random streams hit the append, prepend and shift-to-gap paths.
+    BPlusTree<std::int64_t, std::int64_t, 128> ascending(options);
+    BPlusTree<std::int64_t, std::int64_t, 128> descending(options);
+    for (std::int64_t key = 0; key < 20'000; ++key) {
+        ascending.insert(key, key * 2);
+        descending.insert(-key, key * 2);
+    }
+    for (std::int64_t key = 0; key < 20'000; ++key) {
+        CHECK_EQ(*ascending.find(key), key * 2);
+        CHECK_EQ(*descending.find(-key), key * 2);
+    }
+
+    BPlusTree<std::int64_t, std::int64_t, 130> random(options);
+    std::unordered_map<std::int64_t, std::int64_t> reference;
+    std::mt19937_64 rng(0x9A95u);
+    for (int i = 0; i < 50'000; ++i) {
+        const auto key = static_cast<std::int64_t>(rng() % 80'000);
+        const auto value = static_cast<std::int64_t>(rng());
+        CHECK_EQ(random.insert_or_assign(key, value), reference.find(key) == reference.end());
+        reference[key] = value;
+    }
+    for (const auto& [key, expected] : reference) {
+        auto actual = random.find(key);
+        CHECK_TRUE(actual.has_value());
+        CHECK_EQ(*actual, expected);
+    }
+    for (std::int64_t key = 80'000; key < 80'100; ++key) {
+        CHECK_FALSE(random.find(key).has_value());
+    }
+}
+
+void testAppendLeafLayout() {
+    test::TestScope scope("append_leaf_layout");
+    BPlusTreeOptions options;
+    options.leaf_layout = LeafLayout::Append;
+
+    // A limit larger than the leaf means only splits sort; the default limit sorts along the way.
+    for (std::size_t tail_limit : {std::size_t{0}, std::size_t{1'000}}) {
+        options.append_tail_limit = tail_limit;
+        BPlusTree<std::int64_t, std::int64_t, 64> tree(options);
+        std::unordered_map<std::int64_t, std::int64_t> reference;
+        std::mt19937_64 rng(0xA99E4Du);
+        for (int i = 0; i < 40'000; ++i) {
+            const auto key = static_cast<std::int64_t>(rng() % 60'000) - 30'000;
+            const auto value = static_cast<std::int64_t>(rng());
+            CHECK_EQ(tree.try_emplace(key, value), reference.find(key) == reference.end());
+            tree.insert(key, value);
+            reference[key] = value;
+            if (i % 97 == 0) {
+                CHECK_EQ(*tree.find(key), value);
+            }
+        }
+        for (const auto& [key, expected] : reference) {
+            auto actual = tree.find(key);
+            CHECK_TRUE(actual.has_value());
+            CHECK_EQ(*actual, expected);
+        }
+        CHECK_FALSE(tree.find(30'000).has_value());
+    }
+
+    // Keys without std::hash still work; they just all share one fingerprint.
+    struct Point {
+        int x;
+        int y;
+        bool operator<(const Point& other) const { return x != other.x ? x < other.x : y < other.y; }
+        bool operator==(const Point& other) const { return x == other.x && y == other.y; }
+    };
+    static_assert(!detail::IsHashable<Point>::value);
+    BPlusTree<Point, int, 8> points(options);
+    for (int i = 0; i < 500; ++i) {
+        points.insert(Point{i % 23, i}, i);
+    }
+    for (int i = 0; i < 500; ++i) {
+        CHECK_EQ(*points.find(Point{i % 23, i}), i);
+    }
+    CHECK_FALSE(points.find(Point{0, 1}).has_value());
+}
+
+void testRedistributeOnOverflow() {
+    test::TestScope scope("redistribute_on_overflow");
+    constexpr int kCount = 50'000;
+    std::vector<int> keys(kCount);
+    std::iota(keys.begin(), keys.end(), 0);
+    std::shuffle(keys.begin(), keys.end(), std::mt19937(0xB57A8u));
+
+    BPlusTreeOptions options;
+    BPlusTree<int, int, 16> split_tree(options);
+    options.overflow_policy = OverflowPolicy::Redistribute;
+    BPlusTree<int, int, 16> redistribute_tree(options);
+    options.leaf_layout = LeafLayout::Gapped;
+    BPlusTree<int, int, 16> gapped_tree(options);
+    options.leaf_layout = LeafLayout::Append;
+    BPlusTree<int, int, 16> append_tree(options);
+
+    for (int key : keys) {
+        split_tree.insert(key, -key);
+        redistribute_tree.insert(key, -key);
+        gapped_tree.insert(key, -key);
+        append_tree.insert(key, -key);
+    }
+    for (int key = 0; key < kCount; ++key) {
+        CHECK_EQ(*redistribute_tree.find(key), -key);
+        CHECK_EQ(*gapped_tree.find(key), -key);
+        CHECK_EQ(*append_tree.find(key), -key);
+    }
+    CHECK_FALSE(redistribute_tree.find(kCount).has_value());
+    CHECK_EQ(redistribute_tree.size(), static_cast<std::size_t>(kCount));
+
+    const BPlusTreeStats split_stats = split_tree.stats();
+    const BPlusTreeStats redistribute_stats = redistribute_tree.stats();
+    CHECK_EQ(redistribute_stats.entries, static_cast<std::size_t>(kCount));
+    CHECK_TRUE(split_stats.leaf_fill < 0.75);
+    CHECK_TRUE(redistribute_stats.leaf_fill > 0.8);
+    CHECK_TRUE(redistribute_stats.leaves < split_stats.leaves);
+    CHECK_TRUE(gapped_tree.stats().leaf_fill > 0.8);
+    CHECK_TRUE(append_tree.stats().leaf_fill > 0.8);
+}
+
+template <LeafLayout Layout>
+void checkEraseAndCompact() {
+    BPlusTreeOptions options;
+    options.leaf_layout = Layout;
+    BPlusTree<int, std::string, 16> tree(options);
+    std::unordered_map<int, std::string> reference;
+    std::mt19937 rng(0xC0A1E5Cu);
+    for (int key = 0; key < 20'000; ++key) {
+        tree.insert(key, std::string(40, static_cast<char>('a' + key % 26)));
+        reference.emplace(key, std::string(40, static_cast<char>('a' + key % 26)));
+    }
+    const BPlusTreeStats full = tree.stats();
+
+    // Erase ~90% of the keys, including whole runs so that some leaves empty out entirely.
+    for (int key = 0; key < 20'000; ++key) {
+        if (key % 10 != 0 || (key > 5'000 && key < 6'000)) {
+            CHECK_TRUE(tree.erase(key));
+            reference.erase(key);
+        }
+    }
+    CHECK_FALSE(tree.erase(1));
+    CHECK_FALSE(tree.erase(-1));
+    CHECK_EQ(tree.size(), reference.size());
+
+    const BPlusTreeStats churned = tree.stats();
+    int slices = 1;
+    while (!tree.compact(8)) {
+        ++slices;
+        // The tree stays fully usable between slices.
+        const int key = static_cast<int>(rng() % 20'000);
+        tree.insert(key, "between slices");
+        reference[key] = "between slices";
+    }
+    CHECK_TRUE(slices > 1);
+    const BPlusTreeStats compacted = tree.stats();
+    CHECK_TRUE(compacted.leaves * 3 < churned.leaves);
+    CHECK_TRUE(compacted.node_bytes * 3 < churned.node_bytes);
+    CHECK_TRUE(compacted.node_bytes < full.node_bytes);
+    CHECK_TRUE(compacted.height <= churned.height);
+
+    for (const auto& [key, expected] : reference) {
+        auto actual = tree.find(key);
+        CHECK_TRUE(actual.has_value());
+        CHECK_EQ(*actual, expected);
+    }
+    for (int key = 0; key < 20'000; key += 7) {
+        CHECK_EQ(tree.find(key).has_value(), reference.count(key) == 1);
+    }
+
+    // Draining the tree entirely collapses it back to an empty root leaf.
+    for (const auto& entry : reference) {
+        CHECK_TRUE(tree.erase(entry.first));
+    }
+    CHECK_TRUE(tree.empty());
+    CHECK_EQ(tree.stats().height, std::size_t{1});
+    CHECK_TRUE(tree.compact(1));
+    tree.insert(3, "three");
+    CHECK_EQ(*tree.find(3), std::string("three"));
+}
+
+void testEraseAndCompact() {
+    test::TestScope scope("erase_and_compact");
+    checkEraseAndCompact<LeafLayout::Sorted>();
+    checkEraseAndCompact<LeafLayout::Gapped>();
+    checkEraseAndCompact<LeafLayout::Append>();
+
+    // Random churn on trivially copyable entries, erasing from gapped slots and append tails.
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        BPlusTree<int, int, 8> tree(options);
+        std::unordered_map<int, int> reference;
+        std::mt19937 rng(0xE7A5Eu);
+        for (int op = 0; op < 60'000; ++op) {
+            const int key = static_cast<int>(rng() % 3'000);
+            if (rng() % 3 == 0) {
+                CHECK_EQ(tree.erase(key), reference.erase(key) == 1);
+            } else {
+                tree.insert(key, op);
+                reference[key] = op;
+            }
+            if (op % 5'000 == 0) tree.compact(16);
+        }
+        CHECK_EQ(tree.size(), reference.size());
+        for (int key = 0; key < 3'000; ++key) {
+            auto actual = tree.find(key);
+            auto expected = reference.find(key);
+            CHECK_EQ(actual.has_value(), expected != reference.end());
+            if (actual && expected != reference.end()) CHECK_EQ(*actual, expected->second);
+        }
+    }
+}
+
+void testMemoryBudget() {
+    test::TestScope scope("memory_budget");
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        options.memory_budget = 64 * 1024;
+        BPlusTree<int, std::string, 16> tree(options);
+        std::unordered_map<int, std::string> reference;
+        std::mt19937 rng(0xB0D6E7u);
+        for (int op = 0; op < 30'000; ++op) {
+            const int key = static_cast<int>(rng() % 8'000);
+            const int action = static_cast<int>(rng() % 8);
+            if (action == 0) {
+                CHECK_EQ(tree.erase(key), reference.erase(key) == 1);
+            } else if (action == 1) {
+                auto actual = tree.find(key);
+                CHECK_EQ(actual.has_value(), reference.count(key) == 1);
+            } else {
+                std::string value(static_cast<std::size_t>(8 + op % 50), static_cast<char>('a' + op % 26));
+                tree.insert_or_assign(key, value);
+                reference[key] = value;
+            }
+            if (op % 3'000 == 0) tree.compact(32);
+            // A single root-to-leaf operation may overshoot by at most one leaf.
+            CHECK_TRUE(tree.stats().resident_bytes <= options.memory_budget + 16 * 128);
+        }
+        const BPlusTreeStats stats = tree.stats();
+        CHECK_TRUE(stats.evicted_leaves > 0);
+        CHECK_EQ(tree.size(), reference.size());
+        for (const auto& [key, expected] : reference) {
+            auto actual = tree.find(key);
+            CHECK_TRUE(actual.has_value());
+            if (actual) CHECK_EQ(*actual, expected);
+        }
+        // Scans read evicted leaves straight from the spill file.
+        std::size_t scanned = 0;
+        int previous = -1;
+        tree.scan(0, 8'000, [&](int key, const std::string& value) {
+            CHECK_TRUE(key > previous);
+            CHECK_EQ(value, reference[key]);
+            previous = key;
+            ++scanned;
+        });
+        CHECK_EQ(scanned, reference.size());
+        CHECK_TRUE(tree.stats().evicted_leaves > 0);
+        while (!tree.compact(64)) {}
+        for (const auto& entry : reference) {
+            CHECK_TRUE(tree.erase(entry.first));
+        }
+        CHECK_TRUE(tree.empty());
+        CHECK_EQ(tree.stats().resident_bytes, std::size_t{0});
+    }
+
+    // The key copies in the gaps of gapped leaves are charged too, and released with them.
+    {
+        std::size_t charged[2] = {};
+        for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped}) {
+            BPlusTreeOptions options;
+            options.leaf_layout = layout;
+            options.memory_budget = std::size_t{64} << 20;
+            BPlusTree<std::string, int, 16> tree(options);
+            for (int key = 0; key < 2'000; ++key) tree.insert(std::string(40, 'k') + std::to_string(key * 7 % 2'000), key);
+            charged[layout == LeafLayout::Gapped] = tree.stats().resident_bytes;
+            for (int key = 0; key < 2'000; key += 2) tree.erase(std::string(40, 'k') + std::to_string(key));
+            while (!tree.compact(64)) {}
+            for (int key = 1; key < 2'000; key += 2) tree.erase(std::string(40, 'k') + std::to_string(key));
+            CHECK_EQ(tree.stats().resident_bytes, std::size_t{0});
+        }
+        CHECK_TRUE(charged[1] > charged[0]);
+    }
+
+    // Only types with a spill encoding can be given a budget.
+    BPlusTreeOptions options;
+    options.memory_budget = 1024;
+    bool threw = false;
+    try {
+        BPlusTree<int, std::vector<int>, 8> tree(options);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    CHECK_TRUE(threw);
+}
+
+void testHugePageArena() {
+    test::TestScope scope("huge_page_arena");
+    for (bool huge_pages : {false, true}) {
+        BPlusTreeOptions options;
+        options.huge_pages = huge_pages;
+        BPlusTree<std::int64_t, std::int64_t, 32> tree(options);
+        std::mt19937_64 rng(0x2A11Cu);
+        std::vector<std::int64_t> keys(50'000);
+        for (auto& key : keys) {
+            key = static_cast<std::int64_t>(rng() >> 1);
+            tree.insert(key, key / 3);
+        }
+        const BPlusTreeStats stats = tree.stats();
+        CHECK_TRUE(stats.arena_bytes >= stats.node_bytes);
+        // Either every chunk was advised or the arena fell back to regular pages.
+        if (huge_pages) {
+            CHECK_TRUE(stats.huge_page_bytes == 0 || stats.huge_page_bytes == stats.arena_bytes);
+        } else {
+            CHECK_EQ(stats.huge_page_bytes, std::size_t{0});
+        }
+        for (std::size_t i = 0; i < keys.size(); i += 2) tree.erase(keys[i]);
+        while (!tree.compact(64)) {}
+
+        // Moving hands the arena over without touching the nodes.
+        BPlusTree<std::int64_t, std::int64_t, 32> moved(std::move(tree));
+        for (std::size_t i = 0; i < keys.size(); ++i) {
+            auto value = moved.find(keys[i]);
+            CHECK_EQ(value.has_value(), i % 2 == 1);
+            if (value) CHECK_EQ(*value, keys[i] / 3);
+        }
+        tree = std::move(moved);
+        CHECK_EQ(tree.size(), keys.size() / 2);
+    }
+}
+
+void testCompressedNodeReferences() {
+    test::TestScope scope("compressed_node_references");
+    static_assert(sizeof(detail::NodeId) == 4);
+
+    // Freed node slots are reused, so churn does not grow the arena.
+    BPlusTree<int, int, 8> tree;
+    std::size_t arena_after_first_round = 0;
+    for (int round = 0; round < 4; ++round) {
+        for (int key = 0; key < 20'000; ++key) tree.insert(key * 7 % 20'000, key);
+        CHECK_EQ(tree.size(), std::size_t{20'000});
+        for (int key = 0; key < 20'000; key += 3) CHECK_EQ(*tree.find(key), (key * 17'143) % 20'000);
+        if (round == 0) arena_after_first_round = tree.stats().arena_bytes;
+        CHECK_EQ(tree.stats().arena_bytes, arena_after_first_round);
+        for (int key = 0; key < 20'000; ++key) CHECK_TRUE(tree.erase(key));
+        CHECK_TRUE(tree.empty());
+        CHECK_EQ(tree.stats().height, std::size_t{1});
+    }
+}
+
+void testConcurrentScan() {
+    test::TestScope scope("concurrent_scan");
+    // Sequential scans: bounds, early stop, and every layout.
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        BPlusTree<int, int, 8> tree(options);
+        for (int key = 0; key < 2'000; ++key) tree.insert(key * 7 % 2'000, key);
+        std::vector<int> seen;
+        tree.scan(100, 1'500, [&](int key, int) { seen.push_back(key); });
+        CHECK_EQ(seen.size(), std::size_t{1'400});
+        CHECK_TRUE(std::is_sorted(seen.begin(), seen.end()));
+        CHECK_EQ(seen.front(), 100);
+        CHECK_EQ(seen.back(), 1'499);
+        int visited = 0;
+        tree.scan(0, 2'000, [&](int, int) { return ++visited < 10; });
+        CHECK_EQ(visited, 10);
+    }
+
+    // Scans running next to a writer see every stable key exactly once, in order.
+    BPlusTreeOptions options;
+    options.overflow_policy = OverflowPolicy::Redistribute;
+    BPlusTree<int, int, 16> tree(options);
+    constexpr int kKeys = 40'000;
+    for (int key = 0; key < kKeys; key += 2) tree.insert(key, key);
+    std::atomic<bool> writing{true};
+    std::thread writer([&] {
+        std::mt19937 rng(0x5CA4u);
+        for (int op = 0; op < 200'000; ++op) {
+            const int key = static_cast<int>(rng() % kKeys) | 1;  // odd keys come and go
+            if (rng() % 3 == 0) {
+                tree.erase(key);
+            } else {
+                tree.insert(key, -key);
+            }
+            if (op % 20'000 == 0) tree.compact(64);
+        }
+        writing = false;
+    });
+    std::vector<std::thread> readers;
+    std::atomic<int> failures{0};
+    std::atomic<int> scans{0};
+    for (int r = 0; r < 2; ++r) {
+        readers.emplace_back([&, r] {
+            do {
+                int previous = -1;
+                int stable = 0;
+                bool ok = true;
+                tree.scan(r * 1'000, kKeys, [&](int key, int value) {
+                    ok = ok && key > previous && value == (key % 2 == 0 ? key : -key);
+                    previous = key;
+                    stable += key % 2 == 0;
+                });
+                if (!ok || stable != (kKeys - r * 1'000) / 2) ++failures;
+                ++scans;
+            } while (writing);
+        });
+    }
+    writer.join();
+    for (auto& reader : readers) reader.join();
+    CHECK_EQ(failures.load(), 0);
+    CHECK_TRUE(scans.load() >= 2);
+}
+
+void testParallelScan() {
+    test::TestScope scope("parallel_scan");
+    BPlusTree<std::int64_t, std::int64_t, 16> tree;
+    constexpr std::int64_t kKeys = 100'000;
+    for (std::int64_t key = 0; key < kKeys; ++key) tree.insert(key * 7'919 % kKeys, key);
+
+    for (unsigned threads : {1u, 3u, 8u}) {
+        std::atomic<std::int64_t> count{0};
+        std::atomic<std::int64_t> key_sum{0};
+        tree.parallel_scan(1'000, 90'000, [&](std::int64_t key, std::int64_t) {
+            ++count;
+            key_sum += key;
+        }, threads);
+        CHECK_EQ(count.load(), std::int64_t{89'000});
+        CHECK_EQ(key_sum.load(), (1'000 + 89'999) * std::int64_t{89'000} / 2);
+
+        // Chunks are combined in key order, so a non-commutative fold sees the keys sorted.
+        auto keys = tree.parallel_reduce(
+            std::int64_t{0}, kKeys, std::vector<std::int64_t>{},
+            [](std::vector<std::int64_t> acc, std::int64_t key, std::int64_t) {
+                acc.push_back(key);
+                return acc;
+            },
+            [](std::vector<std::int64_t> left, std::vector<std::int64_t> right) {
+                left.insert(left.end(), right.begin(), right.end());
+                return left;
+            },
+            threads);
+        std::vector<std::int64_t> expected(kKeys);
+        std::iota(expected.begin(), expected.end(), 0);
+        CHECK_TRUE(keys == expected);
+
+        const auto empty = tree.parallel_reduce(
+            std::int64_t{5}, std::int64_t{5}, std::int64_t{0}, [](std::int64_t acc, std::int64_t, std::int64_t) { return acc + 1; },
+            std::plus<std::int64_t>(), threads);
+        CHECK_EQ(empty, std::int64_t{0});
+    }
+
+    // Returning false stops every worker; exceptions reach the caller.
+    std::atomic<int> visited{0};
+    tree.parallel_scan(0, kKeys, [&](std::int64_t, std::int64_t) { return ++visited < 100; }, 4);
+    CHECK_TRUE(visited.load() < 1'000);
+    bool threw = false;
+    try {
+        tree.parallel_scan(0, kKeys, [](std::int64_t key, std::int64_t) {
+            if (key == 54'321) throw std::runtime_error("visitor failed");
+        }, 4);
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK_TRUE(threw);
+}
+
+void testFindBatch() {
+    test::TestScope scope("find_batch");
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        BPlusTree<std::int64_t, std::int64_t, 8> tree(options);
+        for (std::int64_t key = 0; key < 20'000; key += 2) tree.insert(key * 17'143 % 20'000, key);
+
+        // Unsorted probes with misses, duplicates and keys outside the tree.
+        std::mt19937 rng(0xBA7C4u);
+        std::vector<std::int64_t> probes;
+        for (int i = 0; i < 5'000; ++i) probes.push_back(static_cast<std::int64_t>(rng() % 22'000) - 1'000);
+        probes.push_back(probes.front());
+        std::vector<std::optional<std::int64_t>> expected;
+        for (std::int64_t key : probes) expected.push_back(tree.find(key));
+        CHECK_TRUE(tree.find_batch(probes) == expected);
+        for (unsigned threads : {1u, 3u, 8u}) CHECK_TRUE(tree.find_batch_parallel(probes, threads) == expected);
+        CHECK_TRUE(tree.find_batch({}).empty());
+        CHECK_TRUE(tree.find_batch_parallel({}).empty());
+        CHECK_TRUE(tree.find_batch_parallel({4}) == std::vector<std::optional<std::int64_t>>{tree.find(4)});
+    }
+
+    // Batches honour the memory budget like single lookups; the parallel one runs as find_batch().
+    BPlusTreeOptions options;
+    options.memory_budget = 16 * 1024;
+    BPlusTree<int, std::string, 16> tree(options);
+    std::vector<int> probes;
+    for (int key = 0; key < 4'000; ++key) {
+        tree.insert(key, std::string(24, static_cast<char>('a' + key % 26)));
+        probes.push_back(3'999 - key);
+    }
+    CHECK_TRUE(tree.stats().evicted_leaves > 0);
+    const auto values = tree.find_batch_parallel(probes, 4);
+    bool all_found = true;
+    for (std::size_t i = 0; i < probes.size(); ++i) {
+        all_found = all_found && values[i] && *values[i] == std::string(24, static_cast<char>('a' + probes[i] % 26));
+    }
+    CHECK_TRUE(all_found);
+    CHECK_TRUE(tree.stats().resident_bytes <= options.memory_budget + 16 * 64);
+}
+
+template <typename Tree>
+std::vector<std::int64_t> scannedKeys(const Tree& tree) {
+    std::vector<std::int64_t> keys;
+    tree.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+              [&](std::int64_t key, std::int64_t) { keys.push_back(key); });
+    return keys;
+}
+
+void testSplitAndJoin() {
+    test::TestScope scope("split_at_join");
+    constexpr std::int64_t kKeys = 20'000;
+    std::vector<std::int64_t> all(kKeys);
+    std::iota(all.begin(), all.end(), 0);
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        for (std::int64_t cut : {std::int64_t{-5}, std::int64_t{0}, std::int64_t{37}, std::int64_t{9'999}, kKeys - 40, kKeys, kKeys + 7}) {
+            BPlusTree<std::int64_t, std::int64_t, 8> tree(options);
+            for (std::int64_t i = 0; i < kKeys; ++i) tree.insert(i * 17'143 % kKeys, i);
+            BPlusTree<std::int64_t, std::int64_t, 8> right = tree.split_at(cut);
+            const std::int64_t boundary = std::clamp<std::int64_t>(cut, 0, kKeys);
+            CHECK_EQ(tree.size(), static_cast<std::size_t>(boundary));
+            CHECK_EQ(right.size(), static_cast<std::size_t>(kKeys - boundary));
+            CHECK_TRUE(scannedKeys(tree) == std::vector<std::int64_t>(all.begin(), all.begin() + boundary));
+            CHECK_TRUE(scannedKeys(right) == std::vector<std::int64_t>(all.begin() + boundary, all.end()));
+
+            // Both halves stay fully usable, including the cut spines.
+            for (std::int64_t key = boundary - 30; key < boundary + 30; ++key) {
+                if (key < 0 || key >= kKeys) continue;
+                auto& owner = key < boundary ? tree : right;
+                CHECK_TRUE(owner.find(key).has_value());
+                CHECK_TRUE(owner.erase(key));
+                owner.insert(key, -key);
+            }
+            tree.join(right);
+            CHECK_TRUE(right.empty());
+            CHECK_EQ(tree.size(), static_cast<std::size_t>(kKeys));
+            CHECK_TRUE(scannedKeys(tree) == all);
+            right.insert(kKeys, 1);
+            CHECK_EQ(right.size(), std::size_t{1});
+            while (!tree.compact(256)) {}
+            CHECK_TRUE(scannedKeys(tree) == all);
+        }
+    }
+
+    // Many pieces joined back in order; the shorter tree goes on either side of the taller one.
+    BPlusTree<std::int64_t, std::int64_t, 4> whole;
+    for (std::int64_t key = 0; key < kKeys; ++key) whole.insert(key, key);
+    std::vector<BPlusTree<std::int64_t, std::int64_t, 4>> pieces;
+    for (std::int64_t cut : {15'000, 14'990, 12'000, 100, 3}) pieces.push_back(whole.split_at(cut));
+    pieces.push_back(std::move(whole));
+    BPlusTree<std::int64_t, std::int64_t, 4> joined = std::move(pieces.back());
+    pieces.pop_back();
+    while (!pieces.empty()) {
+        joined.join(pieces.back());
+        pieces.pop_back();
+    }
+    CHECK_TRUE(scannedKeys(joined) == all);
+    for (std::int64_t key = 0; key < kKeys; key += 97) CHECK_EQ(*joined.find(key), key);
+
+    // Overlapping ranges are rejected; trees with their own arenas are joined by moving entries.
+    BPlusTree<std::int64_t, std::int64_t, 4> other;
+    other.insert(kKeys - 1, 0);
+    bool threw = false;
+    try {
+        joined.join(other);
+    } catch (const std::invalid_argument&) {
+        threw = true;
+    }
+    CHECK_TRUE(threw);
+    CHECK_EQ(other.size(), std::size_t{1});
+    other.erase(kKeys - 1);
+    for (std::int64_t key = kKeys; key < kKeys + 500; ++key) other.insert(key, key);
+    joined.join(other);
+    CHECK_TRUE(other.empty());
+    CHECK_EQ(joined.size(), static_cast<std::size_t>(kKeys + 500));
+    CHECK_EQ(*joined.find(kKeys + 499), kKeys + 499);
+
+    // Split trees share the arena but not the latch: both halves can be written concurrently.
+    BPlusTree<std::int64_t, std::int64_t, 8> left;
+    BPlusTree<std::int64_t, std::int64_t, 8> right = left.split_at(0);
+    std::thread writer([&] {
+        for (std::int64_t key = 0; key < kKeys; ++key) right.insert(key, key);
+    });
+    for (std::int64_t key = -kKeys; key < 0; ++key) left.insert(key, key);
+    writer.join();
+    left.join(right);
+    CHECK_EQ(left.size(), static_cast<std::size_t>(2 * kKeys));
+
+    // The halves count their entries when first asked, also after writes in between.
+    BPlusTree<std::int64_t, std::int64_t, 8> upper = left.split_at(100);
+    for (std::int64_t key = 0; key < 50; ++key) CHECK_TRUE(left.erase(key));
+    for (std::int64_t key = 2 * kKeys; key < 2 * kKeys + 70; ++key) upper.insert(key, key);
+    CHECK_EQ(left.stats().entries, static_cast<std::size_t>(kKeys + 50));
+    CHECK_EQ(upper.size(), static_cast<std::size_t>(kKeys - 100 + 70));
+
+    // With a memory budget the moved leaves, evicted ones included, keep their entries and charges.
+    BPlusTreeOptions budgeted;
+    budgeted.memory_budget = 16 * 1024;
+    BPlusTree<int, std::string, 16> cold(budgeted);
+    for (int key = 0; key < 4'000; ++key) cold.insert(key, std::string(24, static_cast<char>('a' + key % 26)));
+    const std::size_t resident = cold.stats().resident_bytes;
+    BPlusTree<int, std::string, 16> warm = cold.split_at(1'234);
+    CHECK_TRUE(cold.stats().resident_bytes + warm.stats().resident_bytes <= resident + 16 * 64);
+    CHECK_EQ(cold.size() + warm.size(), std::size_t{4'000});
+    CHECK_EQ(*warm.find(3'999), std::string(24, static_cast<char>('a' + 3'999 % 26)));
+    CHECK_FALSE(cold.find(1'234).has_value());
+    cold.join(warm);
+    bool all_found = true;
+    for (int key = 0; key < 4'000; ++key) all_found = all_found && cold.find(key) == std::string(24, static_cast<char>('a' + key % 26));
+    CHECK_TRUE(all_found);
+    CHECK_TRUE(cold.stats().resident_bytes <= budgeted.memory_budget + 16 * 64);
+
+    // Node slots freed by a discarded split-off tree go back to the shared arena and are reused.
+    BPlusTree<std::int64_t, std::int64_t, 8> source;
+    std::size_t arena_bytes = 0;
+    for (int round = 0; round < 5; ++round) {
+        for (std::int64_t key = 0; key < 100'000; ++key) source.insert(key, key);
+        CHECK_EQ(source.split_at(0).size(), std::size_t{100'000});
+        CHECK_TRUE(source.empty());
+        if (round == 1) arena_bytes = source.stats().arena_bytes;
+    }
+    CHECK_EQ(source.stats().arena_bytes, arena_bytes);
+}
+
+void testMergeFrom() {
+    test::TestScope scope("merge_from");
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        for (ConflictPolicy policy : {ConflictPolicy::KeepExisting, ConflictPolicy::Overwrite}) {
+            BPlusTreeOptions options;
+            options.leaf_layout = layout;
+            BPlusTree<std::int64_t, std::int64_t, 8> base(options);
+            BPlusTree<std::int64_t, std::int64_t, 8> delta(options);
+            std::map<std::int64_t, std::int64_t> reference;
+            for (std::int64_t key = 0; key < 40'000; key += 2) {
+                base.insert(key, key);
+                reference[key] = key;
+            }
+            // Sparse updates, a dense run that forces repeated splits, and keys past both ends.
+            std::mt19937 rng(0x3E76u);
+            std::size_t fresh = 0;
+            auto add = [&](std::int64_t key) {
+                if (!delta.try_emplace(key, -key)) return;
+                const bool exists = reference.count(key) == 1;
+                fresh += exists ? 0 : 1;
+                if (!exists || policy == ConflictPolicy::Overwrite) reference[key] = -key;
+            };
+            for (int i = 0; i < 2'000; ++i) add(static_cast<std::int64_t>(rng() % 40'000));
+            for (std::int64_t key = 10'001; key < 12'000; key += 2) add(key);
+            for (std::int64_t key : {std::int64_t{-10}, std::int64_t{-1}, std::int64_t{40'000}, std::int64_t{50'001}}) add(key);
+
+            const std::size_t delta_size = delta.size();
+            CHECK_EQ(base.merge_from(delta, policy), fresh);
+            CHECK_EQ(base.size(), reference.size());
+            CHECK_EQ(delta.size(), delta_size);
+            using Entries = std::vector<std::pair<std::int64_t, std::int64_t>>;
+            Entries entries;
+            base.scan(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max(),
+                      [&](std::int64_t key, std::int64_t value) { entries.emplace_back(key, value); });
+            CHECK_TRUE(entries == Entries(reference.begin(), reference.end()));
+            for (std::int64_t key = -20; key < 40'020; key += 3) CHECK_EQ(base.find(key).has_value(), reference.count(key) == 1);
+            CHECK_EQ(base.merge_from(base), std::size_t{0});
+        }
+    }
+
+    // Merging into an empty tree builds it from scratch; the source is left untouched.
+    BPlusTree<std::int64_t, std::int64_t, 4> source;
+    for (std::int64_t key = 0; key < 5'000; ++key) source.insert(key * 7, key);
+    BPlusTree<std::int64_t, std::int64_t, 4> target;
+    CHECK_EQ(target.merge_from(source), std::size_t{5'000});
+    CHECK_EQ(source.size(), std::size_t{5'000});
+    CHECK_EQ(target.stats().height, source.stats().height);
+    for (std::int64_t key = 0; key < 5'000; key += 13) CHECK_EQ(*target.find(key * 7), key);
+
+    // A budgeted target reloads only the leaves it merges into and stays within its budget.
+    BPlusTreeOptions budgeted;
+    budgeted.memory_budget = 16 * 1024;
+    BPlusTree<int, std::string, 16> cold(budgeted);
+    BPlusTree<int, std::string, 16> updates;
+    for (int key = 0; key < 4'000; ++key) cold.insert(key, "old");
+    for (int key = 0; key < 4'000; key += 40) updates.insert(key, "new");
+    CHECK_EQ(cold.merge_from(updates), std::size_t{0});
+    CHECK_EQ(*cold.find(1'200), std::string("new"));
+    CHECK_EQ(*cold.find(1'201), std::string("old"));
+    CHECK_TRUE(cold.stats().resident_bytes <= budgeted.memory_budget + 16 * 64);
+}
+
+void testEraseRange() {
+    test::TestScope scope("erase_range");
+    constexpr std::int64_t kKeys = 30'000;
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        BPlusTree<std::int64_t, std::int64_t, 8> tree(options);
+        std::map<std::int64_t, std::int64_t> reference;
+        for (std::int64_t i = 0; i < kKeys; ++i) {
+            const std::int64_t key = i * 7'919 % kKeys;
+            tree.insert(key, i);
+            reference[key] = i;
+        }
+        const std::size_t height = tree.stats().height;
+        std::mt19937 rng(0xE4A5Eu);
+        for (int round = 0; round < 200; ++round) {
+            // Mostly short ranges (often inside one leaf), some spanning thousands of keys.
+            const auto lo = static_cast<std::int64_t>(rng() % (kKeys + 200)) - 100;
+            const auto hi = lo + static_cast<std::int64_t>(round % 10 == 0 ? rng() % 5'000 : rng() % 12);
+            const auto first = reference.lower_bound(lo);
+            const auto last = reference.lower_bound(hi);
+            const auto expected = static_cast<std::size_t>(std::distance(first, lo < hi ? last : first));
+            if (lo < hi) reference.erase(first, last);
+            CHECK_EQ(tree.erase_range(lo, hi), expected);
+            CHECK_EQ(tree.size(), reference.size());
+            // Refill part of the hole so that the seam keeps taking inserts.
+            for (std::int64_t key = lo; key < hi && key < lo + 20; key += 3) {
+                tree.insert(key, -key);
+                reference[key] = -key;
+            }
+        }
+        std::vector<std::int64_t> expected_keys;
+        for (const auto& entry : reference) expected_keys.push_back(entry.first);
+        CHECK_TRUE(scannedKeys(tree) == expected_keys);
+        for (const auto& [key, value] : reference) {
+            if (key % 11 == 0) CHECK_EQ(*tree.find(key), value);
+        }
+        // Seams are merged back together, so the tree does not grow taller.
+        CHECK_TRUE(tree.stats().height <= height);
+        CHECK_EQ(tree.erase_range(5, 5), std::size_t{0});
+        CHECK_EQ(tree.erase_range(9, 2), std::size_t{0});
+        CHECK_EQ(tree.erase_range(std::numeric_limits<std::int64_t>::min(), std::numeric_limits<std::int64_t>::max()), reference.size());
+        CHECK_TRUE(tree.empty());
+        CHECK_EQ(tree.stats().height, std::size_t{1});
+    }
+
+    // Freed node slots are reused: cycling a large range in and out does not grow the arena.
+    BPlusTree<std::int64_t, std::int64_t, 8> cycled;
+    std::size_t arena_bytes = 0;
+    for (int cycle = 0; cycle < 30; ++cycle) {
+        for (std::int64_t key = 0; key < 20'000; ++key) cycled.insert(key, key);
+        CHECK_EQ(cycled.erase_range(100, 19'900), std::size_t{19'800});
+        if (cycle == 1) arena_bytes = cycled.stats().arena_bytes;
+    }
+    CHECK_EQ(cycled.stats().arena_bytes, arena_bytes);
+    CHECK_TRUE(scannedKeys(cycled).size() == 200);
+
+    // erase_from() drops the tail and frees its nodes, so repeating it does not grow the arena either.
+    BPlusTree<std::int64_t, std::int64_t, 8> tail;
+    std::size_t tail_arena_bytes = 0;
+    for (std::int64_t cycle = 0; cycle < 10; ++cycle) {
+        for (std::int64_t key = 0; key < 20'000; ++key) tail.insert(key, key);
+        CHECK_EQ(tail.erase_from(150 + cycle), static_cast<std::size_t>(20'000 - 150 - cycle));
+        CHECK_EQ(tail.size(), static_cast<std::size_t>(150 + cycle));
+        if (cycle == 1) tail_arena_bytes = tail.stats().arena_bytes;
+    }
+    CHECK_EQ(tail.stats().arena_bytes, tail_arena_bytes);
+    std::vector<std::int64_t> head(159);
+    std::iota(head.begin(), head.end(), 0);
+    CHECK_TRUE(scannedKeys(tail) == head);
+    CHECK_EQ(tail.erase_from(1'000), std::size_t{0});
+    CHECK_EQ(tail.erase_from(std::numeric_limits<std::int64_t>::min()), std::size_t{159});
+    CHECK_TRUE(tail.empty());
+
+    // Budgeted trees drop the charges of erased entries, evicted leaves included.
+    BPlusTreeOptions budgeted;
+    budgeted.memory_budget = 16 * 1024;
+    BPlusTree<int, std::string, 16> cold(budgeted);
+    for (int key = 0; key < 4'000; ++key) cold.insert(key, std::string(24, 'x'));
+    CHECK_EQ(cold.erase_range(500, 3'500), std::size_t{3'000});
+    CHECK_EQ(cold.size(), std::size_t{1'000});
+    CHECK_EQ(*cold.find(3'500), std::string(24, 'x'));
+    CHECK_EQ(cold.erase_range(0, 4'000), std::size_t{1'000});
+    CHECK_EQ(cold.stats().resident_bytes, std::size_t{0});
+}
+
+template <typename Tree>
+auto scannedEntries(const Tree& tree) {
+    std::vector<std::pair<typename Tree::key_type, typename Tree::mapped_type>> entries;
+    tree.scan(std::numeric_limits<typename Tree::key_type>::min(), std::numeric_limits<typename Tree::key_type>::max(),
+              [&](const auto& key, const auto& value) { entries.emplace_back(key, value); });
+    return entries;
+}
+
+template <typename Tree>
+bool throwsOnLoad(const std::string& bytes) {
+    std::istringstream in(bytes);
+    try {
+        Tree::deserialize(in);
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+void testSnapshot() {
+    test::TestScope scope("snapshot");
+    using Tree = BPlusTree<std::int64_t, std::int64_t, 16>;
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        Tree tree(options);
+        std::mt19937_64 rng(0x5EA1u);
+        // Random order leaves unsorted tails in append leaves; the extremes test the delta encoding.
+        for (int i = 0; i < 40'000; ++i) tree.insert(static_cast<std::int64_t>(rng() % 2'000'000) - 1'000'000, i);
+        tree.insert(std::numeric_limits<std::int64_t>::min(), 1);
+        tree.insert(std::numeric_limits<std::int64_t>::max(), 2);
+        std::stringstream stream;
+        tree.serialize(stream);
+        Tree loaded = Tree::deserialize(stream, options);
+        CHECK_EQ(loaded.size(), tree.size());
+        CHECK_TRUE(scannedEntries(loaded) == scannedEntries(tree));
+        // Leaves come out full, so the loaded tree is no taller than the original.
+        const BPlusTreeStats stats = loaded.stats();
+        CHECK_TRUE(stats.leaf_fill > 0.95);
+        CHECK_TRUE(stats.height <= tree.stats().height);
+        // The loaded tree is an ordinary one.
+        loaded.insert(7, -7);
+        CHECK_EQ(*loaded.find(7), std::int64_t{-7});
+        std::size_t inside = 0;
+        for (const auto& entry : scannedEntries(loaded)) inside += entry.first >= -500'000 && entry.first < 500'000 ? 1 : 0;
+        CHECK_EQ(loaded.erase_range(-500'000, 500'000), inside);
+    }
+
+    // Narrow and unsigned integer keys, over their whole range.
+    BPlusTree<std::uint16_t, std::uint8_t, 8> narrow;
+    for (std::uint32_t key = 0; key <= 0xFFFF; key += 3) narrow.insert(static_cast<std::uint16_t>(key), static_cast<std::uint8_t>(key));
+    narrow.insert(0xFFFF, 1);
+    std::stringstream narrow_stream;
+    narrow.serialize(narrow_stream);
+    auto narrow_loaded = decltype(narrow)::deserialize(narrow_stream);
+    CHECK_TRUE(scannedEntries(narrow_loaded) == scannedEntries(narrow));
+
+    // Empty trees round-trip too.
+    Tree empty;
+    std::stringstream empty_stream;
+    empty.serialize(empty_stream);
+    Tree empty_loaded = Tree::deserialize(empty_stream);
+    CHECK_TRUE(empty_loaded.empty());
+    empty_loaded.insert(1, 1);
+    CHECK_EQ(*empty_loaded.find(1), std::int64_t{1});
+
+    // String keys go through their codec; file descriptors work like streams. A budgeted tree writes
+    // its evicted leaves from the spill file, and loading into one evicts while it builds.
+    BPlusTreeOptions budgeted;
+    budgeted.memory_budget = 64 * 1024;
+    BPlusTree<std::string, std::string, 16> words(budgeted);
+    for (int i = 0; i < 20'000; ++i) words.insert("key" + std::to_string(i * 7'919 % 20'000), std::string(i % 40, 'v'));
+    CHECK_TRUE(words.stats().evicted_leaves > 0);
+    std::FILE* file = std::tmpfile();
+    words.serialize(::fileno(file));
+    ::lseek(::fileno(file), 0, SEEK_SET);
+    auto words_loaded = decltype(words)::deserialize(::fileno(file), budgeted);
+    std::fclose(file);
+    CHECK_EQ(words_loaded.size(), std::size_t{20'000});
+    CHECK_TRUE(words_loaded.stats().resident_bytes <= budgeted.memory_budget);
+    CHECK_TRUE(words_loaded.stats().evicted_leaves > 0);
+    bool same = true;
+    words.scan("", "z", [&](const std::string& key, const std::string& value) { same = same && words_loaded.find(key) == value; });
+    CHECK_TRUE(same);
+
+    // Damaged snapshots are rejected rather than loaded.
+    Tree small;
+    for (std::int64_t key = 0; key < 50'000; ++key) small.insert(key, key);
+    std::stringstream small_stream;
+    small.serialize(small_stream);
+    const std::string bytes = small_stream.str();
+    CHECK_FALSE(throwsOnLoad<Tree>(bytes));
+    std::string flipped = bytes;
+    flipped[bytes.size() / 2] = static_cast<char>(flipped[bytes.size() / 2] ^ 0x10);
+    CHECK_TRUE(throwsOnLoad<Tree>(flipped));
+    CHECK_TRUE(throwsOnLoad<Tree>(bytes.substr(0, bytes.size() - 3)));
+    CHECK_TRUE(throwsOnLoad<Tree>(bytes.substr(0, bytes.size() / 3)));
+    CHECK_TRUE(throwsOnLoad<Tree>(""));
+    std::string future = bytes;
+    future[8] = 2;
+    CHECK_TRUE(throwsOnLoad<Tree>(future));
+    // A block size near 4 GiB reads as truncated rather than being allocated up front.
+    std::string oversized = bytes;
+    for (std::size_t i = 4; i < 8; ++i) oversized[detail::kSnapshotHeaderBytes + i] = static_cast<char>(0xFF);
+    CHECK_TRUE(throwsOnLoad<Tree>(oversized));
+
+    // The stream gets one block at a time rather than the whole snapshot at the end.
+    struct CountingBuf : std::stringbuf {
+        std::size_t writes = 0;
+        std::streamsize largest = 0;
+        std::streamsize xsputn(const char* data, std::streamsize size) override {
+            ++writes;
+            largest = std::max(largest, size);
+            return std::stringbuf::xsputn(data, size);
+        }
+    };
+    CountingBuf buf;
+    std::ostream counting(&buf);
+    small.serialize(counting);
+    CHECK_TRUE(buf.str() == bytes);
+    CHECK_TRUE(buf.writes > 2);
+    CHECK_TRUE(buf.largest < static_cast<std::streamsize>(2 * detail::kSnapshotBlockBytes));
+    // snapshot() encodes the same bytes into memory and releases the latch before returning them.
+    const std::string encoded = small.snapshot();
+    CHECK_TRUE(encoded == bytes);
+    small.insert(-1, -1);
+    CHECK_EQ(*small.find(-1), std::int64_t{-1});
+    // A snapshot of string keys is not mistaken for one of integer keys.
+    std::stringstream word_stream;
+    words.serialize(word_stream);
+    CHECK_TRUE(throwsOnLoad<Tree>(word_stream.str()));
+}
+
+void testFrozenLeaves() {
+    test::TestScope scope("frozen_leaves");
+    for (LeafLayout layout : {LeafLayout::Sorted, LeafLayout::Gapped, LeafLayout::Append}) {
+        BPlusTreeOptions options;
+        options.leaf_layout = layout;
+        options.overflow_policy = layout == LeafLayout::Sorted ? OverflowPolicy::Redistribute : OverflowPolicy::Split;
+        BPlusTree<std::int64_t, std::int64_t, 64> tree(options);
+        std::map<std::int64_t, std::int64_t> reference;
+        // Clustered keys, a sparse run, and keys near the extremes (leaves spanning 64-bit ranges).
+        for (std::int64_t i = 0; i < 50'000; ++i) reference[i * 3 - 75'000] = i;
+        for (std::int64_t i = 0; i < 1'000; ++i) reference[i * 1'000'003'001] = -i;
+        reference[std::numeric_limits<std::int64_t>::min()] = 1;
+        reference[std::numeric_limits<std::int64_t>::max() - 1] = 2;
+        for (const auto& [key, value] : reference) tree.insert(key, value);
+
+        const BPlusTreeStats before = tree.stats();
+        tree.freeze();
+        const BPlusTreeStats frozen = tree.stats();
+        CHECK_EQ(frozen.frozen_leaves, frozen.leaves);
+        CHECK_EQ(frozen.entries, reference.size());
+        // Keys three apart take two bits instead of eight bytes.
+        CHECK_TRUE(frozen.node_bytes * 10 < before.node_bytes * 7);
+        bool found = true;
+        for (const auto& [key, value] : reference) found = found && tree.find(key) == value;
+        CHECK_TRUE(found);
+        bool absent = true;
+        for (std::int64_t key = -75'001; key < 1'000; key += 3) absent = absent && !tree.find(key);
+        CHECK_TRUE(absent);
+        CHECK_FALSE(tree.find(std::numeric_limits<std::int64_t>::min() + 1).has_value());
+        CHECK_TRUE(scannedKeys(tree).size() == reference.size());
+        std::vector<std::int64_t> probes{5, -75'000, 3'000'009'003, std::numeric_limits<std::int64_t>::max() - 1};
+        const auto results = tree.find_batch(probes);
+        CHECK_FALSE(results[0].has_value());
+        CHECK_EQ(*results[1], std::int64_t{0});
+        CHECK_EQ(*results[2], std::int64_t{-3});
+        CHECK_EQ(*results[3], std::int64_t{2});
+
+        // Writes unpack only the leaves they touch.
+        std::mt19937 rng(0xF0F0u);
+        for (int round = 0; round < 300; ++round) {
+            const std::int64_t key = static_cast<std::int64_t>(rng() % 160'000) - 80'000;
+            if (round % 3 == 0) {
+                CHECK_EQ(tree.erase(key), reference.erase(key) == 1);
+            } else {
+                tree.insert(key, round);
+                reference[key] = round;
+            }
+        }
+        const BPlusTreeStats thawed = tree.stats();
+        CHECK_TRUE(thawed.frozen_leaves > 0 && thawed.frozen_leaves < thawed.leaves);
+        CHECK_EQ(tree.erase_range(-10'000, 10'000), static_cast<std::size_t>(std::distance(reference.lower_bound(-10'000),
+                                                                                          reference.lower_bound(10'000))));
+        reference.erase(reference.lower_bound(-10'000), reference.lower_bound(10'000));
+        tree.freeze();
+        auto upper = tree.split_at(50'000);
+        tree.join(upper);
+        while (!tree.compact(64)) {}
+        std::vector<std::int64_t> expected_keys;
+        for (const auto& entry : reference) expected_keys.push_back(entry.first);
+        CHECK_TRUE(scannedKeys(tree) == expected_keys);
+        found = true;
+        for (const auto& [key, value] : reference) found = found && tree.find(key) == value;
+        CHECK_TRUE(found);
+        std::stringstream stream;
+        tree.serialize(stream);
+        CHECK_TRUE(scannedKeys(decltype(tree)::deserialize(stream)) == expected_keys);
+    }
+
+    // Narrow keys and a memory budget: evicted leaves are skipped, and the charges stay balanced.
+    BPlusTreeOptions budgeted;
+    budgeted.memory_budget = 8 * 1024;
+    BPlusTree<std::int16_t, std::string, 16> cold(budgeted);
+    for (int key = -20'000; key < 20'000; key += 5) cold.insert(static_cast<std::int16_t>(key), std::to_string(key));
+    cold.freeze();
+    const BPlusTreeStats stats = cold.stats();
+    CHECK_TRUE(stats.frozen_leaves > 0);
+    CHECK_EQ(stats.frozen_leaves + stats.evicted_leaves, stats.leaves);
+    bool found = true;
+    for (int key = -20'000; key < 20'000; key += 5) found = found && cold.find(static_cast<std::int16_t>(key)) == std::to_string(key);
+    CHECK_TRUE(found);
+    CHECK_FALSE(cold.find(1).has_value());
+    CHECK_EQ(cold.erase_range(-32'768, 32'767), std::size_t{8'000});
+    CHECK_EQ(cold.stats().resident_bytes, std::size_t{0});
+}
+
+void testInternedValues() {
+    test::TestScope scope("interned_values");
+    CHECK_EQ(InternedString().id(), std::uint32_t{0});
+    CHECK_TRUE(InternedString().view().empty());
+    CHECK_TRUE(InternedString("north") == InternedString(std::string("north")));
+    CHECK_TRUE(InternedString("north") != InternedString("south"));
+    CHECK_TRUE(InternedString("north") < InternedString("south"));
+    CHECK_TRUE(InternedString("north") == "north");
+
+    const std::vector<std::string> statuses{"active", "suspended", "closed", "pending"};
+    BPlusTree<std::int64_t, InternedString, 32> tree;
+    BPlusTree<std::int64_t, std::string, 32> plain;
+    for (std::int64_t key = 0; key < 20'000; ++key) {
+        tree.insert(key, statuses[static_cast<std::size_t>(key * 7 % 4)]);
+        plain.insert(key, statuses[static_cast<std::size_t>(key * 7 % 4)]);
+    }
+    const std::size_t dictionary_size = detail::StringDictionary::instance().size();
+    bool found = true;
+    for (std::int64_t key = 0; key < 20'000; ++key) {
+        const std::optional<InternedString> value = tree.find(key);
+        const std::string_view text = *value;
+        found = found && value == statuses[static_cast<std::size_t>(key * 7 % 4)] && text == *plain.find(key);
+    }
+    CHECK_TRUE(found);
+    // Lookups do not intern anything, and each leaf stores 4-byte ids.
+    CHECK_EQ(detail::StringDictionary::instance().size(), dictionary_size);
+    CHECK_TRUE(tree.stats().node_bytes < plain.stats().node_bytes);
+    std::size_t closed = 0;
+    const InternedString closed_status("closed");
+    tree.scan(0, 20'000, [&](std::int64_t, InternedString value) { closed += value == closed_status ? 1 : 0; });
+    CHECK_EQ(closed, std::size_t{5'000});
+
+    // Threads interning the same strings agree on their ids; ids resolve across segment boundaries.
+    constexpr int kWords = 3'000;
+    std::vector<std::vector<std::uint32_t>> ids(4, std::vector<std::uint32_t>(kWords));
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < ids.size(); ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < kWords; ++i) {
+                const int word = static_cast<int>(t % 2 == 0 ? i : kWords - 1 - i);
+                ids[t][static_cast<std::size_t>(word)] = InternedString("word" + std::to_string(word)).id();
+            }
+        });
+    }
+    for (auto& thread : threads) thread.join();
+    bool agreed = true;
+    for (int i = 0; i < kWords; ++i) {
+        const auto id = ids[0][static_cast<std::size_t>(i)];
+        for (const auto& other : ids) agreed = agreed && other[static_cast<std::size_t>(i)] == id;
+        agreed = agreed && detail::StringDictionary::instance().lookup(id) == "word" + std::to_string(i);
+    }
+    CHECK_TRUE(agreed);
+
+    // Spilled leaves and snapshots carry the text, which is interned again when read back.
+    BPlusTreeOptions budgeted;
+    budgeted.memory_budget = 2 * 1024;
+    BPlusTree<std::int64_t, InternedString, 32> cold(budgeted);
+    for (std::int64_t key = 0; key < 5'000; ++key) cold.insert(key, "region-" + std::to_string(key % 12));
+    CHECK_TRUE(cold.stats().evicted_leaves > 0);
+    found = true;
+    for (std::int64_t key = 0; key < 5'000; key += 7) found = found && cold.find(key) == "region-" + std::to_string(key % 12);
+    CHECK_TRUE(found);
+    std::stringstream stream;
+    cold.serialize(stream);
+    auto loaded = decltype(cold)::deserialize(stream);
+    CHECK_EQ(loaded.size(), std::size_t{5'000});
+    CHECK_TRUE(loaded.find(4'999) == "region-7");
+}
+
+void testInsertBatch() {
+    test::TestScope scope("insert_batch");
+    BPlusTree<int, int, 8> tree;
+    std::map<int, int> reference;
+    for (int key = 0; key < 1'000; key += 2) {
+        tree.insert(key, -1);
+        reference[key] = -1;
+    }
+    std::mt19937 rng(70);
+    std::uniform_int_distribution<int> keys(0, 2'999);
+    std::size_t added = 0;
+    std::size_t expected = 0;
+    for (int round = 0; round < 50; ++round) {
+        std::vector<std::pair<int, int>> entries;
+        for (int i = 0; i < 100; ++i) entries.emplace_back(keys(rng), round * 1'000 + i);
+        for (const auto& [key, value] : entries) {
+            const bool fresh = reference.find(key) == reference.end();
+            expected += fresh ? 1 : 0;
+            reference[key] = value;  // the last entry for a key wins
+        }
+        added += tree.insert_batch(std::move(entries));
+    }
+    CHECK_EQ(added, expected);
+    CHECK_EQ(tree.size(), reference.size());
+    std::vector<std::pair<int, int>> scanned;
+    tree.scan(0, 3'000, [&](int key, int value) { scanned.emplace_back(key, value); });
+    CHECK_TRUE((scanned == std::vector<std::pair<int, int>>(reference.begin(), reference.end())));
+    CHECK_EQ(tree.insert_batch({}), std::size_t{0});
+}
+
+void testKeyValueServer() {
+    test::TestScope scope("key_value_server");
+    kv::Tree tree;
+    kv::Endpoint endpoint;
+    endpoint.unix_path = "/tmp/b_plus_tree_tests." + std::to_string(::getpid()) + ".sock";
+    auto server = std::make_unique<kv::Server>(tree, endpoint, 2);
+    CHECK_EQ(::access(endpoint.unix_path.c_str(), F_OK), 0);
+
+    // Pipelined requests are answered in order, across batches of reads, writes and scans.
+    kv::Client client(server->endpoint());
+    client.put("b", "two");
+    client.put("a", "one");
+    client.get("a");
+    client.put("a", "uno");
+    client.get("a");
+    client.get("missing");
+    client.mget({"b", "missing", "a"});
+    client.scan("a", "z", 10);
+    client.scan("a", "z", 1);
+    client.raw(static_cast<std::uint8_t>(kv::Op::Get), "\x05" "ab");  // declares five bytes, has two
+    client.raw(99, "");
+    client.get("b");
+    client.flush();
+    CHECK_TRUE(client.read().status == kv::Status::Ok);
+    CHECK_TRUE(client.read().status == kv::Status::Ok);
+    CHECK_EQ(client.read().body, std::string("one"));
+    CHECK_TRUE(client.read().status == kv::Status::Ok);
+    CHECK_EQ(client.read().body, std::string("uno"));
+    CHECK_TRUE(client.read().status == kv::Status::NotFound);
+    const auto values = kv::Client::values(client.read());
+    CHECK_TRUE((values == std::vector<std::optional<std::string>>{std::string("two"), std::nullopt, std::string("uno")}));
+    const auto entries = kv::Client::entries(client.read());
+    CHECK_TRUE(entries == (std::vector<std::pair<std::string, std::string>>{{"a", "uno"}, {"b", "two"}}));
+    CHECK_EQ(kv::Client::entries(client.read()).size(), std::size_t{1});
+    CHECK_TRUE(client.read().status == kv::Status::Error);
+    CHECK_TRUE(client.read().status == kv::Status::Error);
+    CHECK_EQ(client.read().body, std::string("two"));
+
+    // Concurrent connections over TCP see each other's writes.
+    kv::Endpoint tcp;
+    kv::Server tcp_server(tree, tcp, 2);
+    CHECK_TRUE(tcp_server.endpoint().port != 0);
+    kv::LoadOptions options;
+    options.connections = 3;
+    options.depth = 16;
+    options.requests = 6'000;
+    options.keys = 500;
+    kv::preload(tcp_server.endpoint(), options);
+    const kv::LoadReport report = kv::runLoad(tcp_server.endpoint(), options);
+    CHECK_EQ(report.requests, std::uint64_t{6'000});
+    CHECK_TRUE(report.hits > 0);
+    CHECK_EQ(tree.size(), std::size_t{502});
+    tcp_server.stop();
+    tcp_server.stop();
+
+    server.reset();
+    CHECK_TRUE(::access(endpoint.unix_path.c_str(), F_OK) != 0);
+}
+
+void testWriteBatch() {
+    test::TestScope scope("write_batch");
+    std::vector<BPlusTreeOptions> variants(4);
+    variants[1].leaf_layout = LeafLayout::Gapped;
+    variants[2].leaf_layout = LeafLayout::Append;
+    variants[3].memory_budget = 4 * 1024;
+    for (const BPlusTreeOptions& options : variants) {
+        BPlusTree<int, int, 8> tree(options);
+        std::map<int, int> reference;
+        std::mt19937 rng(72);
+        for (int round = 0; round < 200; ++round) {
+            decltype(tree)::WriteBatch batch;
+            for (int i = 0; i < 40; ++i) {
+                const int key = static_cast<int>(rng() % 3'000);
+                if (rng() % 3 == 0) {
+                    batch.erase(key);
+                    reference.erase(key);
+                } else {
+                    batch.put(key, round * 100 + i);
+                    reference[key] = round * 100 + i;
+                }
+            }
+            CHECK_EQ(batch.size(), std::size_t{40});
+            tree.apply(std::move(batch));
+        }
+        CHECK_EQ(tree.size(), reference.size());
+        std::vector<std::pair<int, int>> scanned;
+        tree.scan(0, 3'000, [&](int key, int value) { scanned.emplace_back(key, value); });
+        CHECK_TRUE((scanned == std::vector<std::pair<int, int>>(reference.begin(), reference.end())));
+    }
+
+    // The last operation on a key wins, whichever kind it is.
+    BPlusTree<int, int, 8> tree;
+    tree.insert(1, 1);
+    decltype(tree)::WriteBatch batch;
+    batch.erase(1);
+    batch.put(1, 2);
+    batch.put(2, 2);
+    batch.erase(2);
+    tree.apply(std::move(batch));
+    CHECK_EQ(tree.find(1), std::optional<int>(2));
+    CHECK_FALSE(tree.find(2).has_value());
+    tree.apply({});
+
+    // Batches move amounts between accounts spread over the whole tree; every reader sees the total
+    // unchanged.
+    constexpr int kAccounts = 2'000;
+    constexpr int kTotal = kAccounts * 100;
+    BPlusTree<int, int, 8> accounts;
+    for (int key = 0; key < kAccounts; ++key) accounts.insert(key, 100);
+    std::atomic<bool> done{false};
+    std::thread writer([&] {
+        std::mt19937 rng(7);
+        std::vector<int> balances(kAccounts, 100);
+        for (int round = 0; round < 3'000; ++round) {
+            decltype(accounts)::WriteBatch transfer;
+            for (int leg = 0; leg < 4; ++leg) {
+                const int from = static_cast<int>(rng() % kAccounts);
+                const int to = static_cast<int>(rng() % kAccounts);
+                const int amount = static_cast<int>(rng() % 10);
+                balances[static_cast<std::size_t>(from)] -= amount;
+                balances[static_cast<std::size_t>(to)] += amount;
+                transfer.put(from, balances[static_cast<std::size_t>(from)]);
+                transfer.put(to, balances[static_cast<std::size_t>(to)]);
+            }
+            accounts.apply(std::move(transfer));
+        }
+        done = true;
+    });
+    std::vector<int> keys(kAccounts);
+    std::iota(keys.begin(), keys.end(), 0);
+    bool consistent = true;
+    int reads = 0;
+    while (!done || reads < 3) {
+        long scanned_total = 0;
+        // Yielding now and then lets batches land while the scan is under way.
+        accounts.scan(0, kAccounts, [&](int key, int value) {
+            scanned_total += value;
+            if (key % 256 == 0) std::this_thread::yield();
+        });
+        long batch_total = 0;
+        for (const auto& value : accounts.find_batch(keys)) batch_total += *value;
+        const long reduced = accounts.parallel_reduce(0, kAccounts, 0L, [](long acc, int, int value) { return acc + value; },
+                                                      [](long a, long b) { return a + b; }, 2);
+        consistent = consistent && scanned_total == kTotal && batch_total == kTotal && reduced == kTotal;
+        ++reads;
+    }
+    writer.join();
+    CHECK_TRUE(consistent);
+    CHECK_EQ(accounts.size(), std::size_t{kAccounts});
+
+    // fn runs without any latch, so it may apply batches and scan again; the outer scan goes on
+    // reading as of its start, also across two batches touching the same key.
+    BPlusTree<int, int, 8> nested;
+    for (int key = 0; key < 2'000; key += 2) nested.insert(key, 1);
+    std::vector<std::pair<int, int>> seen;
+    nested.scan(0, 2'000, [&](int key, int value) {
+        seen.emplace_back(key, value);
+        decltype(nested)::WriteBatch change;
+        if (key == 10) {
+            change.put(1'000, 100);
+            change.erase(1'200);
+            change.put(1'301, 5);
+        } else if (key == 1'100) {
+            change.erase(1'000);
+            change.put(1'300, 7);
+        } else {
+            return;
+        }
+        nested.apply(std::move(change));
+        long inner = 0;
+        nested.parallel_scan(0, 2'000, [&](int, int inner_value) { inner += inner_value; }, 1);
+        CHECK_EQ(inner, key == 10 ? 1'000L - 1 + 100 - 1 + 5 : 1'000L - 1 - 1 + 6 + 5);
+    });
+    std::vector<std::pair<int, int>> original;
+    for (int key = 0; key < 2'000; key += 2) original.emplace_back(key, 1);
+    CHECK_TRUE(seen == original);
+    CHECK_FALSE(nested.find(1'000).has_value());
+    CHECK_EQ(nested.find(1'300), std::optional<int>(7));
+    CHECK_EQ(nested.find(1'301), std::optional<int>(5));
+    CHECK_FALSE(nested.find(1'200).has_value());
+}
+
+void testCursor() {
+    test::TestScope scope("cursor");
+    std::vector<BPlusTreeOptions> variants(5);
+    variants[1].leaf_layout = LeafLayout::Gapped;
+    variants[2].leaf_layout = LeafLayout::Append;
+    variants[3].overflow_policy = OverflowPolicy::Redistribute;
+    variants[4].memory_budget = 4 * 1024;
+    for (const BPlusTreeOptions& options : variants) {
+        BPlusTree<int, int, 8> tree(options);
+        auto cursor = tree.cursor();
+        CHECK_FALSE(cursor.seek(0));
+        CHECK_FALSE(cursor.next());
+        std::map<int, int> reference;
+        std::mt19937 rng(75);
+        int key = 0;
+        bool agrees = true;
+        for (int round = 0; round < 2'000; ++round) {
+            // Writes between the cursor's calls split, redistribute and free the leaves under it.
+            for (int i = 0; i < 5; ++i) {
+                const int written = static_cast<int>(rng() % 4'000);
+                if (rng() % 3 == 0) {
+                    tree.erase(written);
+                    reference.erase(written);
+                } else {
+                    tree.insert(written, round);
+                    reference[written] = round;
+                }
+            }
+            // Mostly short hops from the previous key, sometimes a jump.
+            key = rng() % 8 == 0 ? static_cast<int>(rng() % 4'200) : key + static_cast<int>(rng() % 40) - 20;
+            auto expected = reference.lower_bound(key);
+            agrees = agrees && cursor.seek(key) == (expected != reference.end());
+            auto found = reference.find(key);
+            agrees = agrees && cursor.find(key) == (found == reference.end() ? std::nullopt : std::optional<int>(found->second));
+            if (!cursor.valid()) continue;
+            const bool forward = rng() % 2 == 0;
+            for (int step = 0; step < 12 && agrees; ++step) {
+                agrees = cursor.key() == expected->first && cursor.value() == expected->second;
+                if (forward) {
+                    ++expected;
+                    agrees = agrees && cursor.next() == (expected != reference.end());
+                } else {
+                    agrees = agrees && cursor.prev() == (expected != reference.begin());
+                    if (expected == reference.begin()) break;
+                    --expected;
+                }
+                if (!cursor.valid()) break;
+            }
+        }
+        CHECK_TRUE(agrees);
+
+        // A full walk in either direction.
+        std::vector<std::pair<int, int>> walked;
+        for (bool more = cursor.seek(std::numeric_limits<int>::min()); more; more = cursor.next()) walked.emplace_back(cursor.key(), cursor.value());
+        CHECK_TRUE((walked == std::vector<std::pair<int, int>>(reference.begin(), reference.end())));
+        walked.clear();
+        for (bool more = cursor.seek(reference.rbegin()->first); more; more = cursor.prev()) walked.emplace_back(cursor.key(), cursor.value());
+        CHECK_TRUE((walked == std::vector<std::pair<int, int>>(reference.rbegin(), reference.rend())));
+        CHECK_FALSE(cursor.next());
+    }
+
+    // Still right after the tree is cut in two and put back together.
+    BPlusTree<int, int, 8> tree;
+    for (int key = 0; key < 1'000; ++key) tree.insert(key, key);
+    auto cursor = tree.cursor();
+    CHECK_TRUE(cursor.seek(900));
+    auto upper = tree.split_at(500);
+    CHECK_FALSE(cursor.seek(900));
+    CHECK_TRUE(cursor.seek(499));
+    CHECK_FALSE(cursor.next());
+    tree.join(upper);
+    CHECK_EQ(cursor.find(900), std::optional<int>(900));
+    CHECK_TRUE(cursor.next());
+    CHECK_EQ(cursor.key(), 901);
+}
+
+void testTransactions() {
+    test::TestScope scope("transactions");
+    BPlusTree<int, int, 8> tree;
+    for (int key = 0; key < 1'000; key += 2) tree.insert(key, key);
+
+    // Reads see the transaction's own writes; nothing reaches the tree before commit().
+    auto txn = tree.begin();
+    CHECK_EQ(txn.get(10), std::optional<int>(10));
+    txn.put(10, 11);
+    txn.put(11, 11);
+    txn.erase(12);
+    CHECK_EQ(txn.get(10), std::optional<int>(11));
+    CHECK_FALSE(txn.get(12).has_value());
+    std::vector<std::pair<int, int>> seen;
+    txn.scan(8, 16, [&](int key, int value) { seen.emplace_back(key, value); });
+    CHECK_TRUE((seen == std::vector<std::pair<int, int>>{{8, 8}, {10, 11}, {11, 11}, {14, 14}}));
+    CHECK_EQ(tree.find(10), std::optional<int>(10));
+    CHECK_TRUE(txn.commit());
+    CHECK_EQ(tree.find(10), std::optional<int>(11));
+    CHECK_EQ(tree.find(11), std::optional<int>(11));
+    CHECK_FALSE(tree.find(12).has_value());
+
+    // A read that went stale fails the commit, which then writes nothing.
+    auto first = tree.begin();
+    auto second = tree.begin();
+    first.put(500, first.get(500).value_or(0) + 1);
+    second.put(500, second.get(500).value_or(0) + 1);
+    CHECK_TRUE(second.commit());
+    CHECK_FALSE(first.commit());
+    CHECK_EQ(tree.find(500), std::optional<int>(501));
+
+    // Phantoms: an insert into a range read fails the commit, one in a distant leaf does not.
+    auto reader = tree.begin();
+    int count = 0;
+    reader.scan(301, 305, [&](int, int) { ++count; });
+    reader.put(-1, count);
+    tree.insert(900, 900);
+    CHECK_TRUE(reader.commit());
+    reader.scan(301, 305, [&](int, int) { ++count; });
+    reader.put(-1, count);
+    tree.insert(303, 303);
+    CHECK_FALSE(reader.commit());
+    CHECK_EQ(tree.find(-1), std::optional<int>(2));
+    // Also for a range that holds nothing, and for a key found missing.
+    auto empty_range = tree.begin();
+    empty_range.scan(2'000, 3'000, [&](int, int) {});
+    empty_range.put(-2, 0);
+    tree.insert(2'500, 0);
+    CHECK_FALSE(empty_range.commit());
+    auto missing = tree.begin();
+    CHECK_FALSE(missing.get(301).has_value());
+    missing.put(-3, 0);
+    tree.insert(301, 301);
+    CHECK_FALSE(missing.commit());
+
+    // Freeing a distant leaf leaves the transaction alone; freeing the leaf it read fails it, also
+    // once the slot holds a new leaf.
+    auto distant = tree.begin();
+    CHECK_EQ(distant.get(100), std::optional<int>(100));
+    distant.put(-4, 0);
+    CHECK_EQ(tree.erase_range(600, 800), std::size_t{100});
+    CHECK_TRUE(distant.commit());
+    auto freed = tree.begin();
+    CHECK_EQ(freed.get(900), std::optional<int>(900));
+    freed.put(-5, 0);
+    CHECK_EQ(tree.erase_range(850, 1'000), std::size_t{75});
+    for (int key = 600; key < 800; ++key) tree.insert(key, key);
+    CHECK_FALSE(freed.commit());
+
+    // Concurrent transfers keep the total; read-only transactions that commit saw a consistent sum.
+    constexpr int kAccounts = 500;
+    BPlusTree<int, int, 8> accounts;
+    for (int key = 0; key < kAccounts; ++key) accounts.insert(key, 100);
+    std::atomic<int> committed{0};
+    std::atomic<int> aborted{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+        threads.emplace_back([&, t] {
+            std::mt19937 rng(static_cast<unsigned>(t));
+            for (int round = 0; round < 500; ++round) {
+                const int from = static_cast<int>(rng() % kAccounts);
+                const int to = static_cast<int>(rng() % kAccounts);
+                for (auto transfer = accounts.begin();;) {
+                    const int amount = static_cast<int>(rng() % 10);
+                    transfer.put(from, *transfer.get(from) - amount);
+                    transfer.put(to, *transfer.get(to) + amount);
+                    if (transfer.commit()) break;
+                    ++aborted;
+                }
+                ++committed;
+            }
+        });
+    }
+    bool consistent = true;
+    for (int audits = 0; audits < 50;) {
+        auto audit = accounts.begin();
+        long total = 0;
+        audit.scan(0, kAccounts, [&](int, int value) { total += value; });
+        if (!audit.commit()) continue;
+        consistent = consistent && total == kAccounts * 100;
+        ++audits;
+    }
+    for (auto& thread : threads) thread.join();
+    CHECK_TRUE(consistent);
+    CHECK_EQ(committed.load(), 2'000);
+    long total = 0;
+    accounts.scan(0, kAccounts, [&](int, int value) { total += value; });
+    CHECK_EQ(total, long{kAccounts} * 100);
+}
+
+void testChangeHook() {
+    test::TestScope scope("change_hook");
+    BPlusTree<int, int, 8> tree;
+    std::vector<std::tuple<MutationKind, int, int, int>> log;
+    tree.set_change_hook([&](const Mutation<int, int>& mutation) {
+        log.emplace_back(mutation.kind, *mutation.key, mutation.end ? *mutation.end : 0, mutation.value ? *mutation.value : 0);
+    });
+    auto replay = [&](std::map<int, int>& copy, std::size_t from) {
+        for (std::size_t i = from; i < log.size(); ++i) {
+            const auto& [kind, key, end, value] = log[i];
+            if (kind == MutationKind::Put) copy[key] = value;
+            if (kind == MutationKind::Erase) copy.erase(key);
+            if (kind == MutationKind::EraseRange) copy.erase(copy.lower_bound(key), copy.lower_bound(end));
+            if (kind == MutationKind::EraseFrom) copy.erase(copy.lower_bound(key), copy.end());
+        }
+    };
+    auto contents = [](const auto& source) {
+        std::map<int, int> entries;
+        source.scan(std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), [&](int key, int value) { entries[key] = value; });
+        return entries;
+    };
+
+    for (int key = 0; key < 500; ++key) tree.insert(key * 3, key);
+    tree.insert(3, 33);
+    tree.insert_or_assign(6, 66);
+    CHECK_FALSE(tree.try_emplace(9, 99));
+    CHECK_FALSE(tree.erase(1));
+    CHECK_EQ(log.size(), std::size_t{502});
+    std::map<int, int> middle;
+    replay(middle, 0);
+    const std::size_t mark = log.size();
+    tree.erase(12);
+    tree.erase_range(100, 400);
+    tree.insert_batch({{5, 1}, {5, 2}, {700, 7}, {3, 4}});
+    BPlusTree<int, int, 8> other;
+    for (int key = 0; key < 2'000; key += 7) other.insert(key, -key);
+    tree.merge_from(other, ConflictPolicy::KeepExisting);
+    BPlusTree<int, int, 8> tail = tree.split_at(1'200);
+    BPlusTree<int, int, 8> more;
+    for (int key = 5'000; key < 5'100; ++key) more.insert(key, key);
+    tree.join(more);
+    BPlusTree<int, int, 8> right = tree.split_at(5'050);
+    tree.join(right);  // shares the arena: grafted, and still reported entry by entry
+
+    std::map<int, int> copy;
+    replay(copy, 0);
+    CHECK_TRUE(copy == contents(tree));
+    // Replaying from an older state that already holds some of the later changes converges too.
+    replay(middle, mark - 100);
+    CHECK_TRUE(middle == contents(tree));
+
+    tree.set_change_hook({});
+    const std::size_t logged = log.size();
+    tree.insert(-1, -1);
+    CHECK_EQ(log.size(), logged);
+}
+
+void testReplication() {
+    test::TestScope scope("replication");
+    kv::Tree tree;
+    for (int key = 0; key < 20'000; ++key) tree.insert(kv::loadKey(key), "seed");
+    kv::Endpoint endpoint;
+    endpoint.unix_path = "/tmp/b_plus_tree_tests." + std::to_string(::getpid()) + ".replication.sock";
+    kv::ReplicationLeader<> leader(tree, endpoint);
+    auto contents = [](const kv::Tree& source) {
+        std::vector<std::pair<std::string, std::string>> entries;
+        source.scan("", "\x7f", [&](const std::string& key, const std::string& value) { entries.emplace_back(key, value); });
+        return entries;
+    };
+
+    // Writers keep going while the followers connect and load their snapshots.
+    std::atomic<bool> writing{true};
+    std::thread writer([&] {
+        std::mt19937 rng(71);
+        for (int round = 0; writing || round < 2'000; ++round) {
+            const int key = static_cast<int>(rng() % 30'000);
+            if (round % 10 == 0) {
+                tree.erase(kv::loadKey(key));
+            } else {
+                tree.insert(kv::loadKey(key), "v" + std::to_string(round));
+            }
+        }
+    });
+    kv::ReplicationFollower<> follower(leader.endpoint());
+    kv::ReplicationFollower<> second(leader.endpoint());
+    writing = false;
+    writer.join();
+    tree.erase_range(kv::loadKey(100), kv::loadKey(200));
+    tree.insert_batch({{"batch-a", "1"}, {"batch-b", "2"}, {"batch-a", "3"}});
+    tree.split_at(kv::loadKey(9));
+    tree.erase_from(kv::loadKey(8));
+    CHECK_TRUE(follower.wait_for(leader.sequence(), std::chrono::seconds(30)));
+    CHECK_TRUE(second.wait_for(leader.sequence(), std::chrono::seconds(30)));
+    CHECK_EQ(follower.sequence(), leader.sequence());
+    CHECK_TRUE(contents(follower.tree()) == contents(tree));
+    CHECK_TRUE(contents(second.tree()) == contents(tree));
+    CHECK_EQ(follower.tree().find("batch-a"), std::optional<std::string>("3"));
+
+    // A follower that goes away does not disturb the others.
+    second.stop();
+    for (int key = 0; key < 1'000; ++key) tree.insert("late" + std::to_string(key), "x");
+    CHECK_TRUE(follower.wait_for(leader.sequence(), std::chrono::seconds(30)));
+    CHECK_TRUE(contents(follower.tree()) == contents(tree));
+
+    // Over TCP, from a tree that starts out empty.
+    kv::Tree fresh;
+    kv::ReplicationLeader<> tcp_leader(fresh, kv::Endpoint{});
+    kv::ReplicationFollower<> tcp_follower(tcp_leader.endpoint());
+    CHECK_EQ(tcp_follower.tree().size(), std::size_t{0});
+    fresh.insert("k", "v");
+    CHECK_TRUE(tcp_follower.wait_for(1, std::chrono::seconds(30)));
+    CHECK_EQ(tcp_follower.tree().find("k"), std::optional<std::string>("v"));
+
+    // A follower that stops reading is dropped once its backlog passes the cap; the next one that
+    // connects loads a fresh snapshot.
+    kv::Tree busy;
+    for (int key = 0; key < 20'000; ++key) busy.insert(kv::loadKey(key), "seed");
+    kv::ReplicationLeader<> capped_leader(busy, kv::Endpoint{}, 16 * 1024);
+    const int stalled = kv::openSocket(capped_leader.endpoint(), false);
+    auto wait_for_followers = [&](std::size_t count) {
+        for (int i = 0; i < 3'000 && capped_leader.follower_count() != count; ++i) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return capped_leader.follower_count() == count;
+    };
+    CHECK_TRUE(wait_for_followers(1));
+    // The socket buffers absorb some of it first.
+    for (int round = 0; round < 1'000 && capped_leader.follower_count() != 0; ++round) {
+        for (int key = 0; key < 1'000; ++key) busy.insert(kv::loadKey(key), std::string(200, static_cast<char>('a' + round % 26)));
+    }
+    CHECK_TRUE(wait_for_followers(0));
+    ::close(stalled);
+    kv::ReplicationFollower<> caught_up(capped_leader.endpoint());
+    CHECK_EQ(capped_leader.follower_count(), std::size_t{1});
+    CHECK_TRUE(contents(caught_up.tree()) == contents(busy));
+
+    leader.stop();
+    CHECK_FALSE(follower.wait_for(leader.sequence() + 1, std::chrono::seconds(30)));
+    CHECK_FALSE(follower.connected());
+    tree.insert("after", "stop");
+    CHECK_FALSE(follower.tree().find("after").has_value());
+}
+
+void testSharedTree() {
+    test::TestScope scope("shared_tree");
+    using Shared = SharedBPlusTree<int, int, 4>;
+    const std::string name = "/b_plus_tree_test_" + std::to_string(::getpid());
+    Shared::remove(name);
+
+    // Same contents as std::map under random inserts and erases, slots being reused along the way.
+    {
+        Shared tree(name, 20'000);
+        std::map<int, int> expected;
+        std::mt19937 rng(74);
+        for (int i = 0; i < 50'000; ++i) {
+            const int key = static_cast<int>(rng() % 2'000);
+            if (rng() % 3 == 0) {
+                CHECK_EQ(tree.erase(key), expected.erase(key) == 1);
+            } else {
+                CHECK_EQ(tree.insert(key, i), expected.insert_or_assign(key, i).second);
+            }
+        }
+        CHECK_EQ(tree.size(), expected.size());
+        std::vector<std::pair<int, int>> entries;
+        tree.scan(std::numeric_limits<int>::min(), std::numeric_limits<int>::max(), [&](int key, int value) { entries.emplace_back(key, value); });
+        CHECK_TRUE((entries == std::vector<std::pair<int, int>>(expected.begin(), expected.end())));
+        CHECK_EQ(tree.find(expected.begin()->first), std::optional<int>(expected.begin()->second));
+        CHECK_FALSE(tree.find(5'000).has_value());
+
+        // A second mapping, as another process would open it, sees the same tree.
+        Shared other(name);
+        CHECK_EQ(other.size(), expected.size());
+        CHECK_EQ(other.max_nodes(), std::size_t{20'000});
+        other.insert(5'000, 1);
+        CHECK_EQ(tree.find(5'000), std::optional<int>(1));
+        bool mismatch = false;
+        try {
+            SharedBPlusTree<int, long, 4> wrong(name);
+        } catch (const std::runtime_error&) {
+            mismatch = true;
+        }
+        CHECK_TRUE(mismatch);
+
+        for (const auto& entry : expected) tree.erase(entry.first);
+        tree.erase(5'000);
+        CHECK_TRUE(tree.empty());
+    }
+    Shared::remove(name);
+
+    // A full segment refuses the write and keeps the tree as it was.
+    {
+        Shared tree(name, 16);
+        bool full = false;
+        int inserted = 0;
+        try {
+            for (;; ++inserted) tree.insert(inserted, inserted);
+        } catch (const std::length_error&) {
+            full = true;
+        }
+        CHECK_TRUE(full);
+        CHECK_EQ(tree.size(), static_cast<std::size_t>(inserted));
+        int count = 0;
+        tree.scan(0, inserted + 1, [&](int key, int value) { count += key == count && value == key; });
+        CHECK_EQ(count, inserted);
+    }
+    Shared::remove(name);
+
+    // Readers in another process see whole versions while this one writes: every scan holds the keys
+    // 0..n-1 for some n that never goes down.
+    {
+        Shared tree(name, 1 << 16);
+        const pid_t reader = ::fork();
+        if (reader == 0) {
+            Shared mine(name);
+            int last = 0;
+            while (last < 20'000) {
+                int count = 0;
+                bool whole = true;
+                mine.scan(0, std::numeric_limits<int>::max(), [&](int key, int value) { whole = whole && key == count++ && value == key * 3; });
+                if (!whole || count < last) ::_exit(1);
+                last = count;
+            }
+            ::_exit(0);
+        }
+        for (int key = 0; key < 20'000; ++key) tree.insert(key, key * 3);
+        int status = 0;
+        ::waitpid(reader, &status, 0);
+        CHECK_TRUE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+    Shared::remove(name);
+
+    // A writer killed at any point leaves a tree the next writer can take over.
+    {
+        Shared tree(name, 4'096);
+        const pid_t writer = ::fork();
+        if (writer == 0) {
+            for (int key = 0;; key = (key + 1) % 500) {
+                tree.insert(key, key);
+                tree.erase((key + 250) % 500);
+            }
+        }
+        while (tree.generation() < 20'000) std::this_thread::yield();
+        ::kill(writer, SIGKILL);
+        ::waitpid(writer, nullptr, 0);
+        const std::size_t size = tree.size();
+        tree.insert(1'000, 0);  // recovers
+        CHECK_EQ(tree.size(), size + 1);
+        std::size_t count = 0;
+        tree.scan(0, 1'001, [&](int key, int value) { count += key == value || key == 1'000; });
+        CHECK_EQ(count, size + 1);
+        // Slots are reused after the recovery as before.
+        for (int round = 0; round < 10'000; ++round) {
+            tree.insert(round % 700, round);
+            tree.erase((round + 350) % 700);
+        }
+        CHECK_TRUE(tree.size() <= 700);
+    }
+    Shared::remove(name);
+
+    // A reader that dies mid-scan pins its version only until the writer runs out of slots.
+    {
+        Shared tree(name, 256);
+        for (int key = 0; key < 100; ++key) tree.insert(key, key);
+        const pid_t reader = ::fork();
+        if (reader == 0) {
+            tree.scan(0, 100, [](int, int) { ::_exit(0); });
+            ::_exit(1);
+        }
+        ::waitpid(reader, nullptr, 0);
+        for (int round = 0; round < 10'000; ++round) tree.insert(round % 100, round);
+        CHECK_EQ(tree.size(), std::size_t{100});
+    }
+    Shared::remove(name);
+
+    // Readers that died holding every slot do not lock out the ones after them.
+    {
+        Shared tree(name, 256);
+        for (int key = 0; key < 100; ++key) tree.insert(key, key);
+        for (std::size_t reader = 0; reader < Shared::kReaderSlots; ++reader) {
+            const pid_t pid = ::fork();
+            if (pid == 0) {
+                tree.scan(0, 100, [](int, int) { ::_exit(0); });
+                ::_exit(1);
+            }
+            ::waitpid(pid, nullptr, 0);
+        }
+        std::size_t count = 0;
+        tree.scan(0, 100, [&](int key, int value) { count += key == value; });
+        CHECK_EQ(count, std::size_t{100});
+        CHECK_EQ(tree.find(42).value_or(-1), 42);
+    }
+    Shared::remove(name);
+}
+
+void testWorkStealingScheduler() {
+    test::TestScope scope("work_stealing_scheduler");
+
+    // Every index runs exactly once, also when the pool is larger than the machine.
+    detail::WorkStealingScheduler scheduler(4);
+    CHECK_EQ(scheduler.worker_count(), 4u);
+    constexpr std::size_t kCount = 10'000;
+    std::vector<std::atomic<int>> hits(kCount);
+    scheduler.parallel_for(0, kCount, 16, [&](std::size_t i) { hits[i].fetch_add(1); });
+    bool once = true;
+    for (const auto& hit : hits) once = once && hit.load() == 1;
+    CHECK_TRUE(once);
+    scheduler.parallel_for(5, 5, 1, [&](std::size_t) { once = false; });
+    CHECK_TRUE(once);
+
+    // Nested loops run on the caller's worker and can be stolen from there.
+    std::atomic<std::uint64_t> sum{0};
+    scheduler.parallel_for(0, 64, 1, [&](std::size_t outer) {
+        scheduler.parallel_for(0, 100, 8, [&](std::size_t inner) { sum.fetch_add(outer * 100 + inner); });
+    });
+    CHECK_EQ(sum.load(), std::uint64_t{6'400} * 6'399 / 2);
+
+    // The first exception is rethrown on the caller and the scheduler stays usable.
+    bool threw = false;
+    try {
+        scheduler.parallel_for(0, kCount, 1, [](std::size_t i) {
+            if (i == 777) throw std::runtime_error("task failed");
+        });
+    } catch (const std::runtime_error&) {
+        threw = true;
+    }
+    CHECK_TRUE(threw);
+    std::atomic<int> after{0};
+    detail::WorkStealingScheduler::instance().parallel_for(0, 100, 1, [&](std::size_t) { ++after; });
+    scheduler.parallel_for(0, 100, 1, [&](std::size_t) { ++after; });
+    CHECK_EQ(after.load(), 200);
+
+    // A concurrency cap bounds the calls in flight; a cap of 1 runs them in order on the caller.
+    std::atomic<int> running{0};
+    std::atomic<int> peak{0};
+    std::vector<std::atomic<int>> capped(kCount);
+    scheduler.parallel_for(0, kCount, 4, 2, [&](std::size_t i) {
+        const int now = running.fetch_add(1) + 1;
+        int seen = peak.load();
+        while (now > seen && !peak.compare_exchange_weak(seen, now)) {
+        }
+        capped[i].fetch_add(1);
+        running.fetch_sub(1);
+    });
+    once = true;
+    for (const auto& hit : capped) once = once && hit.load() == 1;
+    CHECK_TRUE(once);
+    CHECK_TRUE(peak.load() <= 2);
+    std::vector<std::size_t> serial;
+    scheduler.parallel_for(0, 100, 1, 1, [&](std::size_t i) { serial.push_back(i); });
+    CHECK_EQ(serial.size(), 100u);
+    CHECK_TRUE(std::is_sorted(serial.begin(), serial.end()));
+
+    // parallel_scan(threads = 1) never calls fn concurrently.
+    BPlusTree<int, int, 8> tree;
+    for (int i = 0; i < 20'000; ++i) tree.insert(i, i);
+    running = 0;
+    peak = 0;
+    tree.parallel_scan(0, 20'000, [&](int, int) {
+        peak = std::max(peak.load(), running.fetch_add(1) + 1);
+        running.fetch_sub(1);
+    }, 1);
+    CHECK_EQ(peak.load(), 1);
+}
+
 int main() {
     testBasicInsertFind();
     testOverwriteValue();
@@ -322,5 +2259,32 @@ int main() {
     testRandomBulkInsert();
     testInterleavedInsertFind();
     testHashTableTenThousandEntries();
+    testMoveAwareInsertion();
+    testTriviallyCopyableNodes();
+    testGappedLeafLayout();
+    testAppendLeafLayout();
+    testRedistributeOnOverflow();
+    testEraseAndCompact();
+    testMemoryBudget();
+    testHugePageArena();
+    testCompressedNodeReferences();
+    testConcurrentScan();
+    testParallelScan();
+    testWorkStealingScheduler();
+    testFindBatch();
+    testSplitAndJoin();
+    testMergeFrom();
+    testEraseRange();
+    testSnapshot();
+    testFrozenLeaves();
+    testInternedValues();
+    testInsertBatch();
+    testKeyValueServer();
+    testChangeHook();
+    testWriteBatch();
+    testTransactions();
+    testCursor();
+    testReplication();
+    testSharedTree();
     return ::test::finalize();
 }